@@ -3,7 +3,29 @@
 #include <string.h>
 #include <stdio.h>
 #include "devices/ide.h"
+#include "devices/timer.h"
 #include "threads/malloc.h"
+#include "threads/palloc.h"
+#include "threads/synch.h"
+#include "threads/thread.h"
+#include "threads/vaddr.h"
+
+/* Most sectors in a transfer made by merging requests. */
+#define MERGE_MAX_SECTORS 256
+
+/* Most sectors in a merged transfer whose requests' buffers are
+   not contiguous in memory.  Such a transfer goes through a
+   one-page bounce buffer. */
+#define BOUNCE_SECTORS (PGSIZE / BLOCK_SECTOR_SIZE)
+
+/* Number of buckets in a histogram.  Bucket 0 counts zeros,
+   bucket I counts values from 2**(I-1) to 2**I - 1, and the last
+   bucket also counts everything larger. */
+#define HIST_BUCKETS 20
+
+/* Length of the window over which throughput is measured, in
+   seconds. */
+#define WINDOW_SECS 10
 
 /* A block device. */
 struct block {
@@ -18,6 +40,33 @@ struct block {
 
   unsigned long long read_cnt;  /* Number of sectors read. */
   unsigned long long write_cnt; /* Number of sectors written. */
+
+  /* Request queue. */
+  struct lock queue_lock;      /* Protects the queue members. */
+  struct condition queue_cond; /* Signaled when a request is queued. */
+  struct list queue;           /* Pending requests, in ascending sector order. */
+  size_t queue_len;            /* Number of requests in queue. */
+  block_sector_t head;         /* Sector after the last one transferred. */
+  bool worker_started;         /* Has the queue's thread been created? */
+  uint8_t* bounce;             /* Bounce buffer, or null. Used by queue's thread only. */
+
+  /* Queue statistics, protected by queue_lock. */
+  unsigned long long request_cnt;              /* Requests submitted. */
+  unsigned long long dispatch_cnt;             /* Transfers made. */
+  unsigned long long depth_hist[HIST_BUCKETS]; /* Queue length after each submission. */
+  unsigned long long wait_hist[HIST_BUCKETS];  /* Microseconds from submission to dispatch. */
+  unsigned long long seq_cnt;                  /* Requests that began where the last ended. */
+  unsigned long long random_cnt;               /* Other requests. */
+
+  /* Completion statistics.  Written only by the queue's thread,
+     so recording them takes no locks, except that a device whose
+     driver has a map operation has no queue thread and records
+     them under queue_lock. */
+  unsigned long long latency_hist[2][HIST_BUCKETS]; /* Microseconds from submission to
+                                                       completion, for reads and writes. */
+  int64_t window_sec[WINDOW_SECS];                  /* Second that each slot counts. */
+  unsigned long long window_bytes[WINDOW_SECS];     /* Bytes transferred in that second. */
+  unsigned long long peak_bytes;                    /* Most bytes in any one second. */
 };
 
 /* List of all block devices. */
@@ -27,6 +76,12 @@ static struct list all_blocks = LIST_INITIALIZER(all_blocks);
 static struct block* block_by_role[BLOCK_ROLE_CNT];
 
 static struct block* list_elem_to_block(struct list_elem*);
+static thread_func block_worker;
+static void transfer_sync(struct block*, block_sector_t, block_sector_t cnt, void*, bool write);
+static int hist_bucket(unsigned long long);
+static void print_hist(const char* name, const unsigned long long hist[HIST_BUCKETS]);
+static void count_bytes(struct block*, int64_t now, unsigned long long bytes);
+static void map_transfer(struct block*, struct block_request*);
 
 /* Returns a human-readable name for the given block device
    TYPE. */
@@ -78,15 +133,16 @@ struct block* block_get_by_name(const char* name) {
   return NULL;
 }
 
-/* Verifies that SECTOR is a valid offset within BLOCK.
-   Panics if not. */
-static void check_sector(struct block* block, block_sector_t sector) {
-  if (sector >= block->size) {
+/* Verifies that the CNT sectors starting at SECTOR lie within
+   BLOCK.  Panics if not. */
+static void check_sectors(struct block* block, block_sector_t sector, block_sector_t cnt) {
+  ASSERT(cnt > 0);
+  if (sector >= block->size || cnt > block->size - sector) {
     /* We do not use ASSERT because we want to panic here
          regardless of whether NDEBUG is defined. */
-    PANIC("Access past end of device %s (sector=%" PRDSNu ", "
+    PANIC("Access past end of device %s (sectors=%" PRDSNu "+%" PRDSNu ", "
           "size=%" PRDSNu ")\n",
-          block_name(block), sector, block->size);
+          block_name(block), sector, cnt, block->size);
   }
 }
 
@@ -95,9 +151,7 @@ static void check_sector(struct block* block, block_sector_t sector) {
    Internally synchronizes accesses to block devices, so external
    per-block device locking is unneeded. */
 void block_read(struct block* block, block_sector_t sector, void* buffer) {
-  check_sector(block, sector);
-  block->ops->read(block->aux, sector, buffer);
-  block->read_cnt++;
+  transfer_sync(block, sector, 1, buffer, false);
 }
 
 /* Write sector SECTOR to BLOCK from BUFFER, which must contain
@@ -106,10 +160,307 @@ void block_read(struct block* block, block_sector_t sector, void* buffer) {
    Internally synchronizes accesses to block devices, so external
    per-block device locking is unneeded. */
 void block_write(struct block* block, block_sector_t sector, const void* buffer) {
-  check_sector(block, sector);
-  ASSERT(block->type != BLOCK_FOREIGN);
-  block->ops->write(block->aux, sector, buffer);
-  block->write_cnt++;
+  transfer_sync(block, sector, 1, (void*)buffer, true);
+}
+
+/* Reads the CNT sectors starting at SECTOR from BLOCK into
+   BUFFER, which must have room for CNT * BLOCK_SECTOR_SIZE bytes.
+   Drivers that support it transfer the whole range with as few
+   commands as possible.
+   Internally synchronizes accesses to block devices, so external
+   per-block device locking is unneeded. */
+void block_read_multiple(struct block* block, block_sector_t sector, block_sector_t cnt,
+                         void* buffer) {
+  transfer_sync(block, sector, cnt, buffer, false);
+}
+
+/* Writes the CNT sectors starting at SECTOR to BLOCK from
+   BUFFER, which must contain CNT * BLOCK_SECTOR_SIZE bytes.
+   Returns after the block device has acknowledged receiving the
+   data.  Drivers that support it transfer the whole range with
+   as few commands as possible.
+   Internally synchronizes accesses to block devices, so external
+   per-block device locking is unneeded. */
+void block_write_multiple(struct block* block, block_sector_t sector, block_sector_t cnt,
+                          const void* buffer) {
+  transfer_sync(block, sector, cnt, (void*)buffer, true);
+}
+
+/* Wakes up the thread waiting in transfer_sync() for R. */
+static void wake_up(struct block_request* r) { sema_up(r->aux); }
+
+/* Submits a request to transfer the CNT sectors starting at
+   SECTOR between BLOCK and BUFFER, as described for
+   block_request_init(), and waits for it to complete. */
+static void transfer_sync(struct block* block, block_sector_t sector, block_sector_t cnt,
+                          void* buffer, bool write) {
+  struct block_request r;
+  struct semaphore done;
+
+  sema_init(&done, 0);
+  block_request_init(&r, sector, cnt, buffer, write, wake_up, &done);
+  block_submit(block, &r);
+  sema_down(&done);
+}
+
+/* Initializes R as a request to transfer the CNT sectors
+   starting at SECTOR between a device and BUFFER: to the device
+   if WRITE is true, from it otherwise.  CALLBACK, if non-null,
+   is called with R when the transfer is complete, and may use
+   AUX as it likes. */
+void block_request_init(struct block_request* r, block_sector_t sector, block_sector_t cnt,
+                        void* buffer, bool write, block_callback_func* callback, void* aux) {
+  r->sector = sector;
+  r->cnt = cnt;
+  r->buffer = buffer;
+  r->write = write;
+  r->callback = callback;
+  r->aux = aux;
+}
+
+/* Returns true if request A starts before request B. */
+static bool request_less(const struct list_elem* a_, const struct list_elem* b_,
+                         void* aux UNUSED) {
+  const struct block_request* a = list_entry(a_, struct block_request, elem);
+  const struct block_request* b = list_entry(b_, struct block_request, elem);
+
+  return a->sector < b->sector;
+}
+
+/* Queues R, which must have been initialized with
+   block_request_init(), for BLOCK and returns without waiting
+   for it to be carried out.  R and its buffer must stay in place
+   until it completes. */
+void block_submit(struct block* block, struct block_request* r) {
+  check_sectors(block, r->sector, r->cnt);
+  ASSERT(!r->write || block->type != BLOCK_FOREIGN);
+
+  r->submit_time = timer_ns();
+  if (block->ops->map != NULL) {
+    map_transfer(block, r);
+    return;
+  }
+
+  lock_acquire(&block->queue_lock);
+  if (!block->worker_started) {
+    /* Every thread doing I/O waits on the worker, so it runs at
+       the highest priority lest a middling thread starve it and
+       with it a high-priority waiter. */
+    block->worker_started = true;
+    if (thread_create(block->name, PRI_MAX, block_worker, block) == TID_ERROR)
+      PANIC("can't create thread for block device %s", block->name);
+  }
+  list_insert_ordered(&block->queue, &r->elem, request_less, NULL);
+  block->queue_len++;
+  block->request_cnt++;
+  block->depth_hist[hist_bucket(block->queue_len)]++;
+  cond_signal(&block->queue_cond, &block->queue_lock);
+  lock_release(&block->queue_lock);
+}
+
+/* Moves the next requests in C-SCAN order from BLOCK's queue to
+   BATCH: the first one that starts at or after BLOCK->head, or
+   the first in the queue if there is none, followed by those
+   that continue it on the device in the same direction, as long
+   as they fit in a single transfer.  Returns true if the
+   requests' buffers are contiguous in memory, false if the
+   transfer must use BLOCK's bounce buffer.
+   BLOCK's queue lock must be held. */
+static bool take_batch(struct block* block, struct list* batch) {
+  struct block_request *first, *last;
+  struct list_elem* e;
+  int64_t now = timer_ns();
+  block_sector_t cnt = 0;
+  bool contiguous = true;
+
+  ASSERT(!list_empty(&block->queue));
+
+  for (e = list_begin(&block->queue); e != list_end(&block->queue); e = list_next(e))
+    if (list_entry(e, struct block_request, elem)->sector >= block->head)
+      break;
+  if (e == list_end(&block->queue))
+    e = list_begin(&block->queue);
+
+  first = last = list_entry(e, struct block_request, elem);
+  while (e != list_end(&block->queue)) {
+    struct block_request* r = list_entry(e, struct block_request, elem);
+    struct list_elem* next = list_next(e);
+
+    if (r != first) {
+      bool adjacent = (uint8_t*)last->buffer + last->cnt * BLOCK_SECTOR_SIZE == r->buffer;
+
+      if (r->sector != first->sector + cnt || r->write != first->write ||
+          cnt + r->cnt > MERGE_MAX_SECTORS)
+        break;
+      if ((!contiguous || !adjacent) &&
+          (block->bounce == NULL || cnt + r->cnt > BOUNCE_SECTORS))
+        break;
+      contiguous = contiguous && adjacent;
+    }
+
+    list_remove(e);
+    list_push_back(batch, e);
+    block->queue_len--;
+    block->wait_hist[hist_bucket((now - r->submit_time) / 1000)]++;
+    if (r != first || r->sector == block->head)
+      block->seq_cnt++;
+    else
+      block->random_cnt++;
+    cnt += r->cnt;
+    last = r;
+    e = next;
+  }
+  block->head = first->sector + cnt;
+  block->dispatch_cnt++;
+  return contiguous;
+}
+
+/* Transfers the CNT sectors starting at SECTOR between BLOCK and
+   BUFFER through BLOCK's driver, writing them if WRITE is true
+   and reading them otherwise. */
+static void transfer(struct block* block, block_sector_t sector, block_sector_t cnt,
+                     uint8_t* buffer, bool write) {
+  block_sector_t i;
+
+  if (write) {
+    if (block->ops->write_multiple != NULL)
+      block->ops->write_multiple(block->aux, sector, cnt, buffer);
+    else
+      for (i = 0; i < cnt; i++)
+        block->ops->write(block->aux, sector + i, buffer + i * BLOCK_SECTOR_SIZE);
+    block->write_cnt += cnt;
+  } else {
+    if (block->ops->read_multiple != NULL)
+      block->ops->read_multiple(block->aux, sector, cnt, buffer);
+    else
+      for (i = 0; i < cnt; i++)
+        block->ops->read(block->aux, sector + i, buffer + i * BLOCK_SECTOR_SIZE);
+    block->read_cnt += cnt;
+  }
+}
+
+/* Carries out the requests in BATCH, chosen by take_batch(), as
+   a single transfer, and completes them.  If CONTIGUOUS is
+   false, the data goes through BLOCK's bounce buffer. */
+static void dispatch(struct block* block, struct list* batch, bool contiguous) {
+  struct block_request* first = list_entry(list_front(batch), struct block_request, elem);
+  struct block_request* last = list_entry(list_back(batch), struct block_request, elem);
+  block_sector_t cnt = last->sector + last->cnt - first->sector;
+  uint8_t* buffer = contiguous ? first->buffer : block->bounce;
+  bool write = first->write;
+  struct list_elem* e;
+  int64_t now;
+
+  if (!contiguous && write)
+    for (e = list_begin(batch); e != list_end(batch); e = list_next(e)) {
+      struct block_request* r = list_entry(e, struct block_request, elem);
+      memcpy(buffer + (r->sector - first->sector) * BLOCK_SECTOR_SIZE, r->buffer,
+             r->cnt * BLOCK_SECTOR_SIZE);
+    }
+
+  transfer(block, first->sector, cnt, buffer, write);
+  now = timer_ns();
+  count_bytes(block, now, (unsigned long long)cnt * BLOCK_SECTOR_SIZE);
+
+  while (!list_empty(batch)) {
+    struct block_request* r = list_entry(list_pop_front(batch), struct block_request, elem);
+    block->latency_hist[write][hist_bucket((now - r->submit_time) / 1000)]++;
+    if (!contiguous && !write)
+      memcpy(r->buffer, buffer + (r->sector - first->sector) * BLOCK_SECTOR_SIZE,
+             r->cnt * BLOCK_SECTOR_SIZE);
+    if (r->callback != NULL)
+      r->callback(r);
+  }
+}
+
+/* Carries out R on BLOCK, whose driver maps its sectors into
+   memory, and completes it, all in the caller's thread.  Each
+   sector is copied once, with memcpy(), between R's buffer and
+   the driver's memory.  The copies are made under BLOCK's queue
+   lock, which also covers the statistics, so concurrent requests
+   to BLOCK are serialized.  There is no queue, bounce buffer, or
+   context switch, but the copy itself remains. */
+static void map_transfer(struct block* block, struct block_request* r) {
+  uint8_t* buffer = r->buffer;
+  block_sector_t i;
+  int64_t now;
+
+  lock_acquire(&block->queue_lock);
+  for (i = 0; i < r->cnt; i++) {
+    void* data = block->ops->map(block->aux, r->sector + i);
+    if (r->write)
+      memcpy(data, buffer + i * BLOCK_SECTOR_SIZE, BLOCK_SECTOR_SIZE);
+    else
+      memcpy(buffer + i * BLOCK_SECTOR_SIZE, data, BLOCK_SECTOR_SIZE);
+  }
+
+  if (r->write)
+    block->write_cnt += r->cnt;
+  else
+    block->read_cnt += r->cnt;
+  block->request_cnt++;
+  block->dispatch_cnt++;
+  if (r->sector == block->head)
+    block->seq_cnt++;
+  else
+    block->random_cnt++;
+  block->head = r->sector + r->cnt;
+  now = timer_ns();
+  count_bytes(block, now, (unsigned long long)r->cnt * BLOCK_SECTOR_SIZE);
+  block->latency_hist[r->write][hist_bucket((now - r->submit_time) / 1000)]++;
+  lock_release(&block->queue_lock);
+
+  if (r->callback != NULL)
+    r->callback(r);
+}
+
+/* Adds BYTES, transferred by BLOCK at time NOW, to BLOCK's
+   throughput window. */
+static void count_bytes(struct block* block, int64_t now, unsigned long long bytes) {
+  int64_t sec = now / (1000 * 1000 * 1000);
+  int slot = sec % WINDOW_SECS;
+
+  if (block->window_sec[slot] != sec) {
+    block->window_sec[slot] = sec;
+    block->window_bytes[slot] = 0;
+  }
+  block->window_bytes[slot] += bytes;
+  if (block->window_bytes[slot] > block->peak_bytes)
+    block->peak_bytes = block->window_bytes[slot];
+}
+
+/* Returns the bytes per second that BLOCK transferred over the
+   last WINDOW_SECS seconds. */
+static unsigned long long window_rate(struct block* block) {
+  int64_t sec = timer_ns() / (1000 * 1000 * 1000);
+  unsigned long long bytes = 0;
+  int i;
+
+  for (i = 0; i < WINDOW_SECS; i++)
+    if (block->window_sec[i] > sec - WINDOW_SECS)
+      bytes += block->window_bytes[i];
+  return bytes / WINDOW_SECS;
+}
+
+/* Thread function that serves the request queue of BLOCK_, a
+   struct block, forever. */
+static void block_worker(void* block_) {
+  struct block* block = block_;
+  struct list batch;
+
+  block->bounce = palloc_get_page(0);
+  list_init(&batch);
+  for (;;) {
+    bool contiguous;
+
+    lock_acquire(&block->queue_lock);
+    while (list_empty(&block->queue))
+      cond_wait(&block->queue_cond, &block->queue_lock);
+    contiguous = take_batch(block, &batch);
+    lock_release(&block->queue_lock);
+
+    dispatch(block, &batch, contiguous);
+  }
 }
 
 /* Returns the number of sectors in BLOCK. */
@@ -130,10 +481,55 @@ void block_print_stats(void) {
     if (block != NULL) {
       printf("%s (%s): %llu reads, %llu writes\n", block->name, block_type_name(block->type),
              block->read_cnt, block->write_cnt);
+      printf("%s: %llu requests in %llu transfers, %llu sequential, %llu random\n",
+             block->name, block->request_cnt, block->dispatch_cnt, block->seq_cnt,
+             block->random_cnt);
+      printf("%s: %'llu bytes/s over the last %d s, peak %'llu bytes/s\n", block->name,
+             window_rate(block), WINDOW_SECS, block->peak_bytes);
+      print_hist("queue length", block->depth_hist);
+      print_hist("queue wait (us)", block->wait_hist);
+      print_hist("read latency (us)", block->latency_hist[0]);
+      print_hist("write latency (us)", block->latency_hist[1]);
     }
   }
 }
 
+/* Returns the histogram bucket for VALUE. */
+static int hist_bucket(unsigned long long value) {
+  int bucket = 0;
+
+  while (value > 0 && bucket < HIST_BUCKETS - 1) {
+    value >>= 1;
+    bucket++;
+  }
+  return bucket;
+}
+
+/* Prints the nonempty buckets of histogram HIST under NAME.
+   Prints nothing if HIST is empty. */
+static void print_hist(const char* name, const unsigned long long hist[HIST_BUCKETS]) {
+  int i;
+
+  for (i = 0; i < HIST_BUCKETS; i++)
+    if (hist[i] != 0)
+      break;
+  if (i == HIST_BUCKETS)
+    return;
+
+  printf("  %s:", name);
+  for (i = 0; i < HIST_BUCKETS; i++) {
+    if (hist[i] == 0)
+      continue;
+    if (i <= 1)
+      printf(" %d:%llu", i, hist[i]);
+    else if (i == HIST_BUCKETS - 1)
+      printf(" %llu+:%llu", 1ULL << (i - 1), hist[i]);
+    else
+      printf(" %llu-%llu:%llu", 1ULL << (i - 1), (1ULL << i) - 1, hist[i]);
+  }
+  printf("\n");
+}
+
 /* Registers a new block device with the given NAME.  If
    EXTRA_INFO is non-null, it is printed as part of a user
    message.  The block device's SIZE in sectors and its TYPE must
@@ -142,6 +538,8 @@ void block_print_stats(void) {
 struct block* block_register(const char* name, enum block_type type, const char* extra_info,
                              block_sector_t size, const struct block_operations* ops, void* aux) {
   struct block* block = malloc(sizeof *block);
+  int i;
+
   if (block == NULL)
     PANIC("Failed to allocate memory for block device descriptor");
 
@@ -154,6 +552,26 @@ struct block* block_register(const char* name, enum block_type type, const char*
   block->read_cnt = 0;
   block->write_cnt = 0;
 
+  lock_init(&block->queue_lock);
+  cond_init(&block->queue_cond);
+  list_init(&block->queue);
+  block->queue_len = 0;
+  block->head = 0;
+  block->worker_started = false;
+  block->bounce = NULL;
+  block->request_cnt = 0;
+  block->dispatch_cnt = 0;
+  memset(block->depth_hist, 0, sizeof block->depth_hist);
+  memset(block->wait_hist, 0, sizeof block->wait_hist);
+  block->seq_cnt = 0;
+  block->random_cnt = 0;
+  memset(block->latency_hist, 0, sizeof block->latency_hist);
+  for (i = 0; i < WINDOW_SECS; i++) {
+    block->window_sec[i] = -1;
+    block->window_bytes[i] = 0;
+  }
+  block->peak_bytes = 0;
+
   printf("%s: %'" PRDSNu " sectors (", block->name, block->size);
   print_human_readable_size((uint64_t)block->size * BLOCK_SECTOR_SIZE);
   printf(")");
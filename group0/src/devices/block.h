@@ -2,7 +2,9 @@
 #define DEVICES_BLOCK_H
 
 #include <stddef.h>
+#include <stdbool.h>
 #include <inttypes.h>
+#include <list.h>
 
 /* Size of a block device sector in bytes.
    All IDE disks use this sector size, as do most USB and SCSI
@@ -52,17 +54,60 @@ struct block* block_next(struct block*);
 block_sector_t block_size(struct block*);
 void block_read(struct block*, block_sector_t, void*);
 void block_write(struct block*, block_sector_t, const void*);
+void block_read_multiple(struct block*, block_sector_t, block_sector_t cnt, void*);
+void block_write_multiple(struct block*, block_sector_t, block_sector_t cnt, const void*);
 const char* block_name(struct block*);
 enum block_type block_type(struct block*);
 
+/* Asynchronous block requests.
+
+   A request is queued on its device and carried out later by a
+   kernel thread that serves the device's queue in C-SCAN order,
+   merging requests for adjacent sectors into single transfers.
+   The request's CALLBACK, if any, is then called from that
+   thread, so it must not sleep waiting for more I/O on the same
+   device.  Requests to a device whose driver maps its sectors
+   into memory are instead carried out, and their callbacks
+   called, before block_submit() returns.  Requests whose sectors overlap may complete in any
+   order. */
+struct block_request;
+typedef void block_callback_func(struct block_request*);
+
+struct block_request {
+  block_sector_t sector;         /* First sector. */
+  block_sector_t cnt;            /* Number of sectors. */
+  void* buffer;                  /* CNT * BLOCK_SECTOR_SIZE bytes. */
+  bool write;                    /* Write to the device, or read from it? */
+  block_callback_func* callback; /* Called on completion, or null. */
+  void* aux;                     /* For the callback's use. */
+
+  /* Owned by the block layer while the request is pending. */
+  struct list_elem elem; /* Element in the device's queue. */
+  int64_t submit_time;   /* timer_ns() at submission. */
+};
+
+void block_request_init(struct block_request*, block_sector_t, block_sector_t cnt, void* buffer,
+                        bool write, block_callback_func*, void* aux);
+void block_submit(struct block*, struct block_request*);
+
 /* Statistics. */
 void block_print_stats(void);
 
 /* Lower-level interface to block device drivers. */
 
+/* Driver operations.  READ_MULTIPLE and WRITE_MULTIPLE transfer
+   CNT consecutive sectors; a driver that leaves them null gets
+   one READ or WRITE call per sector instead.  A driver whose
+   sectors are in memory may provide MAP, which returns the
+   address of a sector's data.  The block layer then carries out
+   requests in the caller's thread by copying each sector once
+   to or from that address, instead of queuing them. */
 struct block_operations {
   void (*read)(void* aux, block_sector_t, void* buffer);
   void (*write)(void* aux, block_sector_t, const void* buffer);
+  void (*read_multiple)(void* aux, block_sector_t, block_sector_t cnt, void* buffer);
+  void (*write_multiple)(void* aux, block_sector_t, block_sector_t cnt, const void* buffer);
+  void* (*map)(void* aux, block_sector_t);
 };
 
 struct block* block_register(const char* name, enum block_type, const char* extra_info,
@@ -8,10 +8,16 @@
 #include "devices/timer.h"
 #include "threads/io.h"
 #include "threads/interrupt.h"
+#include "threads/palloc.h"
 #include "threads/synch.h"
+#include "threads/vaddr.h"
 
 /* The code in this file is an interface to an ATA (IDE)
-   controller.  It attempts to comply to [ATA-3]. */
+   controller.  It attempts to comply to [ATA-3].  If the
+   controller supports PCI bus-master DMA [SFF-8038i], as the
+   PIIX controller emulated by QEMU and Bochs does, data moves by
+   DMA; otherwise, and for disks that cannot do DMA, it moves by
+   PIO. */
 
 /* ATA command block port addresses. */
 #define reg_data(CHANNEL) ((CHANNEL)->reg_base + 0)   /* Data. */
@@ -30,10 +36,26 @@
 #define reg_ctl(CHANNEL) ((CHANNEL)->reg_base + 0x206) /* Control (w/o). */
 #define reg_alt_status(CHANNEL) reg_ctl(CHANNEL)       /* Alt Status (r/o). */
 
+/* Bus master port addresses.
+   Only valid if the channel's bm_base is nonzero. */
+#define reg_bm_command(CHANNEL) ((CHANNEL)->bm_base + 0) /* Command. */
+#define reg_bm_status(CHANNEL) ((CHANNEL)->bm_base + 2)  /* Status. */
+#define reg_bm_prdt(CHANNEL) ((CHANNEL)->bm_base + 4)    /* PRD Table Address. */
+
+/* Bus Master Command Register bits. */
+#define BM_CMD_START 0x01 /* Start transfer. */
+#define BM_CMD_READ 0x08  /* Transfer from disk to memory. */
+
+/* Bus Master Status Register bits.
+   Writing 1 to BM_STA_ERR or BM_STA_INTR clears it. */
+#define BM_STA_ERR 0x02  /* Error. */
+#define BM_STA_INTR 0x04 /* Interrupt. */
+
 /* Alternate Status Register bits. */
 #define STA_BSY 0x80  /* Busy. */
 #define STA_DRDY 0x40 /* Device Ready. */
 #define STA_DRQ 0x08  /* Data Request. */
+#define STA_ERR 0x01  /* Error. */
 
 /* Control Register bits. */
 #define CTL_SRST 0x04 /* Software Reset. */
@@ -49,6 +71,30 @@
 #define CMD_IDENTIFY_DEVICE 0xec    /* IDENTIFY DEVICE. */
 #define CMD_READ_SECTOR_RETRY 0x20  /* READ SECTOR with retries. */
 #define CMD_WRITE_SECTOR_RETRY 0x30 /* WRITE SECTOR with retries. */
+#define CMD_READ_MULTIPLE 0xc4      /* READ MULTIPLE. */
+#define CMD_WRITE_MULTIPLE 0xc5     /* WRITE MULTIPLE. */
+#define CMD_SET_MULTIPLE_MODE 0xc6  /* SET MULTIPLE MODE. */
+#define CMD_READ_DMA_RETRY 0xc8     /* READ DMA with retries. */
+#define CMD_WRITE_DMA_RETRY 0xca    /* WRITE DMA with retries. */
+
+/* Most sectors a single read or write command can transfer. */
+#define MAX_COMMAND_SECTORS 256
+
+/* A Physical Region Descriptor: one entry in the table that
+   tells the bus master which memory a DMA transfer uses.  A
+   region must not cross a 64 kB boundary, so we use one entry
+   per page. */
+struct prd {
+  uint32_t addr;  /* Physical address, must be even. */
+  uint16_t size;  /* Size in bytes, with 0 meaning 64 kB. */
+  uint16_t flags; /* PRD_EOT in the last entry. */
+};
+
+#define PRD_EOT 0x8000 /* End of table. */
+
+/* Most PRD entries a command needs: one per page of the largest
+   transfer, plus one for an unaligned start. */
+#define PRD_CNT (MAX_COMMAND_SECTORS * BLOCK_SECTOR_SIZE / PGSIZE + 1)
 
 /* An ATA device. */
 struct ata_disk {
@@ -56,6 +102,9 @@ struct ata_disk {
   struct channel* channel; /* Channel that disk is attached to. */
   int dev_no;              /* Device 0 or 1 for master or slave. */
   bool is_ata;             /* Is device an ATA disk? */
+  int multiple;            /* Sectors per interrupt in READ/WRITE MULTIPLE,
+                              or 1 to use READ/WRITE SECTOR instead. */
+  bool dma;                /* Transfer data by bus-master DMA? */
 };
 
 /* An ATA channel (aka controller).
@@ -64,6 +113,8 @@ struct channel {
   char name[8];      /* Name, e.g. "ide0". */
   uint16_t reg_base; /* Base I/O port. */
   uint8_t irq;       /* Interrupt in use. */
+  uint16_t bm_base;  /* Bus master base I/O port, or 0 if none. */
+  struct prd* prdt;  /* PRD table, if bm_base is nonzero. */
 
   struct lock lock;                 /* Must acquire to access the controller. */
   bool expecting_interrupt;         /* True if an interrupt is expected, false if
@@ -79,11 +130,17 @@ static struct channel channels[CHANNEL_CNT];
 
 static struct block_operations ide_operations;
 
+static uint16_t find_bus_master(void);
 static void reset_channel(struct channel*);
 static bool check_device_type(struct ata_disk*);
 static void identify_ata_device(struct ata_disk*);
 
-static void select_sector(struct ata_disk*, block_sector_t);
+static void set_multiple_mode(struct ata_disk*, int cnt);
+static void select_sector(struct ata_disk*, block_sector_t, int cnt);
+static void pio_read(struct ata_disk*, block_sector_t, int cnt, uint8_t*);
+static void pio_write(struct ata_disk*, block_sector_t, int cnt, const uint8_t*);
+static bool dma_transfer(struct ata_disk*, block_sector_t, int cnt, void*, bool write);
+static void build_prdt(struct channel*, const void*, size_t size);
 static void issue_pio_command(struct channel*, uint8_t command);
 static void input_sector(struct channel*, void*);
 static void output_sector(struct channel*, const void*);
@@ -97,6 +154,7 @@ static void interrupt_handler(struct intr_frame*);
 
 /* Initialize the disk subsystem and detect disks. */
 void ide_init(void) {
+  uint16_t bm_base = find_bus_master();
   size_t chan_no;
 
   for (chan_no = 0; chan_no < CHANNEL_CNT; chan_no++) {
@@ -117,6 +175,13 @@ void ide_init(void) {
       default:
         NOT_REACHED();
     }
+    c->bm_base = bm_base != 0 ? bm_base + chan_no * 8 : 0;
+    c->prdt = NULL;
+    if (c->bm_base != 0) {
+      c->prdt = palloc_get_page(0);
+      if (c->prdt == NULL)
+        c->bm_base = 0;
+    }
     lock_init(&c->lock);
     c->expecting_interrupt = false;
     sema_init(&c->completion_wait, 0);
@@ -128,6 +193,8 @@ void ide_init(void) {
       d->channel = c;
       d->dev_no = dev_no;
       d->is_ata = false;
+      d->multiple = 1;
+      d->dma = false;
     }
 
     /* Register interrupt handler. */
@@ -151,6 +218,56 @@ void ide_init(void) {
 
 static char* descramble_ata_string(char*, int size);
 
+/* PCI configuration space registers.  We only touch PCI to find
+   the IDE controller's bus master ports. */
+#define PCI_CONFIG_ADDRESS 0xcf8 /* Configuration address port. */
+#define PCI_CONFIG_DATA 0xcfc    /* Configuration data port. */
+#define PCI_REG_COMMAND 0x04     /* Command (low 16 bits). */
+#define PCI_REG_CLASS 0x08       /* Class, subclass, prog-if, revision. */
+#define PCI_REG_BAR4 0x20        /* Base address register 4. */
+#define PCI_CMD_IO 0x0001        /* Command: decode I/O space. */
+#define PCI_CMD_MASTER 0x0004    /* Command: allow bus mastering. */
+
+/* Selects register REG of PCI device DEV, function FUNC, on bus
+   0, for access through PCI_CONFIG_DATA. */
+static void pci_select(int dev, int func, int reg) {
+  outl(PCI_CONFIG_ADDRESS, 0x80000000 | (dev << 11) | (func << 8) | reg);
+}
+
+/* Looks on PCI bus 0 for an IDE controller that supports bus
+   mastering and uses the legacy ports for both channels, which
+   are the only ones we drive.  If one is found, enables bus
+   mastering on it and returns the base of its bus master ports,
+   with the secondary channel's 8 ports after the primary's.
+   Otherwise, returns 0. */
+static uint16_t find_bus_master(void) {
+  int dev, func;
+
+  for (dev = 0; dev < 32; dev++)
+    for (func = 0; func < 8; func++) {
+      uint32_t class, bar;
+
+      /* Class 1, subclass 1 is IDE.  Programming interface bit
+         7 means bus master, bits 0 and 2 native (non-legacy)
+         mode.  A missing device reads as all 1s. */
+      pci_select(dev, func, PCI_REG_CLASS);
+      class = inl(PCI_CONFIG_DATA);
+      if ((class >> 16) != 0x0101 || (class & 0x8500) != 0x8000)
+        continue;
+
+      /* Bit 0 set means the BAR is in I/O space. */
+      pci_select(dev, func, PCI_REG_BAR4);
+      bar = inl(PCI_CONFIG_DATA);
+      if ((bar & 1) == 0 || (bar & 0xfffc) == 0)
+        continue;
+
+      pci_select(dev, func, PCI_REG_COMMAND);
+      outl(PCI_CONFIG_DATA, (inl(PCI_CONFIG_DATA) & 0xffff) | PCI_CMD_IO | PCI_CMD_MASTER);
+      return bar & 0xfffc;
+    }
+  return 0;
+}
+
 /* Resets an ATA channel and waits for any devices present on it
    to finish the reset. */
 static void reset_channel(struct channel* c) {
@@ -262,7 +379,9 @@ static void identify_ata_device(struct ata_disk* d) {
   capacity = *(uint32_t*)&id[60 * 2];
   model = descramble_ata_string(&id[10 * 2], 20);
   serial = descramble_ata_string(&id[27 * 2], 40);
-  snprintf(extra_info, sizeof extra_info, "model \"%s\", serial \"%s\"", model, serial);
+  d->dma = c->bm_base != 0 && (id[49 * 2 + 1] & 0x01) != 0;
+  snprintf(extra_info, sizeof extra_info, "model \"%s\", serial \"%s\"%s", model, serial,
+           d->dma ? ", DMA" : "");
 
   /* Disable access to IDE disks over 1 GB, which are likely
      physical IDE disks rather than virtual ones.  If we don't
@@ -277,6 +396,10 @@ static void identify_ata_device(struct ata_disk* d) {
     return;
   }
 
+  /* Transfer as many sectors per interrupt as the disk allows.
+     Word 47 gives the most it supports, if any. */
+  set_multiple_mode(d, id[47 * 2] & 0xff);
+
   /* Register. */
   block = block_register(d->name, BLOCK_RAW, extra_info, capacity, &ide_operations, d);
   partition_scan(block);
@@ -306,59 +429,223 @@ static char* descramble_ata_string(char* string, int size) {
   return string;
 }
 
-/* Reads sector SEC_NO from disk D into BUFFER, which must have
-   room for BLOCK_SECTOR_SIZE bytes.
+/* Sends SET MULTIPLE MODE to disk D, asking for CNT sectors per
+   interrupt in READ MULTIPLE and WRITE MULTIPLE, and records the
+   result.  Leaves D using single-sector commands if CNT is not a
+   valid count or the disk refuses it. */
+static void set_multiple_mode(struct ata_disk* d, int cnt) {
+  struct channel* c = d->channel;
+
+  d->multiple = 1;
+  if (cnt < 2 || cnt > 128 || (cnt & (cnt - 1)) != 0)
+    return;
+
+  select_device_wait(d);
+  outb(reg_nsect(c), cnt);
+  issue_pio_command(c, CMD_SET_MULTIPLE_MODE);
+  sema_down(&c->completion_wait);
+  wait_while_busy(d);
+  if ((inb(reg_status(c)) & STA_ERR) == 0)
+    d->multiple = cnt;
+}
+
+/* Reads the CNT sectors starting at SEC_NO from disk D into
+   BUFFER, which must have room for CNT * BLOCK_SECTOR_SIZE
+   bytes.  Each command covers up to MAX_COMMAND_SECTORS sectors.
    Internally synchronizes accesses to disks, so external
    per-disk locking is unneeded. */
-static void ide_read(void* d_, block_sector_t sec_no, void* buffer) {
+static void ide_read_multiple(void* d_, block_sector_t sec_no, block_sector_t cnt, void* buffer_) {
   struct ata_disk* d = d_;
   struct channel* c = d->channel;
+  uint8_t* buffer = buffer_;
+
   lock_acquire(&c->lock);
-  select_sector(d, sec_no);
-  issue_pio_command(c, CMD_READ_SECTOR_RETRY);
-  sema_down(&c->completion_wait);
-  if (!wait_while_busy(d))
-    PANIC("%s: disk read failed, sector=%" PRDSNu, d->name, sec_no);
-  input_sector(c, buffer);
+  while (cnt > 0) {
+    int cmd_cnt = cnt < MAX_COMMAND_SECTORS ? cnt : MAX_COMMAND_SECTORS;
+
+    if (!dma_transfer(d, sec_no, cmd_cnt, buffer, false))
+      pio_read(d, sec_no, cmd_cnt, buffer);
+
+    sec_no += cmd_cnt;
+    cnt -= cmd_cnt;
+    buffer += cmd_cnt * BLOCK_SECTOR_SIZE;
+  }
   lock_release(&c->lock);
 }
 
-/* Write sector SEC_NO to disk D from BUFFER, which must contain
-   BLOCK_SECTOR_SIZE bytes.  Returns after the disk has
-   acknowledged receiving the data.
+/* Writes the CNT sectors starting at SEC_NO to disk D from
+   BUFFER, which must contain CNT * BLOCK_SECTOR_SIZE bytes.
+   Returns after the disk has acknowledged receiving the data.
+   Each command covers up to MAX_COMMAND_SECTORS sectors.
    Internally synchronizes accesses to disks, so external
    per-disk locking is unneeded. */
-static void ide_write(void* d_, block_sector_t sec_no, const void* buffer) {
+static void ide_write_multiple(void* d_, block_sector_t sec_no, block_sector_t cnt,
+                               const void* buffer_) {
   struct ata_disk* d = d_;
   struct channel* c = d->channel;
+  const uint8_t* buffer = buffer_;
+
   lock_acquire(&c->lock);
-  select_sector(d, sec_no);
-  issue_pio_command(c, CMD_WRITE_SECTOR_RETRY);
-  if (!wait_while_busy(d))
-    PANIC("%s: disk write failed, sector=%" PRDSNu, d->name, sec_no);
-  output_sector(c, buffer);
-  sema_down(&c->completion_wait);
+  while (cnt > 0) {
+    int cmd_cnt = cnt < MAX_COMMAND_SECTORS ? cnt : MAX_COMMAND_SECTORS;
+
+    if (!dma_transfer(d, sec_no, cmd_cnt, (void*)buffer, true))
+      pio_write(d, sec_no, cmd_cnt, buffer);
+
+    sec_no += cmd_cnt;
+    cnt -= cmd_cnt;
+    buffer += cmd_cnt * BLOCK_SECTOR_SIZE;
+  }
   lock_release(&c->lock);
 }
 
-static struct block_operations ide_operations = {ide_read, ide_write};
+/* Reads sector SEC_NO from disk D into BUFFER, which must have
+   room for BLOCK_SECTOR_SIZE bytes. */
+static void ide_read(void* d, block_sector_t sec_no, void* buffer) {
+  ide_read_multiple(d, sec_no, 1, buffer);
+}
+
+/* Write sector SEC_NO to disk D from BUFFER, which must contain
+   BLOCK_SECTOR_SIZE bytes.  Returns after the disk has
+   acknowledged receiving the data. */
+static void ide_write(void* d, block_sector_t sec_no, const void* buffer) {
+  ide_write_multiple(d, sec_no, 1, buffer);
+}
+
+static struct block_operations ide_operations = {ide_read, ide_write, ide_read_multiple,
+                                                 ide_write_multiple, NULL};
 
 /* Selects device D, waiting for it to become ready, and then
-   writes SEC_NO to the disk's sector selection registers.  (We
-   use LBA mode.) */
-static void select_sector(struct ata_disk* d, block_sector_t sec_no) {
+   writes SEC_NO to the disk's sector selection registers and
+   CNT, from 1 to MAX_COMMAND_SECTORS, to its sector count
+   register.  (We use LBA mode.) */
+static void select_sector(struct ata_disk* d, block_sector_t sec_no, int cnt) {
   struct channel* c = d->channel;
 
-  ASSERT(sec_no < (1UL << 28));
+  ASSERT(cnt >= 1 && cnt <= MAX_COMMAND_SECTORS);
+  ASSERT(sec_no + cnt <= (1UL << 28));
 
   select_device_wait(d);
-  outb(reg_nsect(c), 1);
+  outb(reg_nsect(c), cnt == MAX_COMMAND_SECTORS ? 0 : cnt);
   outb(reg_lbal(c), sec_no);
   outb(reg_lbam(c), sec_no >> 8);
   outb(reg_lbah(c), (sec_no >> 16));
   outb(reg_device(c), DEV_MBS | DEV_LBA | (d->dev_no == 1 ? DEV_DEV : 0) | (sec_no >> 24));
 }
 
+/* Reads the CNT sectors, from 1 to MAX_COMMAND_SECTORS, starting
+   at SEC_NO from disk D into BUFFER by PIO, with one interrupt
+   per D->multiple sectors.  D's channel must be locked. */
+static void pio_read(struct ata_disk* d, block_sector_t sec_no, int cnt, uint8_t* buffer) {
+  struct channel* c = d->channel;
+  int done;
+
+  select_sector(d, sec_no, cnt);
+  issue_pio_command(c, d->multiple > 1 ? CMD_READ_MULTIPLE : CMD_READ_SECTOR_RETRY);
+  for (done = 0; done < cnt;) {
+    int block_cnt = cnt - done < d->multiple ? cnt - done : d->multiple;
+
+    sema_down(&c->completion_wait);
+    if (!wait_while_busy(d))
+      PANIC("%s: disk read failed, sector=%" PRDSNu, d->name, sec_no + done);
+    for (; block_cnt > 0; block_cnt--, done++)
+      input_sector(c, buffer + done * BLOCK_SECTOR_SIZE);
+  }
+}
+
+/* Writes the CNT sectors, from 1 to MAX_COMMAND_SECTORS, starting
+   at SEC_NO to disk D from BUFFER by PIO, with one interrupt per
+   D->multiple sectors.  D's channel must be locked. */
+static void pio_write(struct ata_disk* d, block_sector_t sec_no, int cnt, const uint8_t* buffer) {
+  struct channel* c = d->channel;
+  int done;
+
+  select_sector(d, sec_no, cnt);
+  issue_pio_command(c, d->multiple > 1 ? CMD_WRITE_MULTIPLE : CMD_WRITE_SECTOR_RETRY);
+  for (done = 0; done < cnt;) {
+    int block_cnt = cnt - done < d->multiple ? cnt - done : d->multiple;
+
+    if (!wait_while_busy(d))
+      PANIC("%s: disk write failed, sector=%" PRDSNu, d->name, sec_no + done);
+    for (; block_cnt > 0; block_cnt--, done++)
+      output_sector(c, buffer + done * BLOCK_SECTOR_SIZE);
+    sema_down(&c->completion_wait);
+  }
+}
+
+/* Transfers the CNT sectors, from 1 to MAX_COMMAND_SECTORS,
+   starting at SEC_NO between disk D and BUFFER by bus-master
+   DMA: into BUFFER if WRITE is false, out of it if WRITE is
+   true.  The CPU is free to run other threads until the
+   completion interrupt.  D's channel must be locked.
+
+   Returns false without transferring anything if D cannot use
+   DMA for BUFFER, and false after turning off DMA for D if the
+   transfer fails.  Either way, the caller should fall back to
+   PIO. */
+static bool dma_transfer(struct ata_disk* d, block_sector_t sec_no, int cnt, void* buffer,
+                         bool write) {
+  struct channel* c = d->channel;
+  uint8_t direction = write ? 0 : BM_CMD_READ;
+  uint8_t bm_status;
+
+  if (!d->dma || !is_kernel_vaddr(buffer) || ((uintptr_t)buffer & 1) != 0)
+    return false;
+
+  /* Point the bus master at the buffer and clear any stale
+     status. */
+  build_prdt(c, buffer, cnt * BLOCK_SECTOR_SIZE);
+  outl(reg_bm_prdt(c), vtop(c->prdt));
+  outb(reg_bm_command(c), direction);
+  outb(reg_bm_status(c), inb(reg_bm_status(c)) | BM_STA_ERR | BM_STA_INTR);
+
+  /* Issue the command, start the bus master, and sleep until the
+     disk interrupts to say the transfer is done. */
+  select_sector(d, sec_no, cnt);
+  issue_pio_command(c, write ? CMD_WRITE_DMA_RETRY : CMD_READ_DMA_RETRY);
+  outb(reg_bm_command(c), direction | BM_CMD_START);
+  sema_down(&c->completion_wait);
+
+  /* Stop the bus master and check for errors. */
+  outb(reg_bm_command(c), direction);
+  bm_status = inb(reg_bm_status(c));
+  outb(reg_bm_status(c), bm_status | BM_STA_ERR | BM_STA_INTR);
+  if ((bm_status & BM_STA_ERR) != 0 || (inb(reg_status(c)) & STA_ERR) != 0) {
+    printf("%s: DMA %s failed, sector=%" PRDSNu ", switching to PIO\n", d->name,
+           write ? "write" : "read", sec_no);
+    d->dma = false;
+    return false;
+  }
+  return true;
+}
+
+/* Fills in channel C's PRD table to describe the SIZE bytes of
+   kernel memory at BUFFER, with one entry for each page that
+   BUFFER touches. */
+static void build_prdt(struct channel* c, const void* buffer, size_t size) {
+  const uint8_t* p = buffer;
+  struct prd* prd = c->prdt;
+
+  ASSERT(size > 0);
+  for (;;) {
+    size_t chunk = PGSIZE - pg_ofs(p);
+    if (chunk > size)
+      chunk = size;
+
+    ASSERT(prd < c->prdt + PRD_CNT);
+    prd->addr = vtop(p);
+    prd->size = chunk;
+    prd->flags = 0;
+
+    p += chunk;
+    size -= chunk;
+    if (size == 0)
+      break;
+    prd++;
+  }
+  prd->flags = PRD_EOT;
+}
+
 /* Writes COMMAND to channel C and prepares for receiving a
    completion interrupt. */
 static void issue_pio_command(struct channel* c, uint8_t command) {
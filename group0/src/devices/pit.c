@@ -11,9 +11,6 @@
 #define PIT_PORT_CONTROL 0x43                        /* Control port. */
 #define PIT_PORT_COUNTER(CHANNEL) (0x40 + (CHANNEL)) /* Counter port. */
 
-/* PIT cycles per second. */
-#define PIT_HZ 1193180
-
 /* Configure the given CHANNEL in the PIT.  In a PC, the PIT's
    three output channels are hooked up like this:
 
@@ -75,3 +72,23 @@ void pit_configure_channel(int channel, int mode, int frequency) {
   outb(PIT_PORT_COUNTER(channel), count >> 8);
   intr_set_level(old_level);
 }
+
+/* Returns the current value of the given CHANNEL's down-counter.
+   In mode 2 the counter runs from the programmed count down to
+   1, so this tells how far the channel is into its period. */
+uint16_t pit_read_count(int channel) {
+  enum intr_level old_level;
+  uint16_t count;
+
+  ASSERT(channel == 0 || channel == 2);
+
+  /* Latch the counter so that its two bytes are read as a
+     consistent pair, then read low byte and high byte. */
+  old_level = intr_disable();
+  outb(PIT_PORT_CONTROL, channel << 6);
+  count = inb(PIT_PORT_COUNTER(channel));
+  count |= inb(PIT_PORT_COUNTER(channel)) << 8;
+  intr_set_level(old_level);
+
+  return count;
+}
@@ -3,6 +3,10 @@
 
 #include <stdint.h>
 
+/* PIT cycles per second. */
+#define PIT_HZ 1193180
+
 void pit_configure_channel(int channel, int mode, int frequency);
+uint16_t pit_read_count(int channel);
 
 #endif /* devices/pit.h */
@@ -0,0 +1,72 @@
+#include "devices/ramdisk.h"
+#include <debug.h>
+#include <round.h>
+#include <stdio.h>
+#include <string.h>
+#include "devices/block.h"
+#include "threads/malloc.h"
+#include "threads/palloc.h"
+#include "threads/vaddr.h"
+
+/* A block device whose sectors live in kernel memory.  It is
+   registered as "ram0" with type BLOCK_RAW, so it takes on a
+   role only when named explicitly, e.g. "-filesys=ram0".
+
+   The sectors are kept in separately allocated pages, so a large
+   RAM disk does not need contiguous memory.  Because its sectors
+   are in memory, the block layer serves requests in the caller's
+   thread, with one memcpy() per sector between the pages and the
+   caller's buffer.  No request is queued and no thread switch
+   happens, but each transfer is still a copy. */
+
+/* Sectors per page. */
+#define PAGE_SECTORS (PGSIZE / BLOCK_SECTOR_SIZE)
+
+static size_t ramdisk_size; /* Size in kB, 0 for none. */
+static uint8_t** pages;     /* The RAM disk's pages. */
+
+static struct block_operations ramdisk_operations;
+
+/* Sets the size of the RAM disk to KB kilobytes.  Must be called
+   before ramdisk_init(). */
+void ramdisk_configure(size_t kb) { ramdisk_size = kb; }
+
+/* Creates the RAM disk, if one was configured, filled with
+   zeros, and registers it with the block device layer. */
+void ramdisk_init(void) {
+  block_sector_t sector_cnt = DIV_ROUND_UP(ramdisk_size * 1024, BLOCK_SECTOR_SIZE);
+  size_t page_cnt = DIV_ROUND_UP(sector_cnt, PAGE_SECTORS);
+  size_t i;
+
+  if (sector_cnt == 0)
+    return;
+
+  pages = malloc(page_cnt * sizeof *pages);
+  if (pages == NULL)
+    PANIC("ram0: out of memory");
+  for (i = 0; i < page_cnt; i++) {
+    pages[i] = palloc_get_page(PAL_ZERO);
+    if (pages[i] == NULL)
+      PANIC("ram0: out of memory for %zu kB RAM disk", ramdisk_size);
+  }
+
+  block_register("ram0", BLOCK_RAW, "RAM disk", sector_cnt, &ramdisk_operations, NULL);
+}
+
+/* Returns the address of SECTOR's data. */
+static void* ramdisk_map(void* aux UNUSED, block_sector_t sector) {
+  return pages[sector / PAGE_SECTORS] + sector % PAGE_SECTORS * BLOCK_SECTOR_SIZE;
+}
+
+/* Reads sector SECTOR into BUFFER. */
+static void ramdisk_read(void* aux, block_sector_t sector, void* buffer) {
+  memcpy(buffer, ramdisk_map(aux, sector), BLOCK_SECTOR_SIZE);
+}
+
+/* Writes sector SECTOR from BUFFER. */
+static void ramdisk_write(void* aux, block_sector_t sector, const void* buffer) {
+  memcpy(ramdisk_map(aux, sector), buffer, BLOCK_SECTOR_SIZE);
+}
+
+static struct block_operations ramdisk_operations = {ramdisk_read, ramdisk_write, NULL, NULL,
+                                                     ramdisk_map};
@@ -1,5 +1,6 @@
 #include "devices/rtc.h"
 #include <stdio.h>
+#include "threads/interrupt.h"
 #include "threads/io.h"
 
 /* This code is an interface to the MC146818A-compatible real
@@ -27,15 +28,22 @@
 #define RTC_REG_D 0x0d /* Register D: valid time? */
 
 /* Register A. */
-#define RTCSA_UIP 0x80 /* Set while time update in progress. */
+#define RTCSA_UIP 0x80  /* Set while time update in progress. */
+#define RTCSA_RATE 0x0f /* Periodic interrupt rate select. */
+
+/* Rate select value for RTC_PERIODIC_HZ: the periodic interrupt
+   fires at 32768 >> (rate - 1) Hz. */
+#define RTC_RATE_8192HZ 3
 
 /* Register B. */
 #define RTCSB_SET 0x80  /* Disables update to let time be set. */
 #define RTCSB_DM 0x04   /* 0 = BCD time format, 1 = binary format. */
 #define RTCSB_24HR 0x02 /* 0 = 12-hour format, 1 = 24-hour format. */
+#define RTCSB_PIE 0x40  /* Periodic interrupt enable. */
 
 static int bcd_to_bin(uint8_t);
 static uint8_t cmos_read(uint8_t index);
+static void cmos_write(uint8_t index, uint8_t data);
 
 /* Returns number of seconds since Unix epoch of January 1,
    1970. */
@@ -88,6 +96,29 @@ time_t rtc_get_time(void) {
   return time;
 }
 
+/* Sets the RTC's periodic interrupt (IRQ 8) to RTC_PERIODIC_HZ
+   and leaves it disabled.  The caller is responsible for
+   registering a handler. */
+void rtc_periodic_init(void) {
+  enum intr_level old_level = intr_disable();
+  cmos_write(RTC_REG_A, (cmos_read(RTC_REG_A) & ~RTCSA_RATE) | RTC_RATE_8192HZ);
+  cmos_write(RTC_REG_B, cmos_read(RTC_REG_B) & ~RTCSB_PIE);
+  rtc_periodic_ack();
+  intr_set_level(old_level);
+}
+
+/* Turns the RTC's periodic interrupt on or off. */
+void rtc_periodic_enable(bool enable) {
+  enum intr_level old_level = intr_disable();
+  uint8_t b = cmos_read(RTC_REG_B);
+  cmos_write(RTC_REG_B, enable ? b | RTCSB_PIE : b & ~RTCSB_PIE);
+  intr_set_level(old_level);
+}
+
+/* Acknowledges a pending RTC interrupt.  The RTC raises no
+   further interrupts until register C has been read. */
+void rtc_periodic_ack(void) { cmos_read(RTC_REG_C); }
+
 /* Returns the integer value of the given BCD byte. */
 static int bcd_to_bin(uint8_t x) { return (x & 0x0f) + ((x >> 4) * 10); }
 
@@ -97,3 +128,9 @@ static uint8_t cmos_read(uint8_t index) {
   outb(CMOS_REG_SET, index);
   return inb(CMOS_REG_IO);
 }
+
+/* Writes DATA to the CMOS register with the given INDEX. */
+static void cmos_write(uint8_t index, uint8_t data) {
+  outb(CMOS_REG_SET, index);
+  outb(CMOS_REG_IO, data);
+}
@@ -1,8 +1,17 @@
 #ifndef RTC_H
 #define RTC_H
 
+#include <stdbool.h>
+
 typedef unsigned long time_t;
 
 time_t rtc_get_time(void);
 
+/* Rate of the RTC's periodic interrupt, in Hz, once enabled. */
+#define RTC_PERIODIC_HZ 8192
+
+void rtc_periodic_init(void);
+void rtc_periodic_enable(bool);
+void rtc_periodic_ack(void);
+
 #endif
@@ -5,13 +5,19 @@
 #include "devices/serial.h"
 #include "devices/timer.h"
 #include "threads/io.h"
+#include "threads/palloc.h"
+#include "threads/slab.h"
 #include "threads/thread.h"
 #ifdef USERPROG
 #include "userprog/exception.h"
 #endif
 #ifdef FILESYS
 #include "devices/block.h"
+#include "filesys/cache.h"
+#include "filesys/dcache.h"
 #include "filesys/filesys.h"
+#include "filesys/free-map.h"
+#include "filesys/journal.h"
 #endif
 
 /* Keyboard control register port. */
@@ -21,6 +27,7 @@
 static enum shutdown_type how = SHUTDOWN_NONE;
 
 static void print_stats(void);
+static void power_off(void) NO_RETURN;
 
 /* Shuts down the machine in the way configured by
    shutdown_configure().  If the shutdown type is SHUTDOWN_NONE
@@ -74,9 +81,6 @@ void shutdown_reboot(void) {
 /* Powers down the machine we're running on,
    as long as we're running on Bochs or QEMU. */
 void shutdown_power_off(void) {
-  const char s[] = "Shutdown";
-  const char* p;
-
 #ifdef FILESYS
   filesys_done();
 #endif
@@ -84,6 +88,22 @@ void shutdown_power_off(void) {
   print_stats();
 
   printf("Powering off...\n");
+  power_off();
+}
+
+/* Powers down the machine at once, without writing back any file
+   system data, as if it had crashed. */
+void shutdown_crash(void) {
+  printf("Crashing...\n");
+  power_off();
+}
+
+/* Powers down the machine, as described for
+   shutdown_power_off(). */
+static void power_off(void) {
+  const char s[] = "Shutdown";
+  const char* p;
+
   serial_flush();
 
   /* ACPI power-off */
@@ -116,8 +136,14 @@ void shutdown_power_off(void) {
 static void print_stats(void) {
   timer_print_stats();
   thread_print_stats();
+  palloc_print_stats();
+  kmem_print_stats();
 #ifdef FILESYS
   block_print_stats();
+  cache_print_stats();
+  dcache_print_stats();
+  free_map_print_stats();
+  journal_print_stats();
 #endif
   console_print_stats();
   kbd_print_stats();
@@ -4,6 +4,7 @@
 #include <round.h>
 #include <stdio.h>
 #include "devices/pit.h"
+#include "devices/rtc.h"
 #include "threads/interrupt.h"
 #include "threads/synch.h"
 #include "threads/thread.h"
@@ -20,6 +21,27 @@
 /* Number of timer ticks since OS booted. */
 static int64_t ticks;
 
+/* Nanoseconds per timer tick. */
+#define NS_PER_TICK (1000 * 1000 * 1000 / TIMER_FREQ)
+
+/* Sleeps shorter than this many nanoseconds, the resolution of
+   the RTC's periodic interrupt, are busy-waited instead. */
+#define HIRES_MIN_NS (1000 * 1000 * 1000 / RTC_PERIODIC_HZ)
+
+/* PIT channel 0 counts down from this value once per tick. */
+#define PIT_TICK_COUNT ((PIT_HZ + TIMER_FREQ / 2) / TIMER_FREQ)
+
+/* Armed timer events, in ascending order of deadline. */
+static struct list event_list;
+
+/* Is the RTC periodic interrupt currently enabled? */
+static bool hires_enabled;
+
+/* List of threads sleeping in timer_sleep(), in ascending order
+   of wakeup tick.  The timer interrupt only needs to look at the
+   front of the list to know whether any thread is due. */
+static struct list sleep_list;
+
 /* Number of loops per timer tick.
    Initialized by timer_calibrate(). */
 static unsigned loops_per_tick;
@@ -29,12 +51,23 @@ static bool too_many_loops(unsigned loops);
 static void busy_wait(int64_t loops);
 static void real_time_sleep(int64_t num, int32_t denom);
 static void real_time_delay(int64_t num, int32_t denom);
+static bool wakeup_less(const struct list_elem* a, const struct list_elem* b, void* aux UNUSED);
+static intr_handler_func hires_interrupt;
+static void run_timer_events(void);
+static void program_hires(void);
+static bool deadline_less(const struct list_elem* a, const struct list_elem* b, void* aux UNUSED);
+static void timer_nsleep_hires(int64_t ns);
 
 /* Sets up the timer to interrupt TIMER_FREQ times per second,
    and registers the corresponding interrupt. */
 void timer_init(void) {
+  list_init(&sleep_list);
+  list_init(&event_list);
   pit_configure_channel(0, 2, TIMER_FREQ);
   intr_register_ext(0x20, timer_interrupt, "8254 Timer");
+
+  rtc_periodic_init();
+  intr_register_ext(0x28, hires_interrupt, "RTC Periodic");
 }
 
 /* Calibrates loops_per_tick, used to implement brief delays. */
@@ -73,14 +106,58 @@ int64_t timer_ticks(void) {
    should be a value once returned by timer_ticks(). */
 int64_t timer_elapsed(int64_t then) { return timer_ticks() - then; }
 
+/* Returns the number of nanoseconds since the OS booted, with the
+   resolution of the PIT rather than of the timer tick.  Never
+   returns less than it returned before. */
+int64_t timer_ns(void) {
+  static int64_t last_ns; /* Last value returned. */
+  enum intr_level old_level = intr_disable();
+  int64_t t = ticks;
+  bool pending = intr_irq_pending(0);
+  int elapsed = PIT_TICK_COUNT - pit_read_count(0);
+  int64_t ns;
+
+  /* With interrupts off, a tick whose interrupt is pending has
+     not been counted in TICKS, though the PIT has already started
+     counting down the next one.  If the tick came between
+     checking and reading the PIT, read the PIT again. */
+  if (!pending && intr_irq_pending(0)) {
+    pending = true;
+    elapsed = PIT_TICK_COUNT - pit_read_count(0);
+  }
+  if (pending)
+    t++;
+  if (elapsed < 0)
+    elapsed = 0;
+
+  /* Guard against anything this misses, such as a tick that
+     comes while reading the PIT the second time. */
+  ns = t * NS_PER_TICK + (int64_t)elapsed * 1000 * 1000 * 1000 / PIT_HZ;
+  if (ns < last_ns)
+    ns = last_ns;
+  last_ns = ns;
+  intr_set_level(old_level);
+  return ns;
+}
+
 /* Sleeps for approximately TICKS timer ticks.  Interrupts must
-   be turned on. */
+   be turned on.
+
+   The thread blocks until the timer interrupt wakes it, so it
+   takes no part in scheduling while it sleeps. */
 void timer_sleep(int64_t ticks) {
-  int64_t start = timer_ticks();
+  struct thread* cur = thread_current();
+  enum intr_level old_level;
 
   ASSERT(intr_get_level() == INTR_ON);
-  while (timer_elapsed(start) < ticks)
-    thread_yield();
+  if (ticks <= 0)
+    return;
+
+  old_level = intr_disable();
+  cur->wakeup_tick = timer_ticks() + ticks;
+  list_insert_ordered(&sleep_list, &cur->elem, wakeup_less, NULL);
+  thread_block();
+  intr_set_level(old_level);
 }
 
 /* Sleeps for approximately MS milliseconds.  Interrupts must be
@@ -122,13 +199,146 @@ void timer_udelay(int64_t us) { real_time_delay(us, 1000 * 1000); }
    instead if interrupts are enabled.*/
 void timer_ndelay(int64_t ns) { real_time_delay(ns, 1000 * 1000 * 1000); }
 
+/* Initializes EVENT to call FUNC with AUX when it expires. */
+void timer_event_init(struct timer_event* event, timer_event_func* func, void* aux) {
+  ASSERT(event != NULL);
+  ASSERT(func != NULL);
+
+  event->func = func;
+  event->aux = aux;
+  event->armed = false;
+}
+
+/* Arms EVENT to expire NS nanoseconds from now.  EVENT must not
+   already be armed. */
+void timer_event_arm(struct timer_event* event, int64_t ns) {
+  enum intr_level old_level;
+
+  ASSERT(event != NULL);
+  ASSERT(!event->armed);
+
+  old_level = intr_disable();
+  event->deadline = timer_ns() + ns;
+  event->armed = true;
+  list_insert_ordered(&event_list, &event->elem, deadline_less, NULL);
+  program_hires();
+  intr_set_level(old_level);
+}
+
+/* Disarms EVENT.  Returns true if it was armed, false if it had
+   already expired or was never armed. */
+bool timer_event_cancel(struct timer_event* event) {
+  enum intr_level old_level;
+  bool was_armed;
+
+  ASSERT(event != NULL);
+
+  old_level = intr_disable();
+  was_armed = event->armed;
+  if (was_armed) {
+    list_remove(&event->elem);
+    event->armed = false;
+    program_hires();
+  }
+  intr_set_level(old_level);
+
+  return was_armed;
+}
+
 /* Prints timer statistics. */
 void timer_print_stats(void) { printf("Timer: %" PRId64 " ticks\n", timer_ticks()); }
 
-/* Timer interrupt handler. */
+/* Timer interrupt handler.  Wakes every sleeping thread whose
+   wakeup tick has arrived, which are all at the front of
+   sleep_list. */
 static void timer_interrupt(struct intr_frame* args UNUSED) {
+  bool woke = false;
+
   ticks++;
+  while (!list_empty(&sleep_list)) {
+    struct thread* t = list_entry(list_front(&sleep_list), struct thread, elem);
+    if (t->wakeup_tick > ticks)
+      break;
+    list_pop_front(&sleep_list);
+    thread_unblock(t);
+    woke = true;
+  }
+  run_timer_events();
   thread_tick();
+
+  if (woke)
+    thread_preempt();
+}
+
+/* RTC periodic interrupt handler.  Only enabled while a timer
+   event is due before the next tick. */
+static void hires_interrupt(struct intr_frame* args UNUSED) {
+  rtc_periodic_ack();
+  run_timer_events();
+}
+
+/* Calls the function of every timer event whose deadline has
+   passed, then turns the RTC periodic interrupt on or off to
+   suit the next deadline.  Runs in interrupt context. */
+static void run_timer_events(void) {
+  int64_t now = timer_ns();
+
+  while (!list_empty(&event_list)) {
+    struct timer_event* e = list_entry(list_front(&event_list), struct timer_event, elem);
+    if (e->deadline > now)
+      break;
+    list_pop_front(&event_list);
+    e->armed = false;
+    e->func(e->aux);
+  }
+  program_hires();
+}
+
+/* Enables the RTC periodic interrupt if the earliest armed event
+   expires before the next timer tick, and disables it otherwise.
+   Later deadlines are caught by the timer tick itself, so the
+   RTC only interrupts while it is actually needed. */
+static void program_hires(void) {
+  bool need = false;
+
+  ASSERT(intr_get_level() == INTR_OFF);
+
+  if (!list_empty(&event_list)) {
+    struct timer_event* e = list_entry(list_front(&event_list), struct timer_event, elem);
+    need = e->deadline < (ticks + 1) * NS_PER_TICK;
+  }
+  if (need != hires_enabled) {
+    rtc_periodic_enable(need);
+    hires_enabled = need;
+  }
+}
+
+/* Orders timer events by ascending deadline. */
+static bool deadline_less(const struct list_elem* a, const struct list_elem* b, void* aux UNUSED) {
+  return list_entry(a, struct timer_event, elem)->deadline <
+         list_entry(b, struct timer_event, elem)->deadline;
+}
+
+/* Timer event function that wakes a thread sleeping on the
+   semaphore AUX. */
+static void wake_hires_sleeper(void* sema) { sema_up(sema); }
+
+/* Blocks the running thread for approximately NS nanoseconds
+   using a one-shot timer event. */
+static void timer_nsleep_hires(int64_t ns) {
+  struct timer_event event;
+  struct semaphore sema;
+
+  sema_init(&sema, 0);
+  timer_event_init(&event, wake_hires_sleeper, &sema);
+  timer_event_arm(&event, ns);
+  sema_down(&sema);
+}
+
+/* Orders sleeping threads by ascending wakeup tick. */
+static bool wakeup_less(const struct list_elem* a, const struct list_elem* b, void* aux UNUSED) {
+  return list_entry(a, struct thread, elem)->wakeup_tick <
+         list_entry(b, struct thread, elem)->wakeup_tick;
 }
 
 /* Returns true if LOOPS iterations waits for more than one timer
@@ -176,6 +386,10 @@ static void real_time_sleep(int64_t num, int32_t denom) {
          timer_sleep() because it will yield the CPU to other
          processes. */
     timer_sleep(ticks);
+  } else if (num * 1000 * 1000 * 1000 / denom >= HIRES_MIN_NS) {
+    /* Sub-tick, but long enough for a one-shot timer event to
+         time accurately.  Block so that other threads can run. */
+    timer_nsleep_hires(num * 1000 * 1000 * 1000 / denom);
   } else {
     /* Otherwise, use a busy-wait loop for more accurate
          sub-tick timing. */
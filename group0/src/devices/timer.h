@@ -1,7 +1,9 @@
 #ifndef DEVICES_TIMER_H
 #define DEVICES_TIMER_H
 
+#include <list.h>
 #include <round.h>
+#include <stdbool.h>
 #include <stdint.h>
 
 /* Number of timer interrupts per second. */
@@ -12,6 +14,7 @@ void timer_calibrate(void);
 
 int64_t timer_ticks(void);
 int64_t timer_elapsed(int64_t);
+int64_t timer_ns(void);
 
 /* Sleep and yield the CPU to other threads. */
 void timer_sleep(int64_t ticks);
@@ -26,4 +29,29 @@ void timer_ndelay(int64_t nanoseconds);
 
 void timer_print_stats(void);
 
+/* One-shot timer events.
+
+   A kernel subsystem that wants a callback after a delay embeds
+   a struct timer_event in its own data (for example, one per
+   thread), initializes it with timer_event_init(), and arms it
+   with timer_event_arm().  FUNC is called with AUX from the
+   timer interrupt handler, so it must not sleep.  Deadlines
+   shorter than one timer tick are served by the RTC's periodic
+   interrupt, which is only enabled while such a deadline is
+   pending, so resolution is about 1/RTC_PERIODIC_HZ seconds
+   rather than one tick. */
+typedef void timer_event_func(void* aux);
+
+struct timer_event {
+  struct list_elem elem;  /* Element in the pending events list. */
+  int64_t deadline;       /* Expiry time, in timer_ns() units. */
+  timer_event_func* func; /* Called on expiry. */
+  void* aux;              /* Passed to FUNC. */
+  bool armed;             /* On the pending events list? */
+};
+
+void timer_event_init(struct timer_event*, timer_event_func*, void* aux);
+void timer_event_arm(struct timer_event*, int64_t nanoseconds);
+bool timer_event_cancel(struct timer_event*);
+
 #endif /* devices/timer.h */
@@ -0,0 +1,593 @@
+#include "filesys/cache.h"
+#include <debug.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "devices/timer.h"
+#include "filesys/filesys.h"
+#include "filesys/journal.h"
+#include "threads/palloc.h"
+#include "threads/synch.h"
+#include "threads/thread.h"
+#include "threads/vaddr.h"
+
+/* Buffer cache.  Holds CACHE_SIZE sectors of the file system
+   device in memory, evicting with the clock algorithm and
+   writing dirty sectors back only on eviction or flush.
+
+   CACHE_LOCK protects the mapping from sectors to entries, the
+   clock hand, and each entry's SECTOR, OLD_SECTOR, PIN_CNT and
+   ACCESSED members.  An entry's HELD flag is changed only with
+   both CACHE_LOCK and the entry's lock held, so either suffices
+   to read it.  Each entry's own LOCK protects its DIRTY
+   flag and its data, so different sectors may be read, written
+   and transferred to and from disk in parallel.  An entry with a
+   nonzero PIN_CNT is never chosen for eviction, so a thread may
+   drop CACHE_LOCK before blocking on an entry's lock without the
+   entry changing identity underneath it.
+
+   Sectors passed to cache_readahead() are queued for a
+   background "read-ahead" thread that brings them into the cache,
+   so the disk transfer overlaps whatever the requester does
+   next.  It takes queued sectors in batches and submits them to
+   the device's request queue together, which reads adjacent
+   ones in a single transfer.
+
+   A "flusher" thread writes dirty sectors back, in ascending
+   sector order, every FLUSH_INTERVAL ticks and whenever more
+   than FLUSH_HIGH_WATER sectors are dirty.  Writers block only
+   once DIRTY_LIMIT sectors are dirty, until the flusher or
+   eviction catches up.  Each pass also commits the journal.
+
+   Sectors written by cache_write_held() belong to an uncommitted
+   journal transaction.  They are neither evicted nor written
+   back until the journal releases them with cache_unhold(), and
+   do not count toward DIRTY_LIMIT. */
+
+/* SECTOR or OLD_SECTOR value for "no sector". */
+#define CACHE_NO_SECTOR ((block_sector_t)-1)
+
+/* Dirty sector counts that wake the flusher early and that
+   throttle writers. */
+#define FLUSH_HIGH_WATER (CACHE_SIZE / 2)
+#define DIRTY_LIMIT (CACHE_SIZE * 3 / 4)
+
+/* Most consecutive sectors gathered into one write-back. */
+#define FLUSH_RUN_MAX (PGSIZE / BLOCK_SECTOR_SIZE)
+
+/* Most sectors the read-ahead thread reads in one batch. */
+#define RA_BATCH_MAX (PGSIZE / BLOCK_SECTOR_SIZE)
+
+/* Default ticks between flusher passes. */
+#define FLUSH_INTERVAL_DEFAULT (5 * TIMER_FREQ)
+
+/* A cached sector. */
+struct cache_entry {
+  block_sector_t sector;     /* Sector cached here, or CACHE_NO_SECTOR. */
+  block_sector_t old_sector; /* Sector being written back, if any. */
+  int pin_cnt;               /* Threads using or waiting for entry. */
+  bool accessed;             /* Used since clock hand last passed? */
+  bool held;                 /* Awaiting journal commit? */
+  struct lock lock;          /* Protects DIRTY and DATA. */
+  bool dirty;                /* Differs from disk? */
+  uint8_t* data;             /* BLOCK_SECTOR_SIZE bytes of data. */
+};
+
+static struct cache_entry cache[CACHE_SIZE];
+static struct lock cache_lock;      /* Protects mapping, see above. */
+static struct condition cache_cond; /* Entry unpinned or written back. */
+static size_t clock_hand;           /* Next eviction candidate. */
+static size_t dirty_cnt;            /* Number of dirty entries. */
+static size_t held_cnt;             /* Number of held entries, all dirty. */
+
+/* How cache_get() treats a sector. */
+enum cache_mode {
+  CACHE_READ,      /* Read sector from disk on a miss. */
+  CACHE_OVERWRITE, /* Caller replaces whole sector, skip disk read. */
+  CACHE_PREFETCH   /* Read ahead: do nothing if already cached. */
+};
+
+/* Read-ahead queue, a ring buffer of sectors. */
+#define RA_QUEUE_SIZE 64
+static block_sector_t ra_queue[RA_QUEUE_SIZE];
+static size_t ra_head;           /* Index of oldest request. */
+static size_t ra_cnt;            /* Number of queued requests. */
+static struct lock ra_lock;      /* Protects the queue. */
+static struct condition ra_cond; /* Signaled when a request is queued. */
+
+/* Statistics, protected by CACHE_LOCK. */
+static unsigned long long hit_cnt;       /* Lookups that found the sector. */
+static unsigned long long miss_cnt;      /* Lookups that had to evict. */
+static unsigned long long readahead_cnt; /* Sectors read ahead. */
+static unsigned long long writeback_cnt; /* Dirty sectors written back. */
+
+/* Flusher thread state. */
+static int64_t flush_interval = FLUSH_INTERVAL_DEFAULT; /* In ticks. */
+static struct semaphore flush_sema;                     /* Upped to wake flusher. */
+static struct timer_event flush_event;                  /* Periodic wake-up. */
+
+/* Flusher statistics.  Only the flusher writes the first two. */
+static unsigned long long flush_wakeup_cnt; /* Flusher passes. */
+static unsigned long long flush_write_cnt;  /* Sectors written by flusher. */
+static unsigned long long throttle_cnt;     /* Writers made to wait. */
+
+static thread_func readahead_daemon;
+static block_callback_func readahead_done;
+static thread_func flush_daemon;
+static timer_event_func flush_timer;
+static size_t flush_dirty(void);
+
+/* Sets the number of timer ticks between flusher passes to
+   TICKS.  Must be called before cache_init(). */
+void cache_configure_flush(int64_t ticks) {
+  ASSERT(ticks > 0);
+  flush_interval = ticks;
+}
+
+/* Initializes the buffer cache. */
+void cache_init(void) {
+  uint8_t* data;
+  size_t i;
+
+  lock_init(&cache_lock);
+  cond_init(&cache_cond);
+
+  data = palloc_get_multiple(PAL_ASSERT, CACHE_SIZE * BLOCK_SECTOR_SIZE / PGSIZE);
+  for (i = 0; i < CACHE_SIZE; i++) {
+    struct cache_entry* e = &cache[i];
+    e->sector = CACHE_NO_SECTOR;
+    e->old_sector = CACHE_NO_SECTOR;
+    e->pin_cnt = 0;
+    e->accessed = false;
+    e->held = false;
+    lock_init(&e->lock);
+    e->dirty = false;
+    e->data = data + i * BLOCK_SECTOR_SIZE;
+  }
+
+  /* Threads of any priority wait on these daemons, for read-ahead
+     they asked for or for dirty sectors to drain, so they run at
+     the highest priority to avoid priority inversion.  Both spend
+     nearly all their time blocked. */
+  lock_init(&ra_lock);
+  cond_init(&ra_cond);
+  if (thread_create("read-ahead", PRI_MAX, readahead_daemon, NULL) == TID_ERROR)
+    PANIC("can't create read-ahead thread");
+
+  sema_init(&flush_sema, 0);
+  timer_event_init(&flush_event, flush_timer, NULL);
+  if (thread_create("flusher", PRI_MAX, flush_daemon, NULL) == TID_ERROR)
+    PANIC("can't create flusher thread");
+}
+
+/* Returns an unpinned, unheld entry chosen by the clock
+   algorithm, or a null pointer if there is none.  CACHE_LOCK must
+   be held. */
+static struct cache_entry* choose_victim(void) {
+  size_t i;
+
+  for (i = 0; i < 2 * CACHE_SIZE; i++) {
+    struct cache_entry* e = &cache[clock_hand];
+    clock_hand = (clock_hand + 1) % CACHE_SIZE;
+
+    if (e->pin_cnt > 0 || e->held)
+      continue;
+    if (e->accessed)
+      e->accessed = false;
+    else
+      return e;
+  }
+  return NULL;
+}
+
+/* Returns the entry for SECTOR, pinned and with its lock held,
+   taking over an entry for it if it is not cached, in which case
+   it stores true into *MISSED and leaves the entry's data for
+   the caller to fill.  In CACHE_PREFETCH mode, returns a null
+   pointer instead of a hit, or of waiting for an entry to become
+   free. */
+static struct cache_entry* cache_claim(block_sector_t sector, enum cache_mode mode,
+                                       bool* missed) {
+  struct cache_entry* e;
+  block_sector_t old_sector;
+  bool write_back;
+  size_t i;
+
+  ASSERT(sector != CACHE_NO_SECTOR);
+
+  lock_acquire(&cache_lock);
+  for (;;) {
+    bool busy = false;
+
+    for (i = 0; i < CACHE_SIZE; i++) {
+      e = &cache[i];
+      if (e->sector == sector) {
+        if (mode == CACHE_PREFETCH) {
+          lock_release(&cache_lock);
+          return NULL;
+        }
+        e->pin_cnt++;
+        e->accessed = true;
+        hit_cnt++;
+        lock_release(&cache_lock);
+        lock_acquire(&e->lock);
+        *missed = false;
+        return e;
+      }
+      if (e->old_sector == sector)
+        busy = true;
+    }
+
+    /* Don't read SECTOR from disk while an older copy of it is
+       still being written back. */
+    if (!busy) {
+      e = choose_victim();
+      if (e != NULL)
+        break;
+    }
+    if (mode == CACHE_PREFETCH) {
+      lock_release(&cache_lock);
+      return NULL;
+    }
+    cond_wait(&cache_cond, &cache_lock);
+  }
+
+  /* Take over the victim.  It is unpinned, so nobody holds its
+     lock and this does not block. */
+  if (mode == CACHE_PREFETCH)
+    readahead_cnt++;
+  else
+    miss_cnt++;
+  e->pin_cnt++;
+  e->accessed = true;
+  lock_acquire(&e->lock);
+  old_sector = e->sector;
+  write_back = e->dirty;
+  e->sector = sector;
+  if (write_back)
+    e->old_sector = old_sector;
+  lock_release(&cache_lock);
+
+  if (write_back) {
+    block_write(fs_device, old_sector, e->data);
+    e->dirty = false;
+
+    lock_acquire(&cache_lock);
+    e->old_sector = CACHE_NO_SECTOR;
+    dirty_cnt--;
+    writeback_cnt++;
+    cond_broadcast(&cache_cond, &cache_lock);
+    lock_release(&cache_lock);
+  }
+
+  *missed = true;
+  return e;
+}
+
+/* Returns the entry for SECTOR, pinned and with its lock held,
+   bringing SECTOR into the cache if necessary.  MODE says how to
+   treat a miss. */
+static struct cache_entry* cache_get(block_sector_t sector, enum cache_mode mode) {
+  bool missed;
+  struct cache_entry* e;
+
+  ASSERT(mode != CACHE_PREFETCH);
+  e = cache_claim(sector, mode, &missed);
+  if (missed && mode != CACHE_OVERWRITE)
+    block_read(fs_device, sector, e->data);
+  return e;
+}
+
+/* Releases entry E obtained from cache_get(), marking it dirty
+   if DIRTY is true. */
+static void cache_put(struct cache_entry* e, bool dirty) {
+  bool newly_dirty = dirty && !e->dirty;
+
+  if (dirty)
+    e->dirty = true;
+  lock_release(&e->lock);
+
+  lock_acquire(&cache_lock);
+  if (newly_dirty && ++dirty_cnt == FLUSH_HIGH_WATER + 1)
+    sema_up(&flush_sema);
+  if (--e->pin_cnt == 0)
+    cond_broadcast(&cache_cond, &cache_lock);
+  lock_release(&cache_lock);
+}
+
+/* Reads sector SECTOR into BUFFER, which must have room for
+   BLOCK_SECTOR_SIZE bytes. */
+void cache_read(block_sector_t sector, void* buffer) {
+  cache_read_at(sector, buffer, 0, BLOCK_SECTOR_SIZE);
+}
+
+/* Reads SIZE bytes starting at byte SECTOR_OFS within sector
+   SECTOR into BUFFER. */
+void cache_read_at(block_sector_t sector, void* buffer, int sector_ofs, int size) {
+  struct cache_entry* e;
+
+  ASSERT(sector_ofs >= 0 && size >= 0 && sector_ofs + size <= BLOCK_SECTOR_SIZE);
+
+  e = cache_get(sector, CACHE_READ);
+  memcpy(buffer, e->data + sector_ofs, size);
+  cache_put(e, false);
+}
+
+/* Writes sector SECTOR from BUFFER, which must contain
+   BLOCK_SECTOR_SIZE bytes.  The data reaches disk when the
+   sector is evicted or the cache is flushed. */
+void cache_write(block_sector_t sector, const void* buffer) {
+  cache_write_at(sector, buffer, 0, BLOCK_SECTOR_SIZE);
+}
+
+/* Writes SIZE bytes from BUFFER starting at byte SECTOR_OFS
+   within sector SECTOR.  The rest of the sector is unchanged. */
+void cache_write_at(block_sector_t sector, const void* buffer, int sector_ofs, int size) {
+  struct cache_entry* e;
+
+  ASSERT(sector_ofs >= 0 && size >= 0 && sector_ofs + size <= BLOCK_SECTOR_SIZE);
+
+  /* Throttle writers while too much data is dirty. */
+  lock_acquire(&cache_lock);
+  if (dirty_cnt - held_cnt >= DIRTY_LIMIT) {
+    throttle_cnt++;
+    sema_up(&flush_sema);
+    while (dirty_cnt - held_cnt >= DIRTY_LIMIT)
+      cond_wait(&cache_cond, &cache_lock);
+  }
+  lock_release(&cache_lock);
+
+  e = cache_get(sector, size == BLOCK_SECTOR_SIZE ? CACHE_OVERWRITE : CACHE_READ);
+  memcpy(e->data + sector_ofs, buffer, size);
+  cache_put(e, true);
+}
+
+/* Like cache_write_at(), but for a sector in the running journal
+   transaction: the sector stays in the cache, and is not written
+   back, until released by cache_unhold().  Never throttled. */
+void cache_write_held(block_sector_t sector, const void* buffer, int sector_ofs, int size) {
+  struct cache_entry* e;
+
+  ASSERT(sector_ofs >= 0 && size >= 0 && sector_ofs + size <= BLOCK_SECTOR_SIZE);
+
+  e = cache_get(sector, size == BLOCK_SECTOR_SIZE ? CACHE_OVERWRITE : CACHE_READ);
+  if (!e->held) {
+    /* Count the entry as dirty and held in one step, so that
+       DIRTY_CNT - HELD_CNT never goes negative. */
+    lock_acquire(&cache_lock);
+    if (!e->dirty) {
+      e->dirty = true;
+      dirty_cnt++;
+    }
+    e->held = true;
+    held_cnt++;
+    lock_release(&cache_lock);
+  }
+  memcpy(e->data + sector_ofs, buffer, size);
+  cache_put(e, true);
+}
+
+/* Releases SECTOR, held since cache_write_held(), now that the
+   journal has written DATA to its home location.  The sector is
+   clean unless it changed since. */
+void cache_unhold(block_sector_t sector, const void* data) {
+  struct cache_entry* e = cache_get(sector, CACHE_READ);
+  bool clean = e->dirty && !memcmp(e->data, data, BLOCK_SECTOR_SIZE);
+
+  ASSERT(e->held);
+  if (clean)
+    e->dirty = false;
+
+  lock_acquire(&cache_lock);
+  e->held = false;
+  held_cnt--;
+  if (clean)
+    dirty_cnt--;
+  cond_broadcast(&cache_cond, &cache_lock);
+  lock_release(&cache_lock);
+  cache_put(e, false);
+}
+
+/* Asks the read-ahead thread to bring SECTOR into the cache.
+   Does not wait for it.  The request is dropped if the queue is
+   full, since read-ahead is only a hint. */
+void cache_readahead(block_sector_t sector) {
+  lock_acquire(&ra_lock);
+  if (ra_cnt < RA_QUEUE_SIZE) {
+    ra_queue[(ra_head + ra_cnt) % RA_QUEUE_SIZE] = sector;
+    ra_cnt++;
+    cond_signal(&ra_cond, &ra_lock);
+  }
+  lock_release(&ra_lock);
+}
+
+/* Read-ahead thread.  Services cache_readahead() requests in
+   the order they were made, up to RA_BATCH_MAX at a time: takes
+   over an entry for each sector not yet cached, submits a read
+   for each, and releases the entries once all have completed.
+   Sectors that find no free entry are skipped. */
+static void readahead_daemon(void* aux UNUSED) {
+  struct block_request requests[RA_BATCH_MAX];
+  struct cache_entry* entries[RA_BATCH_MAX];
+  struct semaphore done;
+
+  sema_init(&done, 0);
+  for (;;) {
+    block_sector_t sectors[RA_BATCH_MAX];
+    size_t sector_cnt = 0;
+    size_t cnt = 0;
+    size_t i;
+
+    lock_acquire(&ra_lock);
+    while (ra_cnt == 0)
+      cond_wait(&ra_cond, &ra_lock);
+    while (ra_cnt > 0 && sector_cnt < RA_BATCH_MAX) {
+      sectors[sector_cnt++] = ra_queue[ra_head];
+      ra_head = (ra_head + 1) % RA_QUEUE_SIZE;
+      ra_cnt--;
+    }
+    lock_release(&ra_lock);
+
+    for (i = 0; i < sector_cnt; i++) {
+      bool missed;
+      struct cache_entry* e = cache_claim(sectors[i], CACHE_PREFETCH, &missed);
+      if (e != NULL) {
+        entries[cnt] = e;
+        block_request_init(&requests[cnt], sectors[i], 1, e->data, false, readahead_done, &done);
+        cnt++;
+      }
+    }
+
+    for (i = 0; i < cnt; i++)
+      block_submit(fs_device, &requests[i]);
+    for (i = 0; i < cnt; i++)
+      sema_down(&done);
+    for (i = 0; i < cnt; i++)
+      cache_put(entries[i], false);
+  }
+}
+
+/* Called by the block layer when read-ahead request R
+   completes. */
+static void readahead_done(struct block_request* r) { sema_up(r->aux); }
+
+/* Writes every dirty sector in the cache back to disk. */
+void cache_flush(void) { flush_dirty(); }
+
+/* Orders cache entries by ascending sector number, for qsort(). */
+static int compare_sectors(const void* a_, const void* b_) {
+  const struct cache_entry* a = *(struct cache_entry* const*)a_;
+  const struct cache_entry* b = *(struct cache_entry* const*)b_;
+
+  return a->sector < b->sector ? -1 : a->sector > b->sector;
+}
+
+/* Writes back the dirty, unheld entries among the CNT pinned
+   entries in RUN, which hold consecutive sectors in ascending
+   order, and unpins them all.  Neighbors are gathered through
+   BUFFER, which has room for CNT sectors, into one multi-sector
+   write.  Returns the number of sectors written. */
+static size_t write_run(struct cache_entry** run, size_t cnt, uint8_t* buffer) {
+  bool write[FLUSH_RUN_MAX];
+  size_t written = 0;
+  size_t i, j;
+
+  ASSERT(cnt <= FLUSH_RUN_MAX);
+
+  /* Locking in ascending sector order cannot deadlock.  Only the
+     read-ahead thread holds more than one entry's lock, and those
+     are entries it took over as victims, so it never waits for
+     another entry's lock. */
+  for (i = 0; i < cnt; i++) {
+    lock_acquire(&run[i]->lock);
+    write[i] = run[i]->dirty && !run[i]->held;
+  }
+
+  for (i = 0; i < cnt; i = j) {
+    if (!write[i]) {
+      j = i + 1;
+      continue;
+    }
+    for (j = i + 1; j < cnt && write[j]; j++)
+      continue;
+
+    if (j - i == 1)
+      block_write(fs_device, run[i]->sector, run[i]->data);
+    else {
+      size_t k;
+      for (k = i; k < j; k++)
+        memcpy(buffer + (k - i) * BLOCK_SECTOR_SIZE, run[k]->data, BLOCK_SECTOR_SIZE);
+      block_write_multiple(fs_device, run[i]->sector, j - i, buffer);
+    }
+  }
+
+  for (i = 0; i < cnt; i++) {
+    if (write[i]) {
+      run[i]->dirty = false;
+      written++;
+    }
+    lock_release(&run[i]->lock);
+  }
+
+  lock_acquire(&cache_lock);
+  for (i = 0; i < cnt; i++)
+    run[i]->pin_cnt--;
+  dirty_cnt -= written;
+  writeback_cnt += written;
+  cond_broadcast(&cache_cond, &cache_lock);
+  lock_release(&cache_lock);
+  return written;
+}
+
+/* Writes back every dirty sector in the cache, in ascending
+   sector order to keep the disk head moving one way, with runs of
+   consecutive sectors written together, and returns the number
+   written. */
+static size_t flush_dirty(void) {
+  struct cache_entry* dirty[CACHE_SIZE];
+  size_t dirty_found = 0;
+  size_t written = 0;
+  uint8_t* buffer;
+  size_t run_max;
+  size_t i, j;
+
+  /* Pin every entry that looks dirty and is not held.  Reading
+     DIRTY without the entry's lock is only a hint; it is checked
+     again below, as is HELD, which may have been set since. */
+  lock_acquire(&cache_lock);
+  for (i = 0; i < CACHE_SIZE; i++) {
+    struct cache_entry* e = &cache[i];
+    if (e->sector != CACHE_NO_SECTOR && e->old_sector == CACHE_NO_SECTOR && e->dirty &&
+        !e->held) {
+      e->pin_cnt++;
+      dirty[dirty_found++] = e;
+    }
+  }
+  lock_release(&cache_lock);
+
+  qsort(dirty, dirty_found, sizeof *dirty, compare_sectors);
+
+  /* Without a buffer to gather runs in, write sectors one by
+     one. */
+  buffer = palloc_get_page(0);
+  run_max = buffer != NULL ? FLUSH_RUN_MAX : 1;
+
+  for (i = 0; i < dirty_found; i = j) {
+    for (j = i + 1; j < dirty_found && j - i < run_max; j++)
+      if (dirty[j]->sector != dirty[j - 1]->sector + 1)
+        break;
+    written += write_run(dirty + i, j - i, buffer);
+  }
+
+  palloc_free_page(buffer);
+  return written;
+}
+
+/* Flusher thread.  Commits the journal and writes back dirty
+   sectors every FLUSH_INTERVAL ticks, or sooner when woken by a
+   writer. */
+static void flush_daemon(void* aux UNUSED) {
+  for (;;) {
+    timer_event_arm(&flush_event, flush_interval * (1000000000 / TIMER_FREQ));
+    sema_down(&flush_sema);
+    timer_event_cancel(&flush_event);
+    while (sema_try_down(&flush_sema))
+      continue;
+
+    flush_wakeup_cnt++;
+    journal_commit();
+    flush_write_cnt += flush_dirty();
+  }
+}
+
+/* Timer event that wakes the flusher.  Runs in the timer
+   interrupt handler. */
+static void flush_timer(void* aux UNUSED) { sema_up(&flush_sema); }
+
+/* Prints buffer cache statistics. */
+void cache_print_stats(void) {
+  printf("Cache: %llu hits, %llu misses, %llu read-ahead, %llu write-backs\n", hit_cnt, miss_cnt,
+         readahead_cnt, writeback_cnt);
+  printf("Flusher: %llu passes, %llu sectors written, %llu writers throttled\n", flush_wakeup_cnt,
+         flush_write_cnt, throttle_cnt);
+}
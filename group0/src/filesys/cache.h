@@ -0,0 +1,21 @@
+#ifndef FILESYS_CACHE_H
+#define FILESYS_CACHE_H
+
+#include "devices/block.h"
+
+/* Number of sectors held by the buffer cache. */
+#define CACHE_SIZE 64
+
+void cache_configure_flush(int64_t ticks);
+void cache_init(void);
+void cache_read(block_sector_t, void*);
+void cache_read_at(block_sector_t, void*, int sector_ofs, int size);
+void cache_write(block_sector_t, const void*);
+void cache_write_at(block_sector_t, const void*, int sector_ofs, int size);
+void cache_write_held(block_sector_t, const void*, int sector_ofs, int size);
+void cache_unhold(block_sector_t, const void* data);
+void cache_readahead(block_sector_t);
+void cache_flush(void);
+void cache_print_stats(void);
+
+#endif /* filesys/cache.h */
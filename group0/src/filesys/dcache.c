@@ -0,0 +1,218 @@
+#include "filesys/dcache.h"
+#include <debug.h>
+#include <hash.h>
+#include <list.h>
+#include <stdio.h>
+#include <string.h>
+#include "filesys/directory.h"
+#include "threads/slab.h"
+#include "threads/synch.h"
+
+/* Dentry cache.  Remembers the result of looking up a name in a
+   directory, keyed by the directory's inode sector and the name,
+   so repeated lookups of the same names skip the directory's
+   data entirely.  Names that were not found are cached too, as
+   negative entries.  At most DCACHE_SIZE entries are kept, the
+   least recently used being evicted first.
+
+   The directory layer must call dcache_invalidate() after every
+   change to a directory.  Each invalidation advances CUR_EPOCH.  A
+   lookup that misses hands the current epoch to its caller, who
+   passes it back to dcache_insert() once it has searched the
+   directory; if an invalidation happened in between, the result
+   may already be stale and is not cached.  When a directory's
+   inode is freed, dcache_invalidate_dir() drops all its entries,
+   since a new directory may reuse the sector. */
+
+/* A cached directory entry. */
+struct dentry {
+  struct hash_elem hash_elem;  /* Element in `dentries'. */
+  struct list_elem lru_elem;   /* Element in `lru_list'. */
+  block_sector_t dir_sector;   /* Sector of the directory's inode. */
+  char name[NAME_MAX + 1];     /* Null terminated file name. */
+  bool exists;                 /* False for a negative entry. */
+  block_sector_t inode_sector; /* Sector of the file's inode, if EXISTS. */
+};
+
+static struct hash dentries;            /* All entries. */
+static struct list lru_list;            /* All entries, most recently used first. */
+static struct lock dcache_lock;         /* Protects all of the above and below. */
+static struct kmem_cache* dentry_cache; /* Cache of `struct dentry' objects. */
+static unsigned cur_epoch;              /* Number of invalidations so far. */
+static bool enabled = true;             /* False to bypass the cache. */
+
+/* Statistics. */
+static unsigned long long hit_cnt;      /* Lookups answered by a positive entry. */
+static unsigned long long negative_cnt; /* Lookups answered by a negative entry. */
+static unsigned long long miss_cnt;     /* Lookups not answered. */
+static unsigned long long evict_cnt;    /* Entries evicted to make room. */
+
+static hash_hash_func dentry_hash;
+static hash_less_func dentry_less;
+
+/* Initializes the dentry cache. */
+void dcache_init(void) {
+  if (!hash_init(&dentries, dentry_hash, dentry_less, NULL))
+    PANIC("dentry cache initialization failed");
+  list_init(&lru_list);
+  lock_init(&dcache_lock);
+  dentry_cache = kmem_cache_create("dentry", sizeof(struct dentry), NULL);
+}
+
+/* Returns a hash value for dentry E. */
+static unsigned dentry_hash(const struct hash_elem* e, void* aux UNUSED) {
+  const struct dentry* d = hash_entry(e, struct dentry, hash_elem);
+  return hash_string(d->name) ^ hash_int(d->dir_sector);
+}
+
+/* Returns true if dentry A precedes dentry B. */
+static bool dentry_less(const struct hash_elem* a_, const struct hash_elem* b_,
+                        void* aux UNUSED) {
+  const struct dentry* a = hash_entry(a_, struct dentry, hash_elem);
+  const struct dentry* b = hash_entry(b_, struct dentry, hash_elem);
+
+  if (a->dir_sector != b->dir_sector)
+    return a->dir_sector < b->dir_sector;
+  return strcmp(a->name, b->name) < 0;
+}
+
+/* Returns the entry for NAME in the directory whose inode is in
+   DIR_SECTOR, or a null pointer if there is none.  Names too
+   long to be stored are never found. */
+static struct dentry* find(block_sector_t dir_sector, const char* name) {
+  struct dentry key;
+  struct hash_elem* e;
+
+  ASSERT(lock_held_by_current_thread(&dcache_lock));
+
+  if (strlen(name) > NAME_MAX)
+    return NULL;
+  key.dir_sector = dir_sector;
+  strlcpy(key.name, name, sizeof key.name);
+  e = hash_find(&dentries, &key.hash_elem);
+  return e != NULL ? hash_entry(e, struct dentry, hash_elem) : NULL;
+}
+
+/* Removes dentry D from the cache and frees it. */
+static void discard(struct dentry* d) {
+  ASSERT(lock_held_by_current_thread(&dcache_lock));
+
+  hash_delete(&dentries, &d->hash_elem);
+  list_remove(&d->lru_elem);
+  kmem_cache_free(dentry_cache, d);
+}
+
+/* Looks up NAME in the directory whose inode is in DIR_SECTOR.
+   On DCACHE_HIT, stores the sector of the file's inode into
+   *INODE_SECTOR.  On DCACHE_MISS, stores into *EPOCH the value
+   to pass to dcache_insert() with the result of searching the
+   directory. */
+enum dcache_result dcache_lookup(block_sector_t dir_sector, const char* name,
+                                 block_sector_t* inode_sector, unsigned* epoch) {
+  enum dcache_result result;
+  struct dentry* d;
+
+  lock_acquire(&dcache_lock);
+  d = enabled ? find(dir_sector, name) : NULL;
+  if (d == NULL) {
+    *epoch = cur_epoch;
+    if (enabled)
+      miss_cnt++;
+    result = DCACHE_MISS;
+  } else {
+    list_remove(&d->lru_elem);
+    list_push_front(&lru_list, &d->lru_elem);
+    if (d->exists) {
+      *inode_sector = d->inode_sector;
+      hit_cnt++;
+      result = DCACHE_HIT;
+    } else {
+      negative_cnt++;
+      result = DCACHE_NEGATIVE;
+    }
+  }
+  lock_release(&dcache_lock);
+
+  return result;
+}
+
+/* Caches the result of searching the directory whose inode is in
+   DIR_SECTOR for NAME: whether it EXISTS and, if so, the sector
+   of its inode, INODE_SECTOR.  EPOCH must have been obtained
+   from the dcache_lookup() that missed before the search.  Does
+   nothing if the directory may have changed since, or if memory
+   is short. */
+void dcache_insert(block_sector_t dir_sector, const char* name, bool exists,
+                   block_sector_t inode_sector, unsigned epoch) {
+  struct dentry* d;
+
+  if (strlen(name) > NAME_MAX)
+    return;
+
+  lock_acquire(&dcache_lock);
+  if (!enabled || epoch != cur_epoch || find(dir_sector, name) != NULL)
+    goto done;
+
+  if (hash_size(&dentries) >= DCACHE_SIZE) {
+    discard(list_entry(list_back(&lru_list), struct dentry, lru_elem));
+    evict_cnt++;
+  }
+
+  d = kmem_cache_alloc(dentry_cache);
+  if (d == NULL)
+    goto done;
+  d->dir_sector = dir_sector;
+  strlcpy(d->name, name, sizeof d->name);
+  d->exists = exists;
+  d->inode_sector = inode_sector;
+  hash_insert(&dentries, &d->hash_elem);
+  list_push_front(&lru_list, &d->lru_elem);
+
+done:
+  lock_release(&dcache_lock);
+}
+
+/* Forgets any cached result for NAME in the directory whose inode
+   is in DIR_SECTOR.  Must be called after the directory entry for
+   NAME is added or removed. */
+void dcache_invalidate(block_sector_t dir_sector, const char* name) {
+  struct dentry* d;
+
+  lock_acquire(&dcache_lock);
+  d = find(dir_sector, name);
+  if (d != NULL)
+    discard(d);
+  cur_epoch++;
+  lock_release(&dcache_lock);
+}
+
+/* Forgets every cached result for the directory whose inode is
+   in DIR_SECTOR.  Must be called when that inode is freed. */
+void dcache_invalidate_dir(block_sector_t dir_sector) {
+  struct list_elem* e;
+
+  lock_acquire(&dcache_lock);
+  for (e = list_begin(&lru_list); e != list_end(&lru_list);) {
+    struct dentry* d = list_entry(e, struct dentry, lru_elem);
+    e = list_next(e);
+    if (d->dir_sector == dir_sector)
+      discard(d);
+  }
+  cur_epoch++;
+  lock_release(&dcache_lock);
+}
+
+/* Turns the dentry cache on if ON is true, off otherwise.
+   While it is off, every lookup misses and nothing is cached,
+   but invalidations still take effect. */
+void dcache_set_enabled(bool on) {
+  lock_acquire(&dcache_lock);
+  enabled = on;
+  lock_release(&dcache_lock);
+}
+
+/* Prints dentry cache statistics. */
+void dcache_print_stats(void) {
+  printf("Dentry cache: %llu hits, %llu negative hits, %llu misses, %llu evictions\n", hit_cnt,
+         negative_cnt, miss_cnt, evict_cnt);
+}
@@ -0,0 +1,27 @@
+#ifndef FILESYS_DCACHE_H
+#define FILESYS_DCACHE_H
+
+#include <stdbool.h>
+#include "devices/block.h"
+
+/* Maximum number of cached directory entries. */
+#define DCACHE_SIZE 256
+
+/* Result of a dentry cache lookup. */
+enum dcache_result {
+  DCACHE_MISS,    /* Not cached, look in the directory. */
+  DCACHE_HIT,     /* Cached, the entry exists. */
+  DCACHE_NEGATIVE /* Cached, no such entry. */
+};
+
+void dcache_init(void);
+enum dcache_result dcache_lookup(block_sector_t dir_sector, const char* name,
+                                 block_sector_t* inode_sector, unsigned* epoch);
+void dcache_insert(block_sector_t dir_sector, const char* name, bool exists,
+                   block_sector_t inode_sector, unsigned epoch);
+void dcache_invalidate(block_sector_t dir_sector, const char* name);
+void dcache_invalidate_dir(block_sector_t dir_sector);
+void dcache_set_enabled(bool on);
+void dcache_print_stats(void);
+
+#endif /* filesys/dcache.h */
@@ -1,14 +1,20 @@
 #include "filesys/directory.h"
+#include <stddef.h>
 #include <stdio.h>
 #include <string.h>
+#include <hash.h>
 #include <list.h>
+#include <round.h>
+#include "filesys/dcache.h"
 #include "filesys/filesys.h"
 #include "filesys/inode.h"
-#include "threads/malloc.h"
+#include "filesys/journal.h"
+#include "threads/slab.h"
 
 /* A directory. */
 struct dir {
   struct inode* inode; /* Backing store. */
+  bool hashed;         /* DIR_HASHED layout? */
   off_t pos;           /* Current position. */
 };
 
@@ -19,23 +25,356 @@ struct dir_entry {
   bool in_use;                 /* In use or free? */
 };
 
+/* A DIR_LINEAR directory is simply an array of `struct
+   dir_entry'.
+
+   A DIR_HASHED directory uses extendible hashing.  Its file is
+   made of sectors: the root in sector 0, then table and leaf
+   sectors in the order they were added.  Each leaf holds the
+   entries whose name hashes agree in their low DEPTH bits.  The
+   table maps the low bits of a hash, as many as the root's
+   global depth, to the leaf for that hash.  A full leaf is split
+   in two on the next bit, doubling the table first if the leaf
+   already uses every bit the table does.
+
+   Only the slot for a leaf's own DEPTH bits is ever set; the
+   slots for longer hashes that belong in the same leaf are left
+   0, as is every slot of a table sector not yet allocated
+   (listed in the root as file sector 0).  A lookup clears the
+   hash's high bits one at a time until it finds a set slot, so
+   it reads one table slot per bit the leaf lacks, plus the leaf.
+   This way doubling the table only writes the root and a split
+   writes one slot, keeping each directory operation to a few
+   journaled sectors however large the directory.
+
+   The root begins with an unused entry whose name is empty
+   except for `dir_magic' after the null terminator.  A linear
+   directory never has such an entry, since names cannot be
+   empty, which is how the two layouts are told apart.
+
+   Either way, a directory's entries are protected by its inode's
+   directory lock, see inode_lock_dir().  Lookups and
+   dir_readdir() share it, while dir_add() and dir_remove() hold
+   it exclusively.  Directory data is journaled, so each of those
+   opens a journal handle before taking the lock. */
+
+/* Entries per leaf, slots per table sector, and table sectors
+   listed in the root. */
+#define DIR_LEAF_CNT 25
+#define DIR_TABLE_CNT 127
+#define DIR_ROOT_TABLES 121
+
+/* Maximum global depth that fits DIR_ROOT_TABLES table sectors. */
+#define DIR_MAX_DEPTH 13
+
+/* Maximum global depth of a new directory, whatever its size
+   hint, so that creating one journals a handful of sectors.
+   Larger directories grow by splitting. */
+#define DIR_CREATE_DEPTH 2
+
+/* Most leaf splits a single dir_add() makes before giving up.
+   Each split journals a few sectors, see JOURNAL_HANDLE_BLOCKS. */
+#define DIR_SPLIT_MAX 2
+
+/* Identifies a hashed directory in its first entry. */
+static const char dir_magic[NAME_MAX] = "hashed dir";
+
+/* Sector types, at the start of leaf and table sectors. */
+#define DIR_LEAF 0x4641454c  /* "LEAF" */
+#define DIR_TABLE 0x4c424154 /* "TABL" */
+
+/* Root of a hashed directory, in file sector 0. */
+struct dir_root {
+  struct dir_entry header;          /* Unused entry holding `dir_magic'. */
+  uint32_t depth;                   /* The table has 1 << DEPTH slots. */
+  uint32_t table_cnt;               /* Number of table sectors. */
+  uint32_t tables[DIR_ROOT_TABLES]; /* File sector of each table sector. */
+};
+
+/* A leaf of a hashed directory. */
+struct dir_leaf {
+  uint32_t type;                          /* DIR_LEAF. */
+  uint32_t depth;                         /* Number of hash bits shared by entries. */
+  struct dir_entry entries[DIR_LEAF_CNT]; /* Entries. */
+  uint8_t unused[4];                      /* Not used. */
+};
+
+/* A table sector of a hashed directory. */
+struct dir_table {
+  uint32_t type;                 /* DIR_TABLE. */
+  uint32_t slots[DIR_TABLE_CNT]; /* File sector of the leaf for each slot. */
+};
+
+/* Cache of `struct dir' objects. */
+static struct kmem_cache* dir_cache;
+
+/* Initializes the directory module. */
+void dir_init(void) { dir_cache = kmem_cache_create("dir", sizeof(struct dir), NULL); }
+
+/* Returns the hash of NAME in a hashed directory.  FNV's low bits
+   depend only on the low bits of each character, so the high
+   bits are mixed down into them. */
+static uint32_t name_hash(const char* name) {
+  uint32_t h = hash_string(name);
+  h ^= h >> 16;
+  h *= 0x45d9f3b;
+  h ^= h >> 16;
+  return h;
+}
+
+/* Returns the file offset of entry IDX of leaf LEAF_SECTOR. */
+static off_t leaf_entry_ofs(uint32_t leaf_sector, size_t idx) {
+  return leaf_sector * BLOCK_SECTOR_SIZE + offsetof(struct dir_leaf, entries) +
+         idx * sizeof(struct dir_entry);
+}
+
+/* Returns true if INODE holds a hashed directory. */
+static bool is_hashed(struct inode* inode) {
+  struct dir_entry e;
+
+  return (inode_read_at(inode, &e, sizeof e, 0) == sizeof e && !e.in_use && e.name[0] == '\0' &&
+          !memcmp(e.name + 1, dir_magic, sizeof dir_magic));
+}
+
+/* Reads the root of hashed directory INODE into *ROOT. */
+static bool read_root(struct inode* inode, struct dir_root* root) {
+  return inode_read_at(inode, root, sizeof *root, 0) == sizeof *root;
+}
+
+/* Writes ROOT to hashed directory INODE. */
+static bool write_root(struct inode* inode, const struct dir_root* root) {
+  return inode_write_at(inode, root, sizeof *root, 0) == sizeof *root;
+}
+
+/* Appends the sector in BUFFER to hashed directory INODE and
+   stores its file sector into *SECTOR. */
+static bool append_sector(struct inode* inode, const void* buffer, uint32_t* sector) {
+  off_t ofs = inode_length(inode);
+
+  ASSERT(ofs % BLOCK_SECTOR_SIZE == 0);
+  *sector = ofs / BLOCK_SECTOR_SIZE;
+  return inode_write_at(inode, buffer, BLOCK_SECTOR_SIZE, ofs) == BLOCK_SECTOR_SIZE;
+}
+
+/* Returns the file offset of table slot IDX in ROOT's table. */
+static off_t slot_ofs(const struct dir_root* root, uint32_t idx) {
+  return root->tables[idx / DIR_TABLE_CNT] * BLOCK_SECTOR_SIZE +
+         offsetof(struct dir_table, slots) + idx % DIR_TABLE_CNT * sizeof(uint32_t);
+}
+
+/* Stores the leaf sector in slot IDX of ROOT's table, or 0 if
+   the slot is not set, into *LEAF_SECTOR. */
+static bool get_slot(struct inode* inode, const struct dir_root* root, uint32_t idx,
+                     uint32_t* leaf_sector) {
+  if (root->tables[idx / DIR_TABLE_CNT] == 0) {
+    *leaf_sector = 0;
+    return true;
+  }
+  return inode_read_at(inode, leaf_sector, sizeof *leaf_sector, slot_ofs(root, idx)) ==
+         sizeof *leaf_sector;
+}
+
+/* Stores LEAF_SECTOR in slot IDX of ROOT's table, first
+   allocating the table sector that holds it, and writing ROOT,
+   if there is none yet. */
+static bool set_slot(struct inode* inode, struct dir_root* root, uint32_t idx,
+                     uint32_t leaf_sector) {
+  uint32_t* table_sector = &root->tables[idx / DIR_TABLE_CNT];
+
+  if (*table_sector == 0) {
+    struct dir_table table;
+    memset(&table, 0, sizeof table);
+    table.type = DIR_TABLE;
+    if (!append_sector(inode, &table, table_sector))
+      return false;
+    root->table_cnt++;
+    if (!write_root(inode, root))
+      return false;
+  }
+  return inode_write_at(inode, &leaf_sector, sizeof leaf_sector, slot_ofs(root, idx)) ==
+         sizeof leaf_sector;
+}
+
+/* Reads the root of hashed directory INODE into *ROOT and the
+   leaf that HASH belongs in into *LEAF, storing its file sector
+   into *LEAF_SECTOR. */
+static bool find_leaf(struct inode* inode, uint32_t hash, struct dir_root* root,
+                      struct dir_leaf* leaf, uint32_t* leaf_sector) {
+  uint32_t depth;
+
+  if (!read_root(inode, root))
+    return false;
+  for (depth = root->depth;; depth--) {
+    if (!get_slot(inode, root, hash & ((1u << depth) - 1), leaf_sector))
+      return false;
+    if (*leaf_sector != 0)
+      break;
+    if (depth == 0)
+      return false;
+  }
+  return (inode_read_at(inode, leaf, sizeof *leaf, *leaf_sector * BLOCK_SECTOR_SIZE) ==
+          sizeof *leaf);
+}
+
+/* Doubles the table of hashed directory INODE, whose root is
+   ROOT.  The new slots are left unset, so each one leads to the
+   same leaf as its counterpart in the lower half. */
+static bool grow_table(struct inode* inode, struct dir_root* root) {
+  if (root->depth >= DIR_MAX_DEPTH)
+    return false;
+  root->depth++;
+  return write_root(inode, root);
+}
+
+/* Splits LEAF, in file sector LEAF_SECTOR of hashed directory
+   INODE, moving the entries whose hash has the next bit set to a
+   new leaf.  HASH is any hash that belongs in LEAF. */
+static bool split_leaf(struct inode* inode, struct dir_root* root, struct dir_leaf* leaf,
+                       uint32_t leaf_sector, uint32_t hash) {
+  uint32_t depth = leaf->depth;
+  uint32_t bit = 1u << depth;
+  struct dir_leaf new_leaf;
+  uint32_t new_sector;
+  size_t i, j;
+
+  if (depth == root->depth && !grow_table(inode, root))
+    return false;
+
+  memset(&new_leaf, 0, sizeof new_leaf);
+  new_leaf.type = DIR_LEAF;
+  new_leaf.depth = leaf->depth = depth + 1;
+  for (i = j = 0; i < DIR_LEAF_CNT; i++)
+    if (leaf->entries[i].in_use && (name_hash(leaf->entries[i].name) & bit)) {
+      new_leaf.entries[j++] = leaf->entries[i];
+      leaf->entries[i].in_use = false;
+    }
+
+  if (!append_sector(inode, &new_leaf, &new_sector) ||
+      inode_write_at(inode, leaf, sizeof *leaf, leaf_sector * BLOCK_SECTOR_SIZE) != sizeof *leaf)
+    return false;
+
+  /* Point the slot for LEAF's low bits with BIT set at the new
+     leaf.  The longer hashes that share those bits have unset
+     slots, so they follow it too. */
+  return set_slot(inode, root, (hash & (bit - 1)) | bit, new_sector);
+}
+
+/* Creates a hashed directory in SECTOR with enough leaves for
+   ENTRY_CNT entries. */
+static bool create_hashed(block_sector_t sector, size_t entry_cnt) {
+  struct inode* inode;
+  struct dir_root root;
+  struct dir_table table;
+  struct dir_leaf leaf;
+  uint32_t depth, leaf_cnt, idx, unused;
+  bool success = false;
+
+  ASSERT(sizeof root == BLOCK_SECTOR_SIZE);
+  ASSERT(sizeof table == BLOCK_SECTOR_SIZE);
+  ASSERT(sizeof leaf == BLOCK_SECTOR_SIZE);
+
+  depth = 0;
+  while (depth < DIR_CREATE_DEPTH && (1u << depth) * DIR_LEAF_CNT < entry_cnt)
+    depth++;
+  leaf_cnt = 1u << depth;
+
+  if (!inode_create(sector, 0))
+    return false;
+  inode = inode_open(sector);
+  if (inode == NULL)
+    return false;
+  inode_set_journaled(inode);
+
+  /* Root, then the table sectors, then the leaves. */
+  memset(&root, 0, sizeof root);
+  memcpy(root.header.name + 1, dir_magic, sizeof dir_magic);
+  root.depth = depth;
+  root.table_cnt = DIV_ROUND_UP(leaf_cnt, DIR_TABLE_CNT);
+  for (idx = 0; idx < root.table_cnt; idx++)
+    root.tables[idx] = 1 + idx;
+  if (!write_root(inode, &root))
+    goto done;
+
+  for (idx = 0; idx < root.table_cnt * DIR_TABLE_CNT; idx++) {
+    if (idx % DIR_TABLE_CNT == 0) {
+      memset(&table, 0, sizeof table);
+      table.type = DIR_TABLE;
+    }
+    if (idx < leaf_cnt)
+      table.slots[idx % DIR_TABLE_CNT] = 1 + root.table_cnt + idx;
+    if (idx % DIR_TABLE_CNT == DIR_TABLE_CNT - 1 && !append_sector(inode, &table, &unused))
+      goto done;
+  }
+
+  memset(&leaf, 0, sizeof leaf);
+  leaf.type = DIR_LEAF;
+  leaf.depth = depth;
+  for (idx = 0; idx < leaf_cnt; idx++)
+    if (!append_sector(inode, &leaf, &unused))
+      goto done;
+  success = true;
+
+done:
+  if (!success)
+    inode_remove(inode);
+  inode_close(inode);
+  return success;
+}
+
+/* Creates a linear directory in SECTOR sized for ENTRY_CNT
+   entries.  Only the last entry is written; the rest are a hole,
+   which reads as unused entries, so that creating the directory
+   journals one data sector however large it is. */
+static bool create_linear(block_sector_t sector, size_t entry_cnt) {
+  struct inode* inode;
+  struct dir_entry e;
+  bool success;
+
+  if (!inode_create(sector, 0))
+    return false;
+  if (entry_cnt == 0)
+    return true;
+  inode = inode_open(sector);
+  if (inode == NULL)
+    return false;
+  inode_set_journaled(inode);
+
+  memset(&e, 0, sizeof e);
+  success = inode_write_at(inode, &e, sizeof e, (entry_cnt - 1) * sizeof e) == sizeof e;
+  if (!success)
+    inode_remove(inode);
+  inode_close(inode);
+  return success;
+}
+
 /* Creates a directory with space for ENTRY_CNT entries in the
-   given SECTOR.  Returns true if successful, false on failure. */
-bool dir_create(block_sector_t sector, size_t entry_cnt) {
-  return inode_create(sector, entry_cnt * sizeof(struct dir_entry));
+   given SECTOR, laid out as LAYOUT.  Returns true if successful,
+   false on failure. */
+bool dir_create(block_sector_t sector, size_t entry_cnt, enum dir_layout layout) {
+  bool success;
+
+  journal_begin();
+  if (layout == DIR_HASHED)
+    success = create_hashed(sector, entry_cnt);
+  else
+    success = create_linear(sector, entry_cnt);
+  journal_end();
+  return success;
 }
 
 /* Opens and returns the directory for the given INODE, of which
    it takes ownership.  Returns a null pointer on failure. */
 struct dir* dir_open(struct inode* inode) {
-  struct dir* dir = calloc(1, sizeof *dir);
+  struct dir* dir = kmem_cache_alloc(dir_cache);
   if (inode != NULL && dir != NULL) {
+    inode_set_journaled(inode);
     dir->inode = inode;
+    dir->hashed = is_hashed(inode);
     dir->pos = 0;
     return dir;
   } else {
     inode_close(inode);
-    free(dir);
+    kmem_cache_free(dir_cache, dir);
     return NULL;
   }
 }
@@ -56,7 +395,7 @@ struct dir* dir_reopen(struct dir* dir) {
 void dir_close(struct dir* dir) {
   if (dir != NULL) {
     inode_close(dir->inode);
-    free(dir);
+    kmem_cache_free(dir_cache, dir);
   }
 }
 
@@ -77,6 +416,25 @@ static bool lookup(const struct dir* dir, const char* name, struct dir_entry* ep
   ASSERT(dir != NULL);
   ASSERT(name != NULL);
 
+  if (dir->hashed) {
+    struct dir_root root;
+    struct dir_leaf leaf;
+    uint32_t leaf_sector;
+    size_t i;
+
+    if (!find_leaf(dir->inode, name_hash(name), &root, &leaf, &leaf_sector))
+      return false;
+    for (i = 0; i < DIR_LEAF_CNT; i++)
+      if (leaf.entries[i].in_use && !strcmp(name, leaf.entries[i].name)) {
+        if (ep != NULL)
+          *ep = leaf.entries[i];
+        if (ofsp != NULL)
+          *ofsp = leaf_entry_ofs(leaf_sector, i);
+        return true;
+      }
+    return false;
+  }
+
   for (ofs = 0; inode_read_at(dir->inode, &e, sizeof e, ofs) == sizeof e; ofs += sizeof e)
     if (e.in_use && !strcmp(name, e.name)) {
       if (ep != NULL)
@@ -93,19 +451,65 @@ static bool lookup(const struct dir* dir, const char* name, struct dir_entry* ep
    On success, sets *INODE to an inode for the file, otherwise to
    a null pointer.  The caller must close *INODE. */
 bool dir_lookup(const struct dir* dir, const char* name, struct inode** inode) {
+  block_sector_t dir_sector, inode_sector;
   struct dir_entry e;
+  unsigned epoch;
 
   ASSERT(dir != NULL);
   ASSERT(name != NULL);
 
-  if (lookup(dir, name, &e, NULL))
-    *inode = inode_open(e.inode_sector);
-  else
-    *inode = NULL;
+  dir_sector = inode_get_inumber(dir->inode);
+  inode_lock_dir(dir->inode, true);
+  switch (dcache_lookup(dir_sector, name, &inode_sector, &epoch)) {
+    case DCACHE_HIT:
+      *inode = inode_open(inode_sector);
+      break;
+    case DCACHE_NEGATIVE:
+      *inode = NULL;
+      break;
+    default:
+      if (lookup(dir, name, &e, NULL)) {
+        dcache_insert(dir_sector, name, true, e.inode_sector, epoch);
+        *inode = inode_open(e.inode_sector);
+      } else {
+        dcache_insert(dir_sector, name, false, 0, epoch);
+        *inode = NULL;
+      }
+      break;
+  }
+  inode_unlock_dir(dir->inode, true);
 
   return *inode != NULL;
 }
 
+/* Adds an entry for NAME to hashed directory DIR, splitting its
+   leaf up to DIR_SPLIT_MAX times to make room. */
+static bool add_hashed(struct dir* dir, const char* name, block_sector_t inode_sector) {
+  uint32_t hash = name_hash(name);
+  int split_cnt;
+
+  for (split_cnt = 0;; split_cnt++) {
+    struct dir_root root;
+    struct dir_leaf leaf;
+    uint32_t leaf_sector;
+    size_t i;
+
+    if (!find_leaf(dir->inode, hash, &root, &leaf, &leaf_sector))
+      return false;
+    for (i = 0; i < DIR_LEAF_CNT; i++)
+      if (!leaf.entries[i].in_use) {
+        struct dir_entry e;
+        e.in_use = true;
+        strlcpy(e.name, name, sizeof e.name);
+        e.inode_sector = inode_sector;
+        return (inode_write_at(dir->inode, &e, sizeof e, leaf_entry_ofs(leaf_sector, i)) ==
+                sizeof e);
+      }
+    if (split_cnt >= DIR_SPLIT_MAX || !split_leaf(dir->inode, &root, &leaf, leaf_sector, hash))
+      return false;
+  }
+}
+
 /* Adds a file named NAME to DIR, which must not already contain a
    file by that name.  The file's inode is in sector
    INODE_SECTOR.
@@ -125,9 +529,16 @@ bool dir_add(struct dir* dir, const char* name, block_sector_t inode_sector) {
     return false;
 
   /* Check that NAME is not in use. */
+  journal_begin();
+  inode_lock_dir(dir->inode, false);
   if (lookup(dir, name, NULL, NULL))
     goto done;
 
+  if (dir->hashed) {
+    success = add_hashed(dir, name, inode_sector);
+    goto done;
+  }
+
   /* Set OFS to offset of free slot.
      If there are no free slots, then it will be set to the
      current end-of-file.
@@ -146,6 +557,10 @@ bool dir_add(struct dir* dir, const char* name, block_sector_t inode_sector) {
   success = inode_write_at(dir->inode, &e, sizeof e, ofs) == sizeof e;
 
 done:
+  if (success)
+    dcache_invalidate(inode_get_inumber(dir->inode), name);
+  inode_unlock_dir(dir->inode, false);
+  journal_end();
   return success;
 }
 
@@ -162,6 +577,8 @@ bool dir_remove(struct dir* dir, const char* name) {
   ASSERT(name != NULL);
 
   /* Find directory entry. */
+  journal_begin();
+  inode_lock_dir(dir->inode, false);
   if (!lookup(dir, name, &e, &ofs))
     goto done;
 
@@ -176,26 +593,71 @@ bool dir_remove(struct dir* dir, const char* name) {
     goto done;
 
   /* Remove inode. */
+  dcache_invalidate(inode_get_inumber(dir->inode), name);
   inode_remove(inode);
   success = true;
 
 done:
+  inode_unlock_dir(dir->inode, false);
   inode_close(inode);
+  journal_end();
   return success;
 }
 
+/* dir_readdir() for a hashed directory.  DIR's position counts
+   DIR_LEAF_CNT entry positions for every sector of the file,
+   skipping the root and table sectors. */
+static bool readdir_hashed(struct dir* dir, char name[NAME_MAX + 1]) {
+  off_t sector_cnt = inode_length(dir->inode) / BLOCK_SECTOR_SIZE;
+
+  for (;;) {
+    off_t sector = dir->pos / DIR_LEAF_CNT;
+    uint32_t type;
+    struct dir_entry e;
+
+    if (sector == 0) {
+      dir->pos = DIR_LEAF_CNT;
+      continue;
+    }
+    if (sector >= sector_cnt ||
+        inode_read_at(dir->inode, &type, sizeof type, sector * BLOCK_SECTOR_SIZE) != sizeof type)
+      return false;
+    if (type != DIR_LEAF) {
+      dir->pos = (sector + 1) * DIR_LEAF_CNT;
+      continue;
+    }
+
+    if (inode_read_at(dir->inode, &e, sizeof e, leaf_entry_ofs(sector, dir->pos % DIR_LEAF_CNT)) !=
+        sizeof e)
+      return false;
+    dir->pos++;
+    if (e.in_use) {
+      strlcpy(name, e.name, NAME_MAX + 1);
+      return true;
+    }
+  }
+}
+
 /* Reads the next directory entry in DIR and stores the name in
    NAME.  Returns true if successful, false if the directory
    contains no more entries. */
 bool dir_readdir(struct dir* dir, char name[NAME_MAX + 1]) {
   struct dir_entry e;
+  bool success = false;
 
-  while (inode_read_at(dir->inode, &e, sizeof e, dir->pos) == sizeof e) {
-    dir->pos += sizeof e;
-    if (e.in_use) {
-      strlcpy(name, e.name, NAME_MAX + 1);
-      return true;
+  inode_lock_dir(dir->inode, true);
+  if (dir->hashed)
+    success = readdir_hashed(dir, name);
+  else
+    while (inode_read_at(dir->inode, &e, sizeof e, dir->pos) == sizeof e) {
+      dir->pos += sizeof e;
+      if (e.in_use) {
+        strlcpy(name, e.name, NAME_MAX + 1);
+        success = true;
+        break;
+      }
     }
-  }
-  return false;
+  inode_unlock_dir(dir->inode, true);
+
+  return success;
 }
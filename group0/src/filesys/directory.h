@@ -13,8 +13,15 @@
 
 struct inode;
 
+/* On-disk layout of a directory. */
+enum dir_layout {
+  DIR_LINEAR, /* Array of entries, searched linearly. */
+  DIR_HASHED  /* Extendible hash table of entries. */
+};
+
 /* Opening and closing directories. */
-bool dir_create(block_sector_t sector, size_t entry_cnt);
+void dir_init(void);
+bool dir_create(block_sector_t sector, size_t entry_cnt, enum dir_layout);
 struct dir* dir_open(struct inode*);
 struct dir* dir_open_root(void);
 struct dir* dir_reopen(struct dir*);
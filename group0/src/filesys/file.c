@@ -1,28 +1,47 @@
 #include "filesys/file.h"
 #include <debug.h>
+#include "devices/block.h"
 #include "filesys/inode.h"
-#include "threads/malloc.h"
+#include "threads/slab.h"
+
+/* Read-ahead window bounds, in sectors. */
+#define RA_MIN_SECTORS 4
+#define RA_MAX_SECTORS 16
 
 /* An open file. */
 struct file {
   struct inode* inode; /* File's inode. */
   off_t pos;           /* Current position. */
   bool deny_write;     /* Has file_deny_write() been called? */
+  off_t ra_next;       /* Offset just past the previous read. */
+  off_t ra_end;        /* End of bytes already requested for read-ahead. */
+  int ra_window;       /* Read-ahead window, in sectors. */
 };
 
+static void file_readahead(struct file*, off_t file_ofs, off_t bytes_read);
+
+/* Cache of `struct file' objects. */
+static struct kmem_cache* file_cache;
+
+/* Initializes the file module. */
+void file_init(void) { file_cache = kmem_cache_create("file", sizeof(struct file), NULL); }
+
 /* Opens a file for the given INODE, of which it takes ownership,
    and returns the new file.  Returns a null pointer if an
    allocation fails or if INODE is null. */
 struct file* file_open(struct inode* inode) {
-  struct file* file = calloc(1, sizeof *file);
+  struct file* file = kmem_cache_alloc(file_cache);
   if (inode != NULL && file != NULL) {
     file->inode = inode;
     file->pos = 0;
     file->deny_write = false;
+    file->ra_next = 0;
+    file->ra_end = 0;
+    file->ra_window = 0;
     return file;
   } else {
     inode_close(inode);
-    free(file);
+    kmem_cache_free(file_cache, file);
     return NULL;
   }
 }
@@ -38,7 +57,7 @@ void file_close(struct file* file) {
   if (file != NULL) {
     file_allow_write(file);
     inode_close(file->inode);
-    free(file);
+    kmem_cache_free(file_cache, file);
   }
 }
 
@@ -54,6 +73,7 @@ struct inode* file_get_inode(struct file* file) {
    Advances FILE's position by the number of bytes read. */
 off_t file_read(struct file* file, void* buffer, off_t size) {
   off_t bytes_read = inode_read_at(file->inode, buffer, size, file->pos);
+  file_readahead(file, file->pos, bytes_read);
   file->pos += bytes_read;
   return bytes_read;
 }
@@ -64,15 +84,49 @@ off_t file_read(struct file* file, void* buffer, off_t size) {
    which may be less than SIZE if end of file is reached.
    The file's current position is unaffected. */
 off_t file_read_at(struct file* file, void* buffer, off_t size, off_t file_ofs) {
-  return inode_read_at(file->inode, buffer, size, file_ofs);
+  off_t bytes_read = inode_read_at(file->inode, buffer, size, file_ofs);
+  file_readahead(file, file_ofs, bytes_read);
+  return bytes_read;
+}
+
+/* Updates FILE's read-ahead state after BYTES_READ bytes were
+   read starting at FILE_OFS.  A read that starts where the
+   previous one ended doubles the read-ahead window, up to
+   RA_MAX_SECTORS, and keeps that much data requested ahead of
+   the reader; any other read halves the window and requests
+   nothing. */
+static void file_readahead(struct file* file, off_t file_ofs, off_t bytes_read) {
+  off_t target;
+
+  if (file_ofs != file->ra_next) {
+    file->ra_window /= 2;
+    file->ra_next = file_ofs + bytes_read;
+    file->ra_end = file->ra_next;
+    return;
+  }
+
+  if (file->ra_window < RA_MIN_SECTORS)
+    file->ra_window = RA_MIN_SECTORS;
+  else if (file->ra_window < RA_MAX_SECTORS)
+    file->ra_window *= 2;
+
+  file->ra_next = file_ofs + bytes_read;
+  if (file->ra_end < file->ra_next)
+    file->ra_end = file->ra_next;
+
+  target = file->ra_next + file->ra_window * BLOCK_SECTOR_SIZE;
+  if (target > file->ra_end) {
+    inode_readahead(file->inode, target - file->ra_end, file->ra_end);
+    file->ra_end = target;
+  }
 }
 
 /* Writes SIZE bytes from BUFFER into FILE,
    starting at the file's current position.
    Returns the number of bytes actually written,
-   which may be less than SIZE if end of file is reached.
-   (Normally we'd grow the file in that case, but file growth is
-   not yet implemented.)
+   which may be less than SIZE if the disk is full or the
+   maximum file size is reached.  Writing past end of file
+   extends the file.
    Advances FILE's position by the number of bytes read. */
 off_t file_write(struct file* file, const void* buffer, off_t size) {
   off_t bytes_written = inode_write_at(file->inode, buffer, size, file->pos);
@@ -83,9 +137,9 @@ off_t file_write(struct file* file, const void* buffer, off_t size) {
 /* Writes SIZE bytes from BUFFER into FILE,
    starting at offset FILE_OFS in the file.
    Returns the number of bytes actually written,
-   which may be less than SIZE if end of file is reached.
-   (Normally we'd grow the file in that case, but file growth is
-   not yet implemented.)
+   which may be less than SIZE if the disk is full or the
+   maximum file size is reached.  Writing past end of file
+   extends the file.
    The file's current position is unaffected. */
 off_t file_write_at(struct file* file, const void* buffer, off_t size, off_t file_ofs) {
   return inode_write_at(file->inode, buffer, size, file_ofs);
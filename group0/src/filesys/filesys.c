@@ -2,9 +2,12 @@
 #include <debug.h>
 #include <stdio.h>
 #include <string.h>
+#include "filesys/cache.h"
+#include "filesys/dcache.h"
 #include "filesys/file.h"
 #include "filesys/free-map.h"
 #include "filesys/inode.h"
+#include "filesys/journal.h"
 #include "filesys/directory.h"
 
 /* Partition that contains the file system. */
@@ -19,7 +22,12 @@ void filesys_init(bool format) {
   if (fs_device == NULL)
     PANIC("No file system device found, can't initialize file system.");
 
+  cache_init();
+  journal_init(format);
   inode_init();
+  file_init();
+  dir_init();
+  dcache_init();
   free_map_init();
 
   if (format)
@@ -30,7 +38,20 @@ void filesys_init(bool format) {
 
 /* Shuts down the file system module, writing any unwritten data
    to disk. */
-void filesys_done(void) { free_map_close(); }
+void filesys_done(void) {
+  inode_flush_all();
+  free_map_close();
+  journal_commit();
+  cache_flush();
+}
+
+/* Writes any unwritten data to disk, leaving the file system in
+   use. */
+void filesys_sync(void) {
+  inode_flush_all();
+  journal_commit();
+  cache_flush();
+}
 
 /* Creates a file named NAME with the given INITIAL_SIZE.
    Returns true if successful, false otherwise.
@@ -38,12 +59,18 @@ void filesys_done(void) { free_map_close(); }
    or if internal memory allocation fails. */
 bool filesys_create(const char* name, off_t initial_size) {
   block_sector_t inode_sector = 0;
-  struct dir* dir = dir_open_root();
-  bool success = (dir != NULL && free_map_allocate(1, &inode_sector) &&
-                  inode_create(inode_sector, initial_size) && dir_add(dir, name, inode_sector));
+  struct dir* dir;
+  bool success;
+
+  journal_begin();
+  dir = dir_open_root();
+  success = (dir != NULL &&
+             free_map_allocate(1, inode_get_inumber(dir_get_inode(dir)), &inode_sector) &&
+             inode_create(inode_sector, initial_size) && dir_add(dir, name, inode_sector));
   if (!success && inode_sector != 0)
     free_map_release(inode_sector, 1);
   dir_close(dir);
+  journal_end();
 
   return success;
 }
@@ -69,9 +96,14 @@ struct file* filesys_open(const char* name) {
    Fails if no file named NAME exists,
    or if an internal memory allocation fails. */
 bool filesys_remove(const char* name) {
-  struct dir* dir = dir_open_root();
-  bool success = dir != NULL && dir_remove(dir, name);
+  struct dir* dir;
+  bool success;
+
+  journal_begin();
+  dir = dir_open_root();
+  success = dir != NULL && dir_remove(dir, name);
   dir_close(dir);
+  journal_end();
 
   return success;
 }
@@ -80,7 +112,7 @@ bool filesys_remove(const char* name) {
 static void do_format(void) {
   printf("Formatting file system...");
   free_map_create();
-  if (!dir_create(ROOT_DIR_SECTOR, 16))
+  if (!dir_create(ROOT_DIR_SECTOR, 16, DIR_HASHED))
     PANIC("root directory creation failed");
   free_map_close();
   printf("done.\n");
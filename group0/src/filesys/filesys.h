@@ -7,12 +7,14 @@
 /* Sectors of system file inodes. */
 #define FREE_MAP_SECTOR 0 /* Free map file inode sector. */
 #define ROOT_DIR_SECTOR 1 /* Root directory file inode sector. */
+#define JOURNAL_SECTOR 2  /* First sector of the journal. */
 
 /* Block device that contains the file system. */
 extern struct block* fs_device;
 
 void filesys_init(bool format);
 void filesys_done(void);
+void filesys_sync(void);
 bool filesys_create(const char* name, off_t initial_size);
 struct file* filesys_open(const char* name);
 bool filesys_remove(const char* name);
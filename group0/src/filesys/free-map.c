@@ -1,43 +1,303 @@
 #include "filesys/free-map.h"
 #include <bitmap.h>
 #include <debug.h>
+#include <round.h>
+#include <stdio.h>
 #include "filesys/file.h"
 #include "filesys/filesys.h"
 #include "filesys/inode.h"
+#include "filesys/journal.h"
+#include "threads/synch.h"
+
+/* The free map lives in memory.  Each change writes back only the
+   sectors of the free map file that hold the changed bits, and
+   those go to disk with the journal transaction that made the
+   change, so many changes to the same sector cost one write.
+
+   The disk is divided into allocation groups of GROUP_SECTORS
+   sectors.  Allocations look for space in the group of a hint
+   sector first, then in the groups on either side of it,
+   nearest first, so that a file's data ends up near its inode
+   and a new inode near its directory.  Only if no group has a
+   long enough run is the whole disk searched.
+
+   Sectors released by the running transaction are "pending": the
+   free map file shows them free, but they are not allocated again
+   until free_map_commit() is called after the transaction's
+   checkpoint.  Otherwise a released metadata sector could be
+   reused for unjournaled file data and overwritten before the
+   transaction that released it commits, so that a crash would
+   leave the old metadata pointing at the new data.  In memory, a
+   pending sector stays marked in FREE_MAP and is marked in
+   PENDING_MAP too. */
+#define GROUP_SECTORS 1024
 
 static struct file* free_map_file; /* Free map file. */
 static struct bitmap* free_map;    /* Free map, one bit per sector. */
+static struct bitmap* pending_map; /* Sectors released but not yet free. */
+static struct lock free_map_lock;  /* Protects the free map and counts. */
+static size_t free_cnt;            /* Number of free sectors, not counting pending ones. */
+static size_t pending_cnt;         /* Number of pending sectors. */
+static size_t reserved_cnt;        /* Free sectors set aside by free_map_reserve(). */
+
+/* Statistics, protected by FREE_MAP_LOCK. */
+static unsigned long long alloc_cnt;   /* Successful allocations. */
+static unsigned long long release_cnt; /* Releases. */
+static unsigned long long group_cnt;   /* Allocations satisfied in the hint's group. */
+static unsigned long long near_cnt;    /* Allocations satisfied in another group. */
+static unsigned long long write_cnt;   /* Free map file sectors written. */
+
+static block_sector_t allocate(size_t cnt, bool reserved, block_sector_t hint,
+                               size_t* allocated);
+static size_t scan_groups(size_t cnt, block_sector_t hint, size_t* run_cnt);
+static bool write_bits(size_t start, size_t cnt);
+static void recount(void);
 
 /* Initializes the free map. */
 void free_map_init(void) {
+  lock_init(&free_map_lock);
   free_map = bitmap_create(block_size(fs_device));
-  if (free_map == NULL)
+  pending_map = bitmap_create(block_size(fs_device));
+  if (free_map == NULL || pending_map == NULL)
     PANIC("bitmap creation failed--file system device is too large");
   bitmap_mark(free_map, FREE_MAP_SECTOR);
   bitmap_mark(free_map, ROOT_DIR_SECTOR);
+  bitmap_set_multiple(free_map, JOURNAL_SECTOR, JOURNAL_SECTORS, true);
+  recount();
 }
 
-/* Allocates CNT consecutive sectors from the free map and stores
-   the first into *SECTORP.
+/* Allocates CNT consecutive sectors from the free map, near
+   sector HINT if possible, and stores the first into *SECTORP.
+   Of the free runs that are long enough, the shortest is used,
+   to keep long runs intact.
    Returns true if successful, false if not enough consecutive
    sectors were available or if the free_map file could not be
    written. */
-bool free_map_allocate(size_t cnt, block_sector_t* sectorp) {
-  block_sector_t sector = bitmap_scan_and_flip(free_map, 0, cnt, false);
-  if (sector != BITMAP_ERROR && free_map_file != NULL && !bitmap_write(free_map, free_map_file)) {
-    bitmap_set_multiple(free_map, sector, cnt, false);
+bool free_map_allocate(size_t cnt, block_sector_t hint, block_sector_t* sectorp) {
+  size_t allocated;
+  block_sector_t sector;
+
+  journal_begin();
+  sector = allocate(cnt, false, hint, &allocated);
+  if (sector != BITMAP_ERROR && allocated < cnt) {
+    free_map_release(sector, allocated);
     sector = BITMAP_ERROR;
   }
   if (sector != BITMAP_ERROR)
     *sectorp = sector;
+  journal_end();
   return sector != BITMAP_ERROR;
 }
 
-/* Makes CNT sectors starting at SECTOR available for use. */
+/* Allocates an extent of at most CNT consecutive sectors: the
+   best-fitting free run if one is long enough, otherwise as much
+   as possible of the longest one.  A long enough run in the
+   allocation group of sector HINT is preferred.  Stores the first
+   sector into *SECTORP and returns the number allocated, which
+   is 0 if the disk is full or the free_map file could not be
+   written.
+   If RESERVED is true, the sectors are taken out of those set
+   aside earlier with free_map_reserve(). */
+size_t free_map_allocate_extent(size_t cnt, block_sector_t hint, block_sector_t* sectorp,
+                                bool reserved) {
+  size_t allocated;
+  block_sector_t sector;
+
+  journal_begin();
+  sector = allocate(cnt, reserved, hint, &allocated);
+  journal_end();
+  if (sector == BITMAP_ERROR)
+    return 0;
+  *sectorp = sector;
+  return allocated;
+}
+
+/* Makes CNT sectors starting at SECTOR available for use, once
+   the running transaction has committed. */
 void free_map_release(block_sector_t sector, size_t cnt) {
+  journal_begin();
+  lock_acquire(&free_map_lock);
   ASSERT(bitmap_all(free_map, sector, cnt));
-  bitmap_set_multiple(free_map, sector, cnt, false);
-  bitmap_write(free_map, free_map_file);
+  release_cnt++;
+  if (free_map_file != NULL) {
+    ASSERT(bitmap_none(pending_map, sector, cnt));
+    bitmap_set_multiple(pending_map, sector, cnt, true);
+    pending_cnt += cnt;
+    write_bits(sector, cnt);
+  } else {
+    bitmap_set_multiple(free_map, sector, cnt, false);
+    free_cnt += cnt;
+  }
+  lock_release(&free_map_lock);
+  journal_end();
+}
+
+/* Makes the sectors released by the transaction that just
+   committed available for use.  Called by the journal after each
+   checkpoint, while no handle is open. */
+void free_map_commit(void) {
+  size_t size = bitmap_size(free_map);
+  size_t start = 0;
+
+  lock_acquire(&free_map_lock);
+  while (pending_cnt > 0) {
+    size_t end;
+
+    start = bitmap_scan(pending_map, start, 1, true);
+    ASSERT(start != BITMAP_ERROR);
+    end = bitmap_scan(pending_map, start, 1, false);
+    if (end == BITMAP_ERROR)
+      end = size;
+    bitmap_set_multiple(pending_map, start, end - start, false);
+    bitmap_set_multiple(free_map, start, end - start, false);
+    free_cnt += end - start;
+    pending_cnt -= end - start;
+    start = end;
+  }
+  lock_release(&free_map_lock);
+}
+
+/* Sets aside CNT free sectors for a later
+   free_map_allocate_extent() with RESERVED set, so that
+   allocation cannot fail for lack of space.  Returns false if
+   fewer than CNT unreserved sectors are free. */
+bool free_map_reserve(size_t cnt) {
+  bool success;
+
+  lock_acquire(&free_map_lock);
+  success = free_cnt - reserved_cnt >= cnt;
+  if (success)
+    reserved_cnt += cnt;
+  lock_release(&free_map_lock);
+  return success;
+}
+
+/* Returns CNT sectors set aside by free_map_reserve() that will
+   not be allocated after all. */
+void free_map_unreserve(size_t cnt) {
+  lock_acquire(&free_map_lock);
+  ASSERT(reserved_cnt >= cnt);
+  reserved_cnt -= cnt;
+  lock_release(&free_map_lock);
+}
+
+/* Allocates up to CNT consecutive sectors, as described for
+   free_map_allocate_extent(), and stores the number allocated
+   into *ALLOCATED.  Returns the first sector, or BITMAP_ERROR if
+   nothing could be allocated. */
+static block_sector_t allocate(size_t cnt, bool reserved, block_sector_t hint,
+                               size_t* allocated) {
+  block_sector_t sector = BITMAP_ERROR;
+  size_t size = bitmap_size(free_map);
+  size_t avail, run_cnt;
+
+  ASSERT(cnt > 0);
+
+  lock_acquire(&free_map_lock);
+  avail = reserved ? free_cnt : free_cnt - reserved_cnt;
+  ASSERT(!reserved || reserved_cnt >= cnt);
+  if (avail > 0) {
+    /* Try the groups nearest the hint's, then the whole disk. */
+    sector = scan_groups(cnt, hint, &run_cnt);
+    if (sector == BITMAP_ERROR)
+      sector = bitmap_scan_best(free_map, 0, size, cnt, false, &run_cnt);
+    ASSERT(sector != BITMAP_ERROR);
+    if (run_cnt > cnt)
+      run_cnt = cnt;
+    if (run_cnt > avail)
+      run_cnt = avail;
+
+    bitmap_set_multiple(free_map, sector, run_cnt, true);
+    if (free_map_file != NULL && !write_bits(sector, run_cnt)) {
+      bitmap_set_multiple(free_map, sector, run_cnt, false);
+      sector = BITMAP_ERROR;
+    } else {
+      free_cnt -= run_cnt;
+      if (reserved)
+        reserved_cnt -= run_cnt;
+      alloc_cnt++;
+      *allocated = run_cnt;
+    }
+  }
+  lock_release(&free_map_lock);
+  return sector;
+}
+
+/* Looks for a run of at least CNT free sectors inside a single
+   allocation group: the group of HINT, then the groups 1, 2, ...
+   away from it, the later group first at each distance.  Returns
+   the first sector of the best fit in the nearest group that has
+   one, storing its length into *RUN_CNT, or BITMAP_ERROR if no
+   group has a long enough run.  FREE_MAP_LOCK must be held. */
+static size_t scan_groups(size_t cnt, block_sector_t hint, size_t* run_cnt) {
+  size_t size = bitmap_size(free_map);
+  size_t group_total = DIV_ROUND_UP(size, GROUP_SECTORS);
+  size_t home = hint < size ? hint / GROUP_SECTORS : 0;
+  size_t dist;
+
+  for (dist = 0; home + dist < group_total || dist <= home; dist++) {
+    size_t groups[2];
+    size_t cand_cnt = 0;
+    size_t i;
+
+    if (home + dist < group_total)
+      groups[cand_cnt++] = home + dist;
+    if (dist > 0 && dist <= home)
+      groups[cand_cnt++] = home - dist;
+
+    for (i = 0; i < cand_cnt; i++) {
+      size_t start = groups[i] * GROUP_SECTORS;
+      size_t end = start + GROUP_SECTORS < size ? start + GROUP_SECTORS : size;
+      size_t sector = bitmap_scan_best(free_map, start, end, cnt, false, run_cnt);
+
+      if (sector != BITMAP_ERROR && *run_cnt >= cnt) {
+        if (dist == 0)
+          group_cnt++;
+        else
+          near_cnt++;
+        return sector;
+      }
+    }
+  }
+  return BITMAP_ERROR;
+}
+
+/* Sets the bits of FREE_MAP from FIRST up to LAST to VALUE
+   wherever the same bits of PENDING_MAP are set. */
+static void set_pending(size_t first, size_t last, bool value) {
+  size_t i;
+
+  for (i = first; i < last; i++) {
+    i = bitmap_scan(pending_map, i, 1, true);
+    if (i == BITMAP_ERROR || i >= last)
+      break;
+    bitmap_set(free_map, i, value);
+  }
+}
+
+/* Writes the sectors of the free map file that hold the CNT bits
+   starting at bit START, with pending sectors shown free.
+   Returns true if successful. */
+static bool write_bits(size_t start, size_t cnt) {
+  size_t ofs = ROUND_DOWN(start / 8, BLOCK_SECTOR_SIZE);
+  size_t end = ROUND_UP((start + cnt + 7) / 8, BLOCK_SECTOR_SIZE);
+  size_t last = end * 8 < bitmap_size(free_map) ? end * 8 : bitmap_size(free_map);
+  bool success;
+
+  ASSERT(lock_held_by_current_thread(&free_map_lock));
+
+  write_cnt += (end - ofs) / BLOCK_SECTOR_SIZE;
+  if (pending_cnt > 0)
+    set_pending(ofs * 8, last, false);
+  success = bitmap_write_part(free_map, free_map_file, ofs, end - ofs);
+  if (pending_cnt > 0)
+    set_pending(ofs * 8, last, true);
+  return success;
+}
+
+/* Recomputes the free sector count from the free map. */
+static void recount(void) {
+  free_cnt = bitmap_count(free_map, 0, bitmap_size(free_map), false);
 }
 
 /* Opens the free map file and reads it from disk. */
@@ -45,8 +305,10 @@ void free_map_open(void) {
   free_map_file = file_open(inode_open(FREE_MAP_SECTOR));
   if (free_map_file == NULL)
     PANIC("can't open free map");
+  inode_set_journaled(file_get_inode(free_map_file));
   if (!bitmap_read(free_map, free_map_file))
     PANIC("can't read free map");
+  recount();
 }
 
 /* Writes the free map to disk and closes the free map file. */
@@ -55,6 +317,8 @@ void free_map_close(void) { file_close(free_map_file); }
 /* Creates a new free map file on disk and writes the free map to
    it. */
 void free_map_create(void) {
+  size_t ofs;
+
   /* Create inode. */
   if (!inode_create(FREE_MAP_SECTOR, bitmap_file_size(free_map)))
     PANIC("free map creation failed");
@@ -63,6 +327,18 @@ void free_map_create(void) {
   free_map_file = file_open(inode_open(FREE_MAP_SECTOR));
   if (free_map_file == NULL)
     PANIC("can't open free map");
-  if (!bitmap_write(free_map, free_map_file))
-    PANIC("can't write free map");
+  inode_set_journaled(file_get_inode(free_map_file));
+
+  /* Write bitmap to file, a sector per journal handle, since a
+     large disk's free map would not fit in one. */
+  for (ofs = 0; ofs < bitmap_file_size(free_map); ofs += BLOCK_SECTOR_SIZE)
+    if (!bitmap_write_part(free_map, free_map_file, ofs, BLOCK_SECTOR_SIZE))
+      PANIC("can't write free map");
+}
+
+/* Prints free map statistics. */
+void free_map_print_stats(void) {
+  printf("Free map: %llu allocations (%llu in hinted group, %llu in a nearby one), "
+         "%llu releases, %llu sectors written\n",
+         alloc_cnt, group_cnt, near_cnt, release_cnt, write_cnt);
 }
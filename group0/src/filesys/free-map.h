@@ -5,13 +5,23 @@
 #include <stddef.h>
 #include "devices/block.h"
 
+/* Number of sectors whose bits share one sector of the free map
+   file.  Allocating or releasing a run of sectors logs one free
+   map sector for each such group of sectors it touches. */
+#define FREE_MAP_SECTOR_BITS (BLOCK_SECTOR_SIZE * 8)
+
 void free_map_init(void);
 void free_map_read(void);
 void free_map_create(void);
 void free_map_open(void);
 void free_map_close(void);
 
-bool free_map_allocate(size_t, block_sector_t*);
+bool free_map_allocate(size_t, block_sector_t hint, block_sector_t*);
+size_t free_map_allocate_extent(size_t, block_sector_t hint, block_sector_t*, bool reserved);
 void free_map_release(block_sector_t, size_t);
+void free_map_commit(void);
+bool free_map_reserve(size_t);
+void free_map_unreserve(size_t);
+void free_map_print_stats(void);
 
 #endif /* filesys/free-map.h */
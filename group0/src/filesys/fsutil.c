@@ -4,11 +4,17 @@
 #include <stdlib.h>
 #include <string.h>
 #include <ustar.h>
+#include "filesys/dcache.h"
 #include "filesys/directory.h"
 #include "filesys/file.h"
 #include "filesys/filesys.h"
+#include "filesys/free-map.h"
+#include "filesys/inode.h"
+#include "devices/timer.h"
 #include "threads/malloc.h"
 #include "threads/palloc.h"
+#include "threads/synch.h"
+#include "threads/thread.h"
 #include "threads/vaddr.h"
 
 /* List files in the root directory. */
@@ -134,6 +140,10 @@ void fsutil_extract(char** argv UNUSED) {
   block_write(src, 0, header);
   block_write(src, 1, header);
 
+  /* Make the extracted files durable, so that they survive a
+     crash arranged with -jcrash. */
+  filesys_sync();
+
   free(data);
   free(header);
 }
@@ -201,3 +211,290 @@ void fsutil_append(char** argv) {
   file_close(src);
   free(buffer);
 }
+
+/* Number of operations timed for each directory size in
+   fsutil_dirbench(). */
+#define DIRBENCH_OPS 10000
+
+/* Returns OPS operations in TICKS timer ticks as a rate per
+   second. */
+static long long ops_per_sec(long long ops, int64_t ticks) {
+  return ops * TIMER_FREQ / (ticks > 0 ? ticks : 1);
+}
+
+/* Times creating and looking up SIZE entries in directories laid
+   out as LAYOUT.  Creation is repeated in fresh directories until
+   about DIRBENCH_OPS entries have been added, and DIRBENCH_OPS
+   lookups are spread over the entries of the last one.  Every
+   entry refers to the directory's own inode, so no files are
+   created. */
+static void dirbench_size(const char* layout_name, enum dir_layout layout, size_t size) {
+  size_t rep_cnt = size < DIRBENCH_OPS ? DIRBENCH_OPS / size : 1;
+  char name[NAME_MAX + 1];
+  int64_t create_ticks = 0, lookup_ticks, start;
+  block_sector_t sector;
+  struct dir* dir = NULL;
+  size_t rep, i;
+
+  for (rep = 0; rep < rep_cnt; rep++) {
+    if (dir != NULL) {
+      inode_remove(dir_get_inode(dir));
+      dir_close(dir);
+    }
+    if (!free_map_allocate(1, ROOT_DIR_SECTOR, &sector) || !dir_create(sector, 0, layout))
+      PANIC("dirbench: directory creation failed");
+    dir = dir_open(inode_open(sector));
+    if (dir == NULL)
+      PANIC("dirbench: directory open failed");
+
+    start = timer_ticks();
+    for (i = 0; i < size; i++) {
+      snprintf(name, sizeof name, "f%zu", i);
+      if (!dir_add(dir, name, sector))
+        PANIC("dirbench: adding %s failed", name);
+    }
+    create_ticks += timer_elapsed(start);
+  }
+
+  start = timer_ticks();
+  for (i = 0; i < DIRBENCH_OPS; i++) {
+    struct inode* inode;
+    snprintf(name, sizeof name, "f%zu", i % size);
+    if (!dir_lookup(dir, name, &inode))
+      PANIC("dirbench: %s not found", name);
+    inode_close(inode);
+  }
+  lookup_ticks = timer_elapsed(start);
+
+  inode_remove(dir_get_inode(dir));
+  dir_close(dir);
+
+  printf("%-6s %5zu entries: %7lld creates/s, %7lld lookups/s\n", layout_name, size,
+         ops_per_sec((long long)rep_cnt * size, create_ticks),
+         ops_per_sec(DIRBENCH_OPS, lookup_ticks));
+}
+
+/* Compares the create and lookup rates of linear and hashed
+   directories with 10, 1,000, and 10,000 entries.  The file
+   system needs room for a 10,000-entry hashed directory, about
+   300 kB.  Linear directories take quadratic time to fill, so
+   the largest size takes a while.  The dentry cache is off
+   throughout, so that lookups search the directories themselves. */
+void fsutil_dirbench(char** argv UNUSED) {
+  static const size_t sizes[] = {10, 1000, 10000};
+  size_t i;
+
+  printf("Benchmarking directories...\n");
+  dcache_set_enabled(false);
+  for (i = 0; i < sizeof sizes / sizeof *sizes; i++) {
+    dirbench_size("linear", DIR_LINEAR, sizes[i]);
+    dirbench_size("hashed", DIR_HASHED, sizes[i]);
+  }
+  dcache_set_enabled(true);
+}
+
+/* fsutil_iobench() parameters. */
+#define IOBENCH_THREADS 4                     /* Worker threads per run. */
+#define IOBENCH_FILE_SIZE (64 * 1024)         /* Bytes in each file. */
+#define IOBENCH_CHUNK (4 * BLOCK_SECTOR_SIZE) /* Bytes per read or write. */
+#define IOBENCH_PASSES 4                      /* Passes over its file per worker. */
+
+/* In global mode, held across every file system call, the way a
+   single file system lock at the system call layer would be. */
+static struct lock iobench_lock;
+
+/* An fsutil_iobench() worker thread. */
+struct iobench_worker {
+  char file_name[NAME_MAX + 1]; /* File to read or write. */
+  bool writer;                  /* Write the file instead of reading it? */
+  bool global;                  /* Serialize on iobench_lock? */
+  bool ok;                      /* Were all transfers complete? */
+  struct semaphore done;        /* Upped when the worker finishes. */
+};
+
+/* Reads or writes a file IOBENCH_PASSES times, as described by
+   iobench_worker W_. */
+static void iobench_worker(void* w_) {
+  struct iobench_worker* w = w_;
+  struct file* file;
+  void* buffer;
+  off_t ofs;
+  int pass;
+
+  w->ok = false;
+  buffer = malloc(IOBENCH_CHUNK);
+  if (w->global)
+    lock_acquire(&iobench_lock);
+  file = filesys_open(w->file_name);
+  if (w->global)
+    lock_release(&iobench_lock);
+  if (buffer == NULL || file == NULL)
+    goto done;
+
+  memset(buffer, 0x5a, IOBENCH_CHUNK);
+  w->ok = true;
+  for (pass = 0; pass < IOBENCH_PASSES; pass++)
+    for (ofs = 0; ofs < IOBENCH_FILE_SIZE; ofs += IOBENCH_CHUNK) {
+      off_t n;
+      if (w->global)
+        lock_acquire(&iobench_lock);
+      if (w->writer)
+        n = file_write_at(file, buffer, IOBENCH_CHUNK, ofs);
+      else
+        n = file_read_at(file, buffer, IOBENCH_CHUNK, ofs);
+      if (w->global)
+        lock_release(&iobench_lock);
+      if (n != IOBENCH_CHUNK)
+        w->ok = false;
+    }
+
+done:
+  file_close(file);
+  free(buffer);
+  sema_up(&w->done);
+}
+
+/* Runs IOBENCH_THREADS workers, the first WRITER_CNT of which
+   write and the rest read, and prints their combined throughput.
+   If SHARED is true, all of them use the same file, otherwise
+   each has its own.  If GLOBAL is true, every file system call
+   is serialized on a single lock. */
+static void iobench_run(const char* workload, bool shared, int writer_cnt, bool global) {
+  struct iobench_worker workers[IOBENCH_THREADS];
+  long long bytes = (long long)IOBENCH_THREADS * IOBENCH_PASSES * IOBENCH_FILE_SIZE;
+  int64_t start, ticks;
+  int i;
+
+  start = timer_ticks();
+  for (i = 0; i < IOBENCH_THREADS; i++) {
+    struct iobench_worker* w = &workers[i];
+    snprintf(w->file_name, sizeof w->file_name, "iobench%d", shared ? 0 : i);
+    w->writer = i < writer_cnt;
+    w->global = global;
+    sema_init(&w->done, 0);
+    if (thread_create("iobench", PRI_DEFAULT, iobench_worker, w) == TID_ERROR)
+      PANIC("iobench: thread creation failed");
+  }
+  for (i = 0; i < IOBENCH_THREADS; i++) {
+    sema_down(&workers[i].done);
+    if (!workers[i].ok)
+      PANIC("iobench: %s worker %d failed", workload, i);
+  }
+  ticks = timer_elapsed(start);
+
+  printf("%-5s %-6s locking: %6lld kB/s\n", workload, global ? "global" : "inode",
+         ops_per_sec(bytes, ticks) / 1024);
+}
+
+/* Compares file system throughput with a single global lock
+   against the per-inode locks, using IOBENCH_THREADS threads:
+   all reading one file, each writing its own file, and half
+   reading and half writing one file.  These mirror the
+   syn-read, syn-write, and syn-rw tests. */
+void fsutil_iobench(char** argv UNUSED) {
+  char name[NAME_MAX + 1];
+  void* buffer;
+  off_t ofs;
+  int i;
+
+  printf("Benchmarking concurrent file access...\n");
+  lock_init(&iobench_lock);
+  buffer = calloc(1, IOBENCH_CHUNK);
+  if (buffer == NULL)
+    PANIC("iobench: couldn't allocate buffer");
+
+  for (i = 0; i < IOBENCH_THREADS; i++) {
+    struct file* file;
+    snprintf(name, sizeof name, "iobench%d", i);
+    if (!filesys_create(name, 0) || (file = filesys_open(name)) == NULL)
+      PANIC("iobench: %s: create failed", name);
+    for (ofs = 0; ofs < IOBENCH_FILE_SIZE; ofs += IOBENCH_CHUNK)
+      if (file_write(file, buffer, IOBENCH_CHUNK) != IOBENCH_CHUNK)
+        PANIC("iobench: %s: write failed", name);
+    file_close(file);
+  }
+  free(buffer);
+
+  for (i = 0; i < 2; i++) {
+    bool global = i == 0;
+    iobench_run("read", true, 0, global);
+    iobench_run("write", false, IOBENCH_THREADS, global);
+    iobench_run("rw", true, IOBENCH_THREADS / 2, global);
+  }
+
+  for (i = 0; i < IOBENCH_THREADS; i++) {
+    snprintf(name, sizeof name, "iobench%d", i);
+    filesys_remove(name);
+  }
+}
+
+/* Number of files fsutil_crashtest() creates. */
+#define CRASHTEST_FILES 300
+
+/* Creates empty files file0 through file299 in the root
+   directory, one after another, like the crash-create test but
+   without needing system calls.  Run it with -jcrash=N, so that
+   the kernel powers off partway through, then boot again with
+   the crashcheck action to see what journal replay recovered. */
+void fsutil_crashtest(char** argv UNUSED) {
+  char name[NAME_MAX + 1];
+  int i;
+
+  printf("Creating %d files...\n", CRASHTEST_FILES);
+  for (i = 0; i < CRASHTEST_FILES; i++) {
+    snprintf(name, sizeof name, "file%d", i);
+    if (!filesys_create(name, 0))
+      PANIC("crashtest: %s: create failed", name);
+  }
+  printf("Created all %d files without crashing.\n", CRASHTEST_FILES);
+}
+
+/* Returns the N in a file name of the form "fileN", or -1 if
+   NAME is not of that form. */
+static int crashtest_index(const char* name) {
+  const char* p;
+  int idx = 0;
+
+  if (memcmp(name, "file", 4) || name[4] == '\0' || (name[4] == '0' && name[5] != '\0'))
+    return -1;
+  for (p = name + 4; *p != '\0'; p++) {
+    if (*p < '0' || *p > '9' || idx >= CRASHTEST_FILES)
+      return -1;
+    idx = idx * 10 + (*p - '0');
+  }
+  return idx < CRASHTEST_FILES ? idx : -1;
+}
+
+/* Checks the file system left by an interrupted crashtest
+   action.  Creates are committed in order and none may be half
+   done, so the root directory must hold file0 through fileN-1
+   for some N, all empty, and no other fileK. */
+void fsutil_crashcheck(char** argv UNUSED) {
+  char name[NAME_MAX + 1];
+  struct dir* dir;
+  int file_cnt = 0;
+
+  printf("Checking files left by crashtest...\n");
+  for (;;) {
+    struct file* file;
+    snprintf(name, sizeof name, "file%d", file_cnt);
+    file = filesys_open(name);
+    if (file == NULL)
+      break;
+    if (file_length(file) != 0)
+      PANIC("crashcheck: %s should be empty", name);
+    file_close(file);
+    file_cnt++;
+  }
+
+  dir = dir_open_root();
+  if (dir == NULL)
+    PANIC("root dir open failed");
+  while (dir_readdir(dir, name)) {
+    int idx = crashtest_index(name);
+    if (idx >= file_cnt)
+      PANIC("crashcheck: %s exists but file%d does not", name, file_cnt);
+  }
+  dir_close(dir);
+  printf("Found %d files in order and nothing after them.\n", file_cnt);
+}
@@ -6,5 +6,9 @@ void fsutil_cat(char** argv);
 void fsutil_rm(char** argv);
 void fsutil_extract(char** argv);
 void fsutil_append(char** argv);
+void fsutil_dirbench(char** argv);
+void fsutil_iobench(char** argv);
+void fsutil_crashtest(char** argv);
+void fsutil_crashcheck(char** argv);
 
 #endif /* filesys/fsutil.h */
@@ -1,64 +1,680 @@
 #include "filesys/inode.h"
-#include <list.h>
+#include <hash.h>
 #include <debug.h>
 #include <round.h>
 #include <string.h>
+#include "filesys/cache.h"
+#include "filesys/dcache.h"
 #include "filesys/filesys.h"
 #include "filesys/free-map.h"
+#include "filesys/journal.h"
 #include "threads/malloc.h"
+#include "threads/slab.h"
+#include "threads/synch.h"
 
 /* Identifies an inode. */
 #define INODE_MAGIC 0x494e4f44
 
+/* Largest supported file size, in bytes. */
+#define INODE_MAX_LENGTH (8 * 1024 * 1024)
+
+/* A run of CNT file sectors, starting at file sector FIRST, that
+   is stored in CNT consecutive disk sectors starting at START.
+   File sectors not covered by any extent are holes, which read
+   as zeros and take no space on disk. */
+struct inode_extent {
+  uint32_t first;       /* First file sector. */
+  block_sector_t start; /* First disk sector. */
+  uint32_t cnt;         /* Number of sectors. */
+};
+
+/* Number of extents the on-disk inode and each overflow sector
+   can hold.
+
+   A file's extents, in file order, fill the on-disk inode and
+   then a chain of overflow sectors, each holding as many as its
+   count says.  Adding an extent to a full sector splits it,
+   moving its upper half (or nothing, when adding at its end)
+   into a new overflow sector linked in after it, and removing
+   the last extent from an overflow sector unlinks it.  Either
+   way, one change to a file's extents rewrites at most the
+   inode and two overflow sectors, however long the file. */
+#define INODE_EXTENT_CNT 41
+#define CHAIN_EXTENT_CNT 42
+
 /* On-disk inode.
    Must be exactly BLOCK_SECTOR_SIZE bytes long. */
 struct inode_disk {
-  block_sector_t start; /* First data sector. */
-  off_t length;         /* File size in bytes. */
-  unsigned magic;       /* Magic number. */
-  uint32_t unused[125]; /* Not used. */
+  off_t length;                                  /* File size in bytes. */
+  unsigned magic;                                /* Magic number. */
+  uint32_t extent_cnt;                           /* Total number of extents. */
+  block_sector_t chain;                          /* First overflow sector, or 0. */
+  struct inode_extent extents[INODE_EXTENT_CNT]; /* First extents, by file sector. */
+  uint32_t inline_cnt;                           /* Number of extents in EXTENTS. */
+};
+
+/* Overflow sector, holding extents that do not fit in the
+   on-disk inode.  Must be exactly BLOCK_SECTOR_SIZE bytes
+   long. */
+struct extent_block {
+  block_sector_t next;                           /* Next overflow sector, or 0. */
+  uint32_t cnt;                                  /* Number of extents in EXTENTS. */
+  struct inode_extent extents[CHAIN_EXTENT_CNT]; /* Extents, by file sector. */
 };
 
+/* Delayed allocation.  Data written past the last allocated
+   sector of a file is held in memory, up to DELAY_MAX sectors,
+   and given disk space all at once when the buffer fills, the
+   file is closed, or the file system is shut down.  A file
+   written in small appends thus ends up in one extent instead
+   of one sector at a time wherever the free map had room.
+   Space for delayed sectors, plus one sector for a possible new
+   overflow sector, is reserved in the free map up front, so the
+   eventual allocation cannot fail for lack of space. */
+#define DELAY_MAX 16
+
+/* Most journal credits adding one extent can take, besides those
+   for the on-disk inode and the overflow sectors already changed:
+   two free map sectors for its data, which is at most
+   FREE_MAP_SECTOR_BITS sectors long, one for a new overflow
+   sector, and two overflow sectors newly changed.  Allocation
+   stops when the caller's handle has fewer credits than that
+   left, and the caller restarts its handle and goes on. */
+#define EXTENT_CREDITS 5
+
+/* A write to file data opens a new journal handle after every
+   WRITE_STEP_SECTORS sectors, so that however large the write,
+   no handle allocates more than this many sectors. */
+#define WRITE_STEP_SECTORS 8
+
 /* Returns the number of sectors to allocate for an inode SIZE
    bytes long. */
 static inline size_t bytes_to_sectors(off_t size) { return DIV_ROUND_UP(size, BLOCK_SECTOR_SIZE); }
 
+/* Where a run of an inode's extents is stored on disk.  Node 0
+   is the on-disk inode; the rest are its overflow sectors, in
+   chain order. */
+struct extent_node {
+  block_sector_t sector; /* Sector holding the extents. */
+  size_t cnt;            /* Number of extents it holds. */
+  bool dirty;            /* Changed since written? */
+};
+
 /* In-memory inode. */
 struct inode {
-  struct list_elem elem;  /* Element in inode list. */
-  block_sector_t sector;  /* Sector number of disk location. */
-  int open_cnt;           /* Number of openers. */
-  bool removed;           /* True if deleted, false otherwise. */
-  int deny_write_cnt;     /* 0: writes ok, >0: deny writes. */
-  struct inode_disk data; /* Inode content. */
+  struct hash_elem elem;        /* Element in `open_inodes'. */
+  block_sector_t sector;        /* Sector number of disk location. */
+  int open_cnt;                 /* Number of openers, protected by `open_inodes_lock'. */
+  bool removed;                 /* True if deleted, false otherwise. */
+  bool journaled;               /* Data is metadata?  See inode_set_journaled(). */
+  int deny_write_cnt;           /* 0: writes ok, >0: deny writes. */
+  struct rw_lock rw_lock;       /* Held across each read (shared) or write. */
+  struct rw_lock dir_lock;      /* For directories, see inode_lock_dir(). */
+  struct lock lock;             /* Protects the members below. */
+  struct inode_disk data;       /* Inode content. */
+  struct inode_extent* extents; /* All extents, sorted by file sector. */
+  size_t extent_cnt;            /* Number of extents. */
+  size_t extent_cap;            /* Number of elements allocated in EXTENTS. */
+  struct extent_node* nodes;    /* Where EXTENTS are stored, in order. */
+  size_t node_cnt;              /* Number of nodes, at least 1. */
+  size_t node_cap;              /* Number of elements allocated in NODES. */
+  uint8_t* delay_buf;           /* DELAY_MAX sectors of delayed data. */
+  size_t delay_first;           /* File sector of first delayed sector. */
+  size_t delay_cnt;             /* Number of delayed sectors. */
+  size_t delay_reserved;        /* Sectors reserved for delayed data. */
 };
 
+/* A sector's worth of zeros. */
+static const char zeros[BLOCK_SECTOR_SIZE];
+
+/* Returns the number of extents node IDX can hold. */
+static size_t node_capacity(size_t idx) { return idx == 0 ? INODE_EXTENT_CNT : CHAIN_EXTENT_CNT; }
+
+/* Returns the node of INODE that holds extent IDX, or its last
+   node if IDX is past the last extent, and stores the index of
+   the node's first extent into *FIRST. */
+static size_t find_node(const struct inode* inode, size_t idx, size_t* first) {
+  size_t n, ofs = 0;
+
+  for (n = 0; n + 1 < inode->node_cnt && idx >= ofs + inode->nodes[n].cnt; n++)
+    ofs += inode->nodes[n].cnt;
+  *first = ofs;
+  return n;
+}
+
+/* Returns the number of extents in INODE whose first file sector
+   is at or before file sector IDX.  If IDX is covered by an
+   extent, it is the last of those. */
+static size_t find_extent(const struct inode* inode, size_t idx) {
+  size_t lo = 0, hi = inode->extent_cnt;
+
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (inode->extents[mid].first <= idx)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
 /* Returns the block device sector that contains byte offset POS
-   within INODE.
-   Returns -1 if INODE does not contain data for a byte at offset
-   POS. */
+   within INODE, or 0 if that byte lies in a hole or in delayed
+   data.  INODE's lock must be held.  Takes no disk reads. */
 static block_sector_t byte_to_sector(const struct inode* inode, off_t pos) {
-  ASSERT(inode != NULL);
-  if (pos < inode->data.length)
-    return inode->data.start + pos / BLOCK_SECTOR_SIZE;
+  size_t idx = pos / BLOCK_SECTOR_SIZE;
+  size_t i = find_extent(inode, idx);
+
+  ASSERT(lock_held_by_current_thread(&inode->lock));
+  if (i > 0) {
+    const struct inode_extent* e = &inode->extents[i - 1];
+    if (idx - e->first < e->cnt)
+      return e->start + (idx - e->first);
+  }
+  return 0;
+}
+
+/* Returns the file sector just past INODE's last extent. */
+static size_t extent_end(const struct inode* inode) {
+  const struct inode_extent* e;
+
+  if (inode->extent_cnt == 0)
+    return 0;
+  e = &inode->extents[inode->extent_cnt - 1];
+  return e->first + e->cnt;
+}
+
+/* Makes room in memory for INODE to have EXTENT_CNT extents in
+   NODE_CNT nodes.  Returns false if memory runs out. */
+static bool grow_arrays(struct inode* inode, size_t extent_cnt, size_t node_cnt) {
+  if (extent_cnt > inode->extent_cap) {
+    size_t cap = extent_cnt * 2;
+    struct inode_extent* extents = realloc(inode->extents, cap * sizeof *extents);
+    if (extents == NULL)
+      return false;
+    inode->extents = extents;
+    inode->extent_cap = cap;
+  }
+  if (node_cnt > inode->node_cap) {
+    size_t cap = node_cnt * 2;
+    struct extent_node* nodes = realloc(inode->nodes, cap * sizeof *nodes);
+    if (nodes == NULL)
+      return false;
+    inode->nodes = nodes;
+    inode->node_cap = cap;
+  }
+  return true;
+}
+
+/* Makes room in memory for EXTRA more extents in INODE, and for
+   the overflow sectors adding them might need.  Returns false if
+   memory runs out. */
+static bool reserve_extents(struct inode* inode, size_t extra) {
+  return grow_arrays(inode, inode->extent_cnt + extra, inode->node_cnt + extra);
+}
+
+/* Links a new, empty overflow sector into INODE's chain as node
+   IDX, allocating it from space reserved with free_map_reserve()
+   if RESERVED is true.  Returns false if the disk is full. */
+static bool add_node(struct inode* inode, size_t idx, bool reserved) {
+  block_sector_t sector;
+
+  ASSERT(idx > 0 && idx <= inode->node_cnt);
+  ASSERT(inode->node_cnt < inode->node_cap);
+  if (free_map_allocate_extent(1, inode->sector, &sector, reserved) == 0)
+    return false;
+
+  memmove(&inode->nodes[idx + 1], &inode->nodes[idx],
+          (inode->node_cnt - idx) * sizeof *inode->nodes);
+  inode->nodes[idx].sector = sector;
+  inode->nodes[idx].cnt = 0;
+  inode->nodes[idx].dirty = true;
+  inode->nodes[idx - 1].dirty = true;
+  inode->node_cnt++;
+  return true;
+}
+
+/* Inserts E into INODE as extent I, splitting the node it goes
+   into if that is full, with new overflow sectors allocated as
+   in add_node().  Room must have been made with
+   reserve_extents().  Returns false if the disk is full. */
+static bool insert_at(struct inode* inode, size_t i, const struct inode_extent* e,
+                      bool reserved) {
+  size_t first;
+  size_t n = find_node(inode, i, &first);
+
+  /* Prefer the end of the previous node to a full one. */
+  if (n > 0 && i == first && inode->nodes[n - 1].cnt < node_capacity(n - 1)) {
+    n--;
+    first -= inode->nodes[n].cnt;
+  }
+
+  if (inode->nodes[n].cnt == node_capacity(n)) {
+    size_t end = first + inode->nodes[n].cnt;
+    size_t move = i == end ? 0 : inode->nodes[n].cnt / 2;
+
+    if (!add_node(inode, n + 1, reserved))
+      return false;
+    inode->nodes[n].cnt -= move;
+    inode->nodes[n + 1].cnt = move;
+    if (i > first + inode->nodes[n].cnt || i == end)
+      n++;
+  }
+
+  ASSERT(inode->extent_cnt < inode->extent_cap);
+  memmove(&inode->extents[i + 1], &inode->extents[i],
+          (inode->extent_cnt - i) * sizeof *inode->extents);
+  inode->extents[i] = *e;
+  inode->extent_cnt++;
+  inode->nodes[n].cnt++;
+  inode->nodes[n].dirty = true;
+  return true;
+}
+
+/* Removes extent I from INODE, unlinking and releasing the
+   overflow sector that held it if it is left empty. */
+static void remove_at(struct inode* inode, size_t i) {
+  size_t first;
+  size_t n = find_node(inode, i, &first);
+
+  memmove(&inode->extents[i], &inode->extents[i + 1],
+          (inode->extent_cnt - i - 1) * sizeof *inode->extents);
+  inode->extent_cnt--;
+  inode->nodes[n].cnt--;
+  inode->nodes[n].dirty = true;
+
+  if (n > 0 && inode->nodes[n].cnt == 0) {
+    free_map_release(inode->nodes[n].sector, 1);
+    memmove(&inode->nodes[n], &inode->nodes[n + 1],
+            (inode->node_cnt - n - 1) * sizeof *inode->nodes);
+    inode->node_cnt--;
+    inode->nodes[n - 1].dirty = true;
+  }
+}
+
+/* Notes that extent I of INODE has changed in place. */
+static void touch_extent(struct inode* inode, size_t i) {
+  size_t first;
+
+  inode->nodes[find_node(inode, i, &first)].dirty = true;
+}
+
+/* Adds an extent mapping CNT file sectors starting at FIRST to
+   the disk sectors starting at START, merging it with its
+   neighbors where they are contiguous both in the file and on
+   disk.  Room must have been made with reserve_extents().  A new
+   overflow sector, if needed, is allocated as in add_node().
+   Returns false if the disk is full, in which case nothing
+   changes. */
+static bool insert_extent(struct inode* inode, size_t first, block_sector_t start, size_t cnt,
+                          bool reserved) {
+  size_t i = find_extent(inode, first);
+  struct inode_extent* prev = i > 0 ? &inode->extents[i - 1] : NULL;
+  struct inode_extent* next = i < inode->extent_cnt ? &inode->extents[i] : NULL;
+  struct inode_extent e;
+
+  ASSERT(prev == NULL || prev->first + prev->cnt <= first);
+  ASSERT(next == NULL || first + cnt <= next->first);
+
+  if (prev != NULL && prev->first + prev->cnt == first && prev->start + prev->cnt == start) {
+    prev->cnt += cnt;
+    touch_extent(inode, i - 1);
+    if (next != NULL && prev->first + prev->cnt == next->first &&
+        prev->start + prev->cnt == next->start) {
+      prev->cnt += next->cnt;
+      remove_at(inode, i);
+    }
+    return true;
+  } else if (next != NULL && first + cnt == next->first && start + cnt == next->start) {
+    next->first = first;
+    next->start = start;
+    next->cnt += cnt;
+    touch_extent(inode, i);
+    return true;
+  }
+
+  e.first = first;
+  e.start = start;
+  e.cnt = cnt;
+  return insert_at(inode, i, &e, reserved);
+}
+
+/* Writes INODE's length and extents to disk: the on-disk inode
+   always, and each overflow sector changed since the last
+   call. */
+static void write_extents(struct inode* inode) {
+  size_t ofs = inode->nodes[0].cnt;
+  size_t n;
+
+  inode->data.extent_cnt = inode->extent_cnt;
+  inode->data.inline_cnt = inode->nodes[0].cnt;
+  inode->data.chain = inode->node_cnt > 1 ? inode->nodes[1].sector : 0;
+  memset(inode->data.extents, 0, sizeof inode->data.extents);
+  memcpy(inode->data.extents, inode->extents, inode->nodes[0].cnt * sizeof *inode->extents);
+  journal_write(inode->sector, &inode->data, 0, BLOCK_SECTOR_SIZE);
+  inode->nodes[0].dirty = false;
+
+  for (n = 1; n < inode->node_cnt; n++) {
+    struct extent_node* node = &inode->nodes[n];
+    if (node->dirty) {
+      struct extent_block block;
+
+      memset(&block, 0, sizeof block);
+      block.next = n + 1 < inode->node_cnt ? inode->nodes[n + 1].sector : 0;
+      block.cnt = node->cnt;
+      memcpy(block.extents, inode->extents + ofs, node->cnt * sizeof *block.extents);
+      journal_write(node->sector, &block, 0, BLOCK_SECTOR_SIZE);
+      node->dirty = false;
+    }
+    ofs += node->cnt;
+  }
+}
+
+/* Reads INODE's extents from disk into memory.  Returns false,
+   leaving INODE's EXTENTS and NODES null, if memory allocation
+   fails. */
+static bool read_extents(struct inode* inode) {
+  size_t extent_cnt = inode->data.extent_cnt;
+  block_sector_t next = inode->data.chain;
+  size_t ofs = inode->data.inline_cnt;
+
+  inode->extents = NULL;
+  inode->nodes = NULL;
+  inode->extent_cnt = inode->extent_cap = 0;
+  inode->node_cnt = inode->node_cap = 0;
+  if (!grow_arrays(inode, extent_cnt > 4 ? extent_cnt : 4, 4))
+    goto fail;
+
+  ASSERT(ofs <= extent_cnt && ofs <= INODE_EXTENT_CNT);
+  memcpy(inode->extents, inode->data.extents, ofs * sizeof *inode->extents);
+  inode->nodes[0].sector = inode->sector;
+  inode->nodes[0].cnt = ofs;
+  inode->nodes[0].dirty = false;
+  inode->node_cnt = 1;
+
+  while (next != 0) {
+    struct extent_block block;
+
+    if (!grow_arrays(inode, extent_cnt, inode->node_cnt + 1))
+      goto fail;
+    cache_read(next, &block);
+    ASSERT(block.cnt <= CHAIN_EXTENT_CNT && ofs + block.cnt <= extent_cnt);
+    memcpy(inode->extents + ofs, block.extents, block.cnt * sizeof *block.extents);
+    inode->nodes[inode->node_cnt].sector = next;
+    inode->nodes[inode->node_cnt].cnt = block.cnt;
+    inode->nodes[inode->node_cnt].dirty = false;
+    inode->node_cnt++;
+    ofs += block.cnt;
+    next = block.next;
+  }
+  ASSERT(ofs == extent_cnt);
+  inode->extent_cnt = extent_cnt;
+  return true;
+
+fail:
+  free(inode->extents);
+  free(inode->nodes);
+  inode->extents = NULL;
+  inode->nodes = NULL;
+  return false;
+}
+
+/* Writes SIZE bytes from BUFFER starting at byte SECTOR_OFS
+   within data sector SECTOR of INODE, through the journal if
+   INODE is journaled. */
+static void write_data(const struct inode* inode, block_sector_t sector, const void* buffer,
+                       int sector_ofs, int size) {
+  if (inode->journaled)
+    journal_write(sector, buffer, sector_ofs, size);
   else
-    return -1;
+    cache_write_at(sector, buffer, sector_ofs, size);
+}
+
+/* Returns true if the calling thread's journal handle has the
+   credits to add one more extent to INODE and then write INODE's
+   extents to disk. */
+static bool has_extent_credits(const struct inode* inode) {
+  int need = 1 + EXTENT_CREDITS + (inode->journaled ? 1 : 0);
+  size_t n;
+
+  for (n = 1; n < inode->node_cnt; n++)
+    if (inode->nodes[n].dirty)
+      need++;
+  return journal_credits() >= need;
+}
+
+/* Allocates disk space for the CNT file sectors of INODE
+   starting at FIRST, which must all be holes, and writes DATA
+   (or zeros, if DATA is null) to it.  Each extent is as long as
+   the best-fitting free run allows.  Space comes from that
+   reserved with free_map_reserve() if RESERVED is true.
+   Stores the number of sectors allocated, from FIRST on, into
+   *DONE.  That is less than CNT if the caller's journal handle
+   runs low on credits; the caller should then write the extents,
+   restart the handle and go on.  Returns false if memory or disk
+   space runs out, in which case part of the range may have been
+   allocated all the same.  Does not write the extents to disk. */
+static bool allocate_range(struct inode* inode, size_t first, size_t cnt, const uint8_t* data,
+                           bool reserved, size_t* done) {
+  *done = 0;
+  while (cnt > 0) {
+    block_sector_t start;
+    size_t want, allocated, i;
+
+    if (!has_extent_credits(inode))
+      return true;
+
+    /* Journaled data takes a credit per sector, so journaled
+       inodes allocate a sector at a time. */
+    want = cnt < FREE_MAP_SECTOR_BITS ? cnt : FREE_MAP_SECTOR_BITS;
+    if (inode->journaled)
+      want = 1;
+
+    if (!reserve_extents(inode, 1))
+      return false;
+    allocated = free_map_allocate_extent(want, inode->sector, &start, reserved);
+    if (allocated == 0)
+      return false;
+
+    for (i = 0; i < allocated; i++)
+      write_data(inode, start + i,
+                 data != NULL ? data + i * BLOCK_SECTOR_SIZE : (const uint8_t*)zeros, 0,
+                 BLOCK_SECTOR_SIZE);
+    if (!insert_extent(inode, first, start, allocated, reserved)) {
+      free_map_release(start, allocated);
+      return false;
+    }
+
+    first += allocated;
+    cnt -= allocated;
+    *done += allocated;
+    if (data != NULL)
+      data += allocated * BLOCK_SECTOR_SIZE;
+  }
+  return true;
 }
 
-/* List of open inodes, so that opening a single inode twice
-   returns the same `struct inode'. */
-static struct list open_inodes;
+/* Releases every data and overflow sector of INODE, from the end
+   back, a free map sector's worth at a time.  Restarts the
+   caller's journal handle whenever its credits run out, so a
+   crash partway through leaves the sectors not yet released
+   allocated but unused.  Thus INODE must no longer be reachable
+   on disk, and the caller must be able to restart its handle.
+   Leaves INODE's extents in memory empty, but does not write
+   them to disk.  The caller must have a handle open. */
+static void release_blocks(struct inode* inode) {
+  while (inode->extent_cnt > 0) {
+    struct inode_extent* e = &inode->extents[inode->extent_cnt - 1];
+    block_sector_t end = e->start + e->cnt;
+    block_sector_t group = ROUND_DOWN(end - 1, FREE_MAP_SECTOR_BITS);
+    size_t cnt = end - (e->start > group ? e->start : group);
+
+    if (journal_credits() == 0)
+      journal_restart();
+    free_map_release(end - cnt, cnt);
+    e->cnt -= cnt;
+    if (e->cnt == 0)
+      inode->extent_cnt--;
+  }
+  while (inode->node_cnt > 1) {
+    if (journal_credits() == 0)
+      journal_restart();
+    free_map_release(inode->nodes[--inode->node_cnt].sector, 1);
+  }
+  inode->nodes[0].cnt = 0;
+}
+
+/* Returns true if file sector IDX of INODE is delayed data. */
+static bool delay_holds(const struct inode* inode, size_t idx) {
+  return inode->delay_cnt > 0 && idx >= inode->delay_first &&
+         idx < inode->delay_first + inode->delay_cnt;
+}
+
+/* Returns true if a write to file sector IDX of INODE can go to
+   the delay buffer: IDX is already delayed, or it is past every
+   extent and either starts the delay buffer or extends it by one
+   sector without overflowing it. */
+static bool delay_accepts(const struct inode* inode, size_t idx) {
+  if (delay_holds(inode, idx))
+    return true;
+  if (idx < extent_end(inode))
+    return false;
+  return inode->delay_cnt == 0 ||
+         (idx == inode->delay_first + inode->delay_cnt && inode->delay_cnt < DELAY_MAX);
+}
+
+/* Copies SIZE bytes from BUFFER into delayed file sector IDX of
+   INODE, at byte SECTOR_OFS, adding the sector to the delay
+   buffer if it is not already there.  delay_accepts() must be
+   true for IDX.  Returns false if the space cannot be reserved
+   or memory runs out. */
+static bool delay_write(struct inode* inode, size_t idx, const void* buffer, int sector_ofs,
+                        int size) {
+  if (!delay_holds(inode, idx)) {
+    /* Reserve the new sector, plus a possible overflow sector
+       when starting a new delay buffer. */
+    size_t reserve = inode->delay_cnt == 0 ? 2 : 1;
+    if (!free_map_reserve(reserve))
+      return false;
+    if (inode->delay_buf == NULL) {
+      inode->delay_buf = malloc(DELAY_MAX * BLOCK_SECTOR_SIZE);
+      if (inode->delay_buf == NULL) {
+        free_map_unreserve(reserve);
+        return false;
+      }
+    }
+    inode->delay_reserved += reserve;
+    if (inode->delay_cnt == 0)
+      inode->delay_first = idx;
+    memset(inode->delay_buf + (idx - inode->delay_first) * BLOCK_SECTOR_SIZE, 0,
+           BLOCK_SECTOR_SIZE);
+    inode->delay_cnt++;
+  }
+
+  memcpy(inode->delay_buf + (idx - inode->delay_first) * BLOCK_SECTOR_SIZE + sector_ofs, buffer,
+         size);
+  return true;
+}
+
+/* Discards INODE's delayed data and its reservation. */
+static void delay_drop(struct inode* inode) {
+  free_map_unreserve(inode->delay_reserved);
+  inode->delay_reserved = 0;
+  free(inode->delay_buf);
+  inode->delay_buf = NULL;
+  inode->delay_cnt = 0;
+}
+
+/* Allocates disk space for INODE's delayed data, as few extents
+   as the free map allows, and writes it to the buffer cache.
+   INODE's lock must be held.  Stops early, leaving the rest of
+   the data delayed, if the caller's journal handle runs low on
+   credits; the caller should then restart its handle and call
+   again.  Returns false, keeping the data delayed, only if memory
+   runs out. */
+static bool delay_flush(struct inode* inode) {
+  size_t node_cnt = inode->node_cnt;
+  size_t done;
+  bool success;
+
+  ASSERT(lock_held_by_current_thread(&inode->lock));
+  if (inode->delay_cnt == 0)
+    return true;
+
+  /* Every delayed sector might end up in its own extent.  They
+     are all appended, and DELAY_MAX < CHAIN_EXTENT_CNT, so that
+     needs at most one new overflow sector, which the reservation
+     covers.  If part of the data stays delayed, the new overflow
+     sector has room for the rest of it. */
+  if (!reserve_extents(inode, inode->delay_cnt))
+    return false;
+  success = allocate_range(inode, inode->delay_first, inode->delay_cnt, inode->delay_buf, true,
+                           &done);
+  ASSERT(success);
+  ASSERT(inode->node_cnt - node_cnt <= 1);
+  if (done == 0)
+    return true;
+  write_extents(inode);
+  inode->delay_reserved -= done + (inode->node_cnt - node_cnt);
+
+  inode->delay_first += done;
+  inode->delay_cnt -= done;
+  if (inode->delay_cnt > 0) {
+    memmove(inode->delay_buf, inode->delay_buf + done * BLOCK_SECTOR_SIZE,
+            inode->delay_cnt * BLOCK_SECTOR_SIZE);
+    return true;
+  }
+  delay_drop(inode);
+  return true;
+}
+
+/* Table of open inodes, keyed by sector, so that opening a
+   single inode twice returns the same `struct inode'.
+
+   OPEN_INODES_LOCK protects the table and each inode's OPEN_CNT.
+   It is held only while looking up, adding, or removing an
+   inode.  Reading an inode from disk and writing back its
+   delayed data both happen under the inode's own lock instead,
+   which later openers of the same sector wait on.  An inode stays
+   in the table until the write-back is done, so a new opener
+   always finds it there rather than reading it from disk before
+   it is complete. */
+static struct hash open_inodes;
+static struct lock open_inodes_lock;
+
+/* Cache of `struct inode' objects. */
+static struct kmem_cache* inode_cache;
+
+static void put_inode(struct inode*);
+
+/* Returns a hash value for inode E. */
+static unsigned inode_hash(const struct hash_elem* e, void* aux UNUSED) {
+  return hash_int(hash_entry(e, struct inode, elem)->sector);
+}
+
+/* Returns true if inode A's sector precedes inode B's. */
+static bool inode_less(const struct hash_elem* a, const struct hash_elem* b, void* aux UNUSED) {
+  return hash_entry(a, struct inode, elem)->sector < hash_entry(b, struct inode, elem)->sector;
+}
 
 /* Initializes the inode module. */
-void inode_init(void) { list_init(&open_inodes); }
+void inode_init(void) {
+  if (!hash_init(&open_inodes, inode_hash, inode_less, NULL))
+    PANIC("open inode table initialization failed");
+  lock_init(&open_inodes_lock);
+  inode_cache = kmem_cache_create("inode", sizeof(struct inode), NULL);
+}
 
 /* Initializes an inode with LENGTH bytes of data and
    writes the new inode to sector SECTOR on the file system
    device.
    Returns true if successful.
-   Returns false if memory or disk allocation fails. */
+   Returns false if memory or disk allocation fails.
+   Allocating a large file may restart the caller's journal
+   handle, as in inode_close(). */
 bool inode_create(block_sector_t sector, off_t length) {
   struct inode_disk* disk_inode = NULL;
+  struct inode* inode;
   bool success = false;
 
   ASSERT(length >= 0);
@@ -66,25 +682,54 @@ bool inode_create(block_sector_t sector, off_t length) {
   /* If this assertion fails, the inode structure is not exactly
      one sector in size, and you should fix that. */
   ASSERT(sizeof *disk_inode == BLOCK_SECTOR_SIZE);
+  ASSERT(sizeof(struct extent_block) == BLOCK_SECTOR_SIZE);
 
+  if (length > INODE_MAX_LENGTH)
+    return false;
+
+  /* Write an empty inode, then open it to allocate its data. */
   disk_inode = calloc(1, sizeof *disk_inode);
-  if (disk_inode != NULL) {
-    size_t sectors = bytes_to_sectors(length);
-    disk_inode->length = length;
-    disk_inode->magic = INODE_MAGIC;
-    if (free_map_allocate(sectors, &disk_inode->start)) {
-      block_write(fs_device, sector, disk_inode);
-      if (sectors > 0) {
-        static char zeros[BLOCK_SECTOR_SIZE];
-        size_t i;
-
-        for (i = 0; i < sectors; i++)
-          block_write(fs_device, disk_inode->start + i, zeros);
-      }
-      success = true;
+  if (disk_inode == NULL)
+    return false;
+  disk_inode->magic = INODE_MAGIC;
+  journal_begin();
+  journal_write(sector, disk_inode, 0, BLOCK_SECTOR_SIZE);
+  free(disk_inode);
+
+  /* Allocate the data, restarting the handle as its credits run
+     out.  Until the caller links the inode into a directory, a
+     crash just leaves its sectors allocated but unused. */
+  inode = inode_open(sector);
+  if (inode != NULL) {
+    size_t first = 0, cnt = bytes_to_sectors(length);
+
+    success = true;
+    while (success && first < cnt) {
+      size_t done;
+
+      lock_acquire(&inode->lock);
+      success = allocate_range(inode, first, cnt - first, NULL, false, &done);
+      if (done > 0)
+        write_extents(inode);
+      lock_release(&inode->lock);
+      first += done;
+      if (success && first < cnt)
+        journal_restart();
     }
-    free(disk_inode);
+    if (!success)
+      release_blocks(inode);
+
+    if (journal_credits() == 0)
+      journal_restart();
+    lock_acquire(&inode->lock);
+    if (success)
+      inode->data.length = length;
+    write_extents(inode);
+    lock_release(&inode->lock);
+
+    inode_close(inode);
   }
+  journal_end();
   return success;
 }
 
@@ -92,37 +737,77 @@ bool inode_create(block_sector_t sector, off_t length) {
    and returns a `struct inode' that contains it.
    Returns a null pointer if memory allocation fails. */
 struct inode* inode_open(block_sector_t sector) {
-  struct list_elem* e;
+  struct inode key;
+  struct hash_elem* e;
   struct inode* inode;
+  bool success;
 
   /* Check whether this inode is already open. */
-  for (e = list_begin(&open_inodes); e != list_end(&open_inodes); e = list_next(e)) {
-    inode = list_entry(e, struct inode, elem);
-    if (inode->sector == sector) {
-      inode_reopen(inode);
-      return inode;
+  key.sector = sector;
+  lock_acquire(&open_inodes_lock);
+  e = hash_find(&open_inodes, &key.elem);
+  if (e != NULL) {
+    inode = hash_entry(e, struct inode, elem);
+    inode->open_cnt++;
+    lock_release(&open_inodes_lock);
+
+    /* Wait until the first opener has read it from disk. */
+    lock_acquire(&inode->lock);
+    success = inode->extents != NULL;
+    lock_release(&inode->lock);
+    if (!success) {
+      put_inode(inode);
+      return NULL;
     }
+    return inode;
   }
 
   /* Allocate memory. */
-  inode = malloc(sizeof *inode);
-  if (inode == NULL)
+  inode = kmem_cache_alloc(inode_cache);
+  if (inode == NULL) {
+    lock_release(&open_inodes_lock);
     return NULL;
+  }
 
-  /* Initialize. */
-  list_push_front(&open_inodes, &inode->elem);
+  /* Initialize, and add to the table locked, so that other
+     openers wait for the disk read below. */
   inode->sector = sector;
   inode->open_cnt = 1;
   inode->deny_write_cnt = 0;
   inode->removed = false;
-  block_read(fs_device, inode->sector, &inode->data);
+  inode->journaled = false;
+  inode->extents = NULL;
+  inode->extent_cnt = 0;
+  inode->nodes = NULL;
+  inode->node_cnt = 0;
+  inode->delay_buf = NULL;
+  inode->delay_cnt = 0;
+  inode->delay_reserved = 0;
+  rw_lock_init(&inode->rw_lock);
+  rw_lock_init(&inode->dir_lock);
+  lock_init(&inode->lock);
+  lock_acquire(&inode->lock);
+  hash_insert(&open_inodes, &inode->elem);
+  lock_release(&open_inodes_lock);
+
+  cache_read(inode->sector, &inode->data);
+  success = read_extents(inode);
+  lock_release(&inode->lock);
+
+  if (!success) {
+    put_inode(inode);
+    return NULL;
+  }
   return inode;
 }
 
 /* Reopens and returns INODE. */
 struct inode* inode_reopen(struct inode* inode) {
-  if (inode != NULL)
+  if (inode != NULL) {
+    lock_acquire(&open_inodes_lock);
     inode->open_cnt++;
+    lock_release(&open_inodes_lock);
+  }
   return inode;
 }
 
@@ -131,27 +816,76 @@ block_sector_t inode_get_inumber(const struct inode* inode) { return inode->sect
 
 /* Closes INODE and writes it to disk.
    If this was the last reference to INODE, frees its memory.
-   If INODE was also a removed inode, frees its blocks. */
+   If INODE was also a removed inode, frees its blocks.
+   Writing back or freeing a large file may restart the caller's
+   journal handle (see journal_restart()), so the caller must not
+   hold a directory lock. */
 void inode_close(struct inode* inode) {
   /* Ignore null pointer. */
   if (inode == NULL)
     return;
 
-  /* Release resources if this was the last opener. */
-  if (--inode->open_cnt == 0) {
-    /* Remove from inode list and release lock. */
-    list_remove(&inode->elem);
+  journal_begin();
+  put_inode(inode);
+  journal_end();
+}
 
-    /* Deallocate blocks if removed. */
-    if (inode->removed) {
-      free_map_release(inode->sector, 1);
-      free_map_release(inode->data.start, bytes_to_sectors(inode->data.length));
-    }
+/* Does the work of inode_close() for non-null INODE, within a
+   journal handle if that may write anything.  inode_open() calls
+   it directly on failure, when there is nothing to write, so
+   that lookups may fail while holding a directory lock. */
+static void put_inode(struct inode* inode) {
+  lock_acquire(&open_inodes_lock);
 
-    free(inode);
+  /* Last opener: write back delayed data without the table lock,
+     keeping our reference so that the inode stays in the table.
+     Nobody else can add delayed data while ours is the only
+     reference, but an opener that comes and goes meanwhile may,
+     so check again afterward. */
+  while (inode->open_cnt == 1 && !inode->removed && inode->delay_cnt > 0) {
+    lock_release(&open_inodes_lock);
+    lock_acquire(&inode->lock);
+    if (!delay_flush(inode))
+      delay_drop(inode);
+    lock_release(&inode->lock);
+    if (inode->delay_cnt > 0)
+      journal_restart();
+    lock_acquire(&open_inodes_lock);
   }
+
+  if (--inode->open_cnt > 0) {
+    lock_release(&open_inodes_lock);
+    return;
+  }
+  hash_delete(&open_inodes, &inode->elem);
+  lock_release(&open_inodes_lock);
+
+  /* Deallocate blocks if removed, over as many journal handles
+     as it takes.  A directory's cached entries must go too,
+     before its sector can be reused. */
+  if (inode->removed) {
+    if (inode->journaled)
+      dcache_invalidate_dir(inode->sector);
+    delay_drop(inode);
+    journal_begin();
+    release_blocks(inode);
+    if (journal_credits() == 0)
+      journal_restart();
+    free_map_release(inode->sector, 1);
+    journal_end();
+  }
+
+  free(inode->extents);
+  free(inode->nodes);
+  kmem_cache_free(inode_cache, inode);
 }
 
+/* Marks INODE as holding file system metadata, such as a
+   directory or the free map: writes to its data go through the
+   journal, like writes to the inode itself, and are never
+   delayed.  Must be called before writing to INODE. */
+void inode_set_journaled(struct inode* inode) { inode->journaled = true; }
+
 /* Marks INODE to be deleted when it is closed by the last caller who
    has it open. */
 void inode_remove(struct inode* inode) {
@@ -159,18 +893,58 @@ void inode_remove(struct inode* inode) {
   inode->removed = true;
 }
 
+/* Allocates disk space for the delayed data of every open
+   inode, each in a journal handle of its own, stopping early if
+   memory runs out. */
+void inode_flush_all(void) {
+  bool flushed;
+
+  do {
+    struct inode* inode = NULL;
+    struct hash_iterator i;
+
+    /* Find an inode with delayed data and take a reference to it,
+       so that it can be flushed without the table lock.  Reading
+       DELAY_CNT without the inode's lock is only a hint; the flush
+       itself looks again. */
+    lock_acquire(&open_inodes_lock);
+    hash_first(&i, &open_inodes);
+    while (inode == NULL && hash_next(&i)) {
+      struct inode* cur = hash_entry(hash_cur(&i), struct inode, elem);
+      if (cur->delay_cnt > 0) {
+        inode = cur;
+        inode->open_cnt++;
+      }
+    }
+    lock_release(&open_inodes_lock);
+    if (inode == NULL)
+      break;
+
+    journal_begin();
+    lock_acquire(&inode->lock);
+    flushed = delay_flush(inode);
+    lock_release(&inode->lock);
+    put_inode(inode);
+    journal_end();
+  } while (flushed);
+}
+
 /* Reads SIZE bytes from INODE into BUFFER, starting at position OFFSET.
    Returns the number of bytes actually read, which may be less
-   than SIZE if an error occurs or end of file is reached. */
+   than SIZE if an error occurs or end of file is reached.
+   Reads of the same inode run in parallel, but never overlap a
+   write. */
 off_t inode_read_at(struct inode* inode, void* buffer_, off_t size, off_t offset) {
   uint8_t* buffer = buffer_;
   off_t bytes_read = 0;
-  uint8_t* bounce = NULL;
 
+  rw_lock_acquire(&inode->rw_lock, true);
   while (size > 0) {
     /* Disk sector to read, starting byte offset within sector. */
-    block_sector_t sector_idx = byte_to_sector(inode, offset);
+    size_t idx = offset / BLOCK_SECTOR_SIZE;
+    block_sector_t sector_idx = 0;
     int sector_ofs = offset % BLOCK_SECTOR_SIZE;
+    bool delayed;
 
     /* Bytes left in inode, bytes left in sector, lesser of the two. */
     off_t inode_left = inode_length(inode) - offset;
@@ -182,51 +956,71 @@ off_t inode_read_at(struct inode* inode, void* buffer_, off_t size, off_t offset
     if (chunk_size <= 0)
       break;
 
-    if (sector_ofs == 0 && chunk_size == BLOCK_SECTOR_SIZE) {
-      /* Read full sector directly into caller's buffer. */
-      block_read(fs_device, sector_idx, buffer + bytes_read);
-    } else {
-      /* Read sector into bounce buffer, then partially copy
-             into caller's buffer. */
-      if (bounce == NULL) {
-        bounce = malloc(BLOCK_SECTOR_SIZE);
-        if (bounce == NULL)
-          break;
-      }
-      block_read(fs_device, sector_idx, bounce);
-      memcpy(buffer + bytes_read, bounce + sector_ofs, chunk_size);
-    }
+    lock_acquire(&inode->lock);
+    delayed = delay_holds(inode, idx);
+    if (delayed)
+      memcpy(buffer + bytes_read,
+             inode->delay_buf + (idx - inode->delay_first) * BLOCK_SECTOR_SIZE + sector_ofs,
+             chunk_size);
+    else
+      sector_idx = byte_to_sector(inode, offset);
+    lock_release(&inode->lock);
+
+    if (sector_idx != 0)
+      cache_read_at(sector_idx, buffer + bytes_read, sector_ofs, chunk_size);
+    else if (!delayed)
+      memset(buffer + bytes_read, 0, chunk_size);
 
     /* Advance. */
     size -= chunk_size;
     offset += chunk_size;
     bytes_read += chunk_size;
   }
-  free(bounce);
+  rw_lock_release(&inode->rw_lock, true);
 
   return bytes_read;
 }
 
 /* Writes SIZE bytes from BUFFER into INODE, starting at OFFSET.
    Returns the number of bytes actually written, which may be
-   less than SIZE if end of file is reached or an error occurs.
-   (Normally a write at end of file would extend the inode, but
-   growth is not yet implemented.) */
+   less than SIZE if the disk fills up or the maximum file size
+   is reached.  A write past end of file extends the inode,
+   leaving any gap as a hole that is not allocated on disk.
+   Appended data is not given disk space until later; see
+   DELAY_MAX.  Writes to the same inode are serialized, but
+   writes to different inodes run in parallel.  Changes to the
+   inode itself are journaled, as is the data of journaled
+   inodes.
+
+   Writes to a journaled inode are small and made within the
+   caller's handle, which as usual comes before INODE's locks.
+   Other writes may be any size, so they take INODE's write lock
+   first and then a new handle every WRITE_STEP_SECTORS sectors,
+   or sooner if allocation runs the handle low on credits.
+   No thread waits for such an inode's lock with a handle open,
+   so waiting for a commit while holding it cannot deadlock. */
 off_t inode_write_at(struct inode* inode, const void* buffer_, off_t size, off_t offset) {
   const uint8_t* buffer = buffer_;
   off_t bytes_written = 0;
-  uint8_t* bounce = NULL;
+  size_t sector_cnt = 0;
 
   if (inode->deny_write_cnt)
     return 0;
 
+  if (inode->journaled)
+    journal_begin();
+  rw_lock_acquire(&inode->rw_lock, false);
+  if (!inode->journaled)
+    journal_begin();
   while (size > 0) {
     /* Sector to write, starting byte offset within sector. */
-    block_sector_t sector_idx = byte_to_sector(inode, offset);
+    size_t idx = offset / BLOCK_SECTOR_SIZE;
+    block_sector_t sector_idx;
     int sector_ofs = offset % BLOCK_SECTOR_SIZE;
 
-    /* Bytes left in inode, bytes left in sector, lesser of the two. */
-    off_t inode_left = inode_length(inode) - offset;
+    /* Bytes left before maximum file size, bytes left in sector,
+       lesser of the two. */
+    off_t inode_left = INODE_MAX_LENGTH - offset;
     int sector_left = BLOCK_SECTOR_SIZE - sector_ofs;
     int min_left = inode_left < sector_left ? inode_left : sector_left;
 
@@ -235,26 +1029,52 @@ off_t inode_write_at(struct inode* inode, const void* buffer_, off_t size, off_t
     if (chunk_size <= 0)
       break;
 
-    if (sector_ofs == 0 && chunk_size == BLOCK_SECTOR_SIZE) {
-      /* Write full sector directly to disk. */
-      block_write(fs_device, sector_idx, buffer + bytes_written);
+    if (!inode->journaled && sector_cnt == WRITE_STEP_SECTORS) {
+      journal_end();
+      journal_begin();
+      sector_cnt = 0;
+    }
+    sector_cnt++;
+    lock_acquire(&inode->lock);
+
+    /* An append that does not fit the delay buffer flushes it
+       and starts a new one.  A flush cut short by the handle's
+       credits goes on in a new handle. */
+    if (!delay_accepts(inode, idx) && inode->delay_cnt > 0 && idx >= extent_end(inode) &&
+        delay_flush(inode) && inode->delay_cnt > 0) {
+      lock_release(&inode->lock);
+      sector_cnt = WRITE_STEP_SECTORS;
+      continue;
+    }
+    if (!inode->journaled && delay_accepts(inode, idx) &&
+        delay_write(inode, idx, buffer + bytes_written, sector_ofs, chunk_size)) {
+      lock_release(&inode->lock);
     } else {
-      /* We need a bounce buffer. */
-      if (bounce == NULL) {
-        bounce = malloc(BLOCK_SECTOR_SIZE);
-        if (bounce == NULL)
-          break;
+      /* Allocate the sector now if it is a hole.  Stop if the
+         disk is full, or if a journaled inode's handle is out of
+         credits; other inodes go on in a new handle. */
+      bool restart = false;
+
+      sector_idx = byte_to_sector(inode, offset);
+      if (sector_idx == 0) {
+        size_t done;
+        bool success = allocate_range(inode, idx, 1, NULL, false, &done);
+        if (done > 0) {
+          write_extents(inode);
+          sector_idx = byte_to_sector(inode, offset);
+        } else if (success && !inode->journaled) {
+          restart = true;
+        }
       }
+      lock_release(&inode->lock);
+      if (restart) {
+        sector_cnt = WRITE_STEP_SECTORS;
+        continue;
+      }
+      if (sector_idx == 0)
+        break;
 
-      /* If the sector contains data before or after the chunk
-             we're writing, then we need to read in the sector
-             first.  Otherwise we start with a sector of all zeros. */
-      if (sector_ofs > 0 || chunk_size < sector_left)
-        block_read(fs_device, sector_idx, bounce);
-      else
-        memset(bounce, 0, BLOCK_SECTOR_SIZE);
-      memcpy(bounce + sector_ofs, buffer + bytes_written, chunk_size);
-      block_write(fs_device, sector_idx, bounce);
+      write_data(inode, sector_idx, buffer + bytes_written, sector_ofs, chunk_size);
     }
 
     /* Advance. */
@@ -262,11 +1082,55 @@ off_t inode_write_at(struct inode* inode, const void* buffer_, off_t size, off_t
     offset += chunk_size;
     bytes_written += chunk_size;
   }
-  free(bounce);
+
+  /* Extend the file only after its new data is in place, so that
+     concurrent readers never see unwritten bytes. */
+  if (bytes_written > 0 && offset > inode_length(inode)) {
+    lock_acquire(&inode->lock);
+    if (offset > inode->data.length) {
+      inode->data.length = offset;
+      journal_write(inode->sector, &inode->data, 0, BLOCK_SECTOR_SIZE);
+    }
+    lock_release(&inode->lock);
+  }
+  rw_lock_release(&inode->rw_lock, false);
+  journal_end();
 
   return bytes_written;
 }
 
+/* Asks for the SIZE bytes of INODE starting at OFFSET to be
+   read into the buffer cache in the background.  Bytes past end
+   of file, holes and delayed data are ignored. */
+void inode_readahead(struct inode* inode, off_t size, off_t offset) {
+  off_t end = offset + size;
+
+  if (end > inode_length(inode))
+    end = inode_length(inode);
+
+  lock_acquire(&inode->lock);
+  for (offset = ROUND_DOWN(offset, BLOCK_SECTOR_SIZE); offset < end; offset += BLOCK_SECTOR_SIZE) {
+    block_sector_t sector = byte_to_sector(inode, offset);
+    if (sector != 0)
+      cache_readahead(sector);
+  }
+  lock_release(&inode->lock);
+}
+
+/* Acquires the lock that protects the entries of directory
+   INODE, shared if READER is true.  It is separate from the lock
+   that inode_read_at() and inode_write_at() take, so that a
+   directory operation can hold it across several of those
+   calls. */
+void inode_lock_dir(struct inode* inode, bool reader) {
+  rw_lock_acquire(&inode->dir_lock, reader);
+}
+
+/* Releases the lock acquired by inode_lock_dir(). */
+void inode_unlock_dir(struct inode* inode, bool reader) {
+  rw_lock_release(&inode->dir_lock, reader);
+}
+
 /* Disables writes to INODE.
    May be called at most once per inode opener. */
 void inode_deny_write(struct inode* inode) {
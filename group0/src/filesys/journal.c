@@ -0,0 +1,378 @@
+#include "filesys/journal.h"
+#include <debug.h>
+#include <hash.h>
+#include <stdio.h>
+#include <string.h>
+#include "devices/shutdown.h"
+#include "filesys/cache.h"
+#include "filesys/filesys.h"
+#include "filesys/free-map.h"
+#include "threads/palloc.h"
+#include "threads/synch.h"
+#include "threads/thread.h"
+#include "threads/vaddr.h"
+
+/* Write-ahead journal of file system metadata.
+
+   Every change to an inode, overflow sector, directory or the
+   free map is made through journal_write() inside a handle,
+   which journal_begin() opens and journal_end() closes.  Handles
+   nest, so an operation such as filesys_create() opens one
+   around everything it does and the calls it makes join it.
+   Journaled sectors are written to the buffer cache as usual,
+   but held there, never written back, until committed.
+
+   All handles open at the same time belong to one running
+   transaction.  Committing it (only possible while no handle is
+   open) writes a descriptor listing the sectors, a copy of each,
+   and a commit record with a checksum to the journal region,
+   and only then writes the sectors to their home locations
+   (the "checkpoint").  Changes thus reach their home locations
+   all together or, after a crash, are copied there by replay at
+   the next mount, which reads nothing but the journal region.
+   The sequence number in the superblock goes up after each
+   checkpoint, so that an old transaction is never replayed
+   twice.
+
+   Many operations share a commit: the running transaction is
+   committed only once it has logged JOURNAL_COMMIT_BLOCKS
+   sectors, by the flusher thread, or at shutdown.  A commit
+   requested while handles are open is done by the last of them
+   to close, and new handles wait for it.  Thus journal_begin()
+   may block, and it must be called before taking any file
+   system lock.
+
+   A transaction must never outgrow the journal region, since a
+   sector that cannot be logged cannot be written atomically with
+   the rest.  So each outermost handle reserves room for
+   JOURNAL_HANDLE_BLOCKS sectors when it opens, waiting for a
+   commit if the running transaction lacks the room, and a
+   handle that logs more than that panics the kernel.
+
+   Only metadata is journaled.  File data goes through the
+   buffer cache unlogged, so after a crash a file may contain
+   stale data, but the file system structure is intact.  For the
+   same reason, the free map does not reuse a sector until the
+   transaction that released it has committed, since unlogged
+   data written there could otherwise replace metadata that a
+   crash would bring back. */
+
+/* Running transaction size that triggers a commit. */
+#define JOURNAL_COMMIT_BLOCKS (JOURNAL_MAX_BLOCKS / 2)
+
+/* Magic numbers identifying journal blocks. */
+#define JOURNAL_SUPER_MAGIC 0x4a535550  /* "JSUP" */
+#define JOURNAL_DESC_MAGIC 0x4a445343   /* "JDSC" */
+#define JOURNAL_COMMIT_MAGIC 0x4a434d54 /* "JCMT" */
+
+/* Journal superblock, in sector JOURNAL_SECTOR.
+   Must be exactly BLOCK_SECTOR_SIZE bytes long. */
+struct journal_super {
+  uint32_t magic;      /* JOURNAL_SUPER_MAGIC. */
+  uint32_t seq;        /* Sequence number of next transaction. */
+  uint8_t unused[504]; /* Not used. */
+};
+
+/* Transaction descriptor, in sector JOURNAL_SECTOR + 1.  The
+   logged sectors follow it.  Must be exactly BLOCK_SECTOR_SIZE
+   bytes long. */
+struct journal_desc {
+  uint32_t magic;              /* JOURNAL_DESC_MAGIC. */
+  uint32_t seq;                /* Transaction sequence number. */
+  uint32_t cnt;                /* Number of logged sectors. */
+  block_sector_t sectors[125]; /* Home location of each logged sector. */
+};
+
+/* Commit record, just past the last logged sector.  Must be
+   exactly BLOCK_SECTOR_SIZE bytes long. */
+struct journal_commit {
+  uint32_t magic;      /* JOURNAL_COMMIT_MAGIC. */
+  uint32_t seq;        /* Transaction sequence number. */
+  uint32_t checksum;   /* Checksum of descriptor and logged sectors. */
+  uint8_t unused[500]; /* Not used. */
+};
+
+static struct lock journal_lock;      /* Protects all of the below. */
+static struct condition journal_cond; /* Signaled after each commit. */
+static int active_cnt;                /* Number of open outermost handles. */
+static size_t reserved_cnt;           /* Sectors open handles may still log. */
+static bool commit_requested;         /* Commit when ACTIVE_CNT drops to 0? */
+static uint32_t seq;                  /* Sequence number of running transaction. */
+
+/* Sectors logged by the running transaction, and buffer for
+   their contents during commit and replay. */
+static block_sector_t txn_sectors[JOURNAL_MAX_BLOCKS];
+static size_t txn_cnt;
+static uint8_t* log_data;
+
+/* Power off right after this many commits, or never if 0. */
+static int crash_after;
+
+/* Statistics. */
+static unsigned long long commit_cnt;   /* Transactions committed. */
+static unsigned long long logged_cnt;   /* Sectors written to the journal. */
+static unsigned long long handle_cnt;   /* Outermost handles opened. */
+static unsigned long long full_cnt;     /* Handles that waited for room. */
+static size_t replayed_cnt;             /* Sectors replayed at mount. */
+
+static void commit(void);
+static void replay(void);
+static void write_super(void);
+static uint32_t checksum(const struct journal_desc*);
+
+/* Makes the machine power off, without writing back anything,
+   just after the CNT'th commit record reaches disk.  Used to
+   test recovery.  Must be called before journal_init(). */
+void journal_configure_crash(int cnt) {
+  ASSERT(cnt > 0);
+  crash_after = cnt;
+}
+
+/* Initializes the journal.  If FORMAT is true, writes an empty
+   journal; otherwise replays the last committed transaction,
+   if it was interrupted by a crash.  Must be called after
+   cache_init() and before any metadata is read. */
+void journal_init(bool format) {
+  ASSERT(sizeof(struct journal_super) == BLOCK_SECTOR_SIZE);
+  ASSERT(sizeof(struct journal_desc) == BLOCK_SECTOR_SIZE);
+  ASSERT(sizeof(struct journal_commit) == BLOCK_SECTOR_SIZE);
+
+  lock_init(&journal_lock);
+  cond_init(&journal_cond);
+  log_data = palloc_get_multiple(PAL_ASSERT, JOURNAL_MAX_BLOCKS * BLOCK_SECTOR_SIZE / PGSIZE);
+
+  if (format)
+    seq = 1;
+  else
+    replay();
+  write_super();
+}
+
+/* Returns true if the running transaction has room for one more
+   handle's worth of sectors.  JOURNAL_LOCK must be held. */
+static bool has_room(void) {
+  return txn_cnt + reserved_cnt + JOURNAL_HANDLE_BLOCKS <= JOURNAL_MAX_BLOCKS;
+}
+
+/* Opens a handle, making the calling thread's journal_write()
+   calls part of the running transaction until the matching
+   journal_end().  Handles nest.  Opening an outermost handle
+   waits for a requested commit, or for one it requests itself
+   if the running transaction is too full, so the caller must
+   not hold any file system lock. */
+void journal_begin(void) {
+  struct thread* t = thread_current();
+
+  if (t->journal_depth++ > 0)
+    return;
+
+  lock_acquire(&journal_lock);
+  if (!has_room())
+    full_cnt++;
+  while (commit_requested || !has_room()) {
+    commit_requested = true;
+    if (active_cnt == 0)
+      commit();
+    else
+      cond_wait(&journal_cond, &journal_lock);
+  }
+  active_cnt++;
+  reserved_cnt += JOURNAL_HANDLE_BLOCKS;
+  t->journal_credits = JOURNAL_HANDLE_BLOCKS;
+  handle_cnt++;
+  lock_release(&journal_lock);
+}
+
+/* Closes the handle opened by the matching journal_begin().
+   Closing the last open handle commits the running transaction
+   if it has grown large or a commit was requested. */
+void journal_end(void) {
+  struct thread* t = thread_current();
+
+  ASSERT(t->journal_depth > 0);
+  if (--t->journal_depth > 0)
+    return;
+
+  lock_acquire(&journal_lock);
+  reserved_cnt -= t->journal_credits;
+  t->journal_credits = 0;
+  if (txn_cnt >= JOURNAL_COMMIT_BLOCKS)
+    commit_requested = true;
+  if (--active_cnt == 0 && commit_requested)
+    commit();
+  lock_release(&journal_lock);
+}
+
+/* Returns the number of new sectors the calling thread's handle
+   may still log. */
+int journal_credits(void) {
+  struct thread* t = thread_current();
+
+  ASSERT(t->journal_depth > 0);
+  return t->journal_credits;
+}
+
+/* Closes the calling thread's outermost handle and opens a new
+   one with a full JOURNAL_HANDLE_BLOCKS credits, leaving any
+   handles nested in it open.  What was logged before may thus
+   commit apart from what is logged after, so the caller must be
+   at a point where that leaves the file system consistent, or at
+   worst with sectors allocated that nothing uses.  Like
+   journal_begin(), may wait for a commit, so the caller must not
+   hold any file system lock that a thread with a handle open
+   might wait for. */
+void journal_restart(void) {
+  struct thread* t = thread_current();
+  int depth = t->journal_depth;
+
+  ASSERT(depth > 0);
+  t->journal_depth = 1;
+  journal_end();
+  journal_begin();
+  t->journal_depth = depth;
+}
+
+/* Writes SIZE bytes from BUFFER starting at byte SECTOR_OFS
+   within sector SECTOR, as part of the running transaction.  The
+   caller must have a handle open.  Panics if SECTOR would be
+   more than JOURNAL_HANDLE_BLOCKS new sectors for the handle. */
+void journal_write(block_sector_t sector, const void* buffer, int sector_ofs, int size) {
+  struct thread* t = thread_current();
+  size_t i;
+
+  ASSERT(t->journal_depth > 0);
+
+  lock_acquire(&journal_lock);
+  for (i = 0; i < txn_cnt; i++)
+    if (txn_sectors[i] == sector)
+      break;
+  if (i == txn_cnt) {
+    if (t->journal_credits == 0)
+      PANIC("journal handle logged more than %d sectors", JOURNAL_HANDLE_BLOCKS);
+    ASSERT(txn_cnt < JOURNAL_MAX_BLOCKS);
+    t->journal_credits--;
+    reserved_cnt--;
+    txn_sectors[txn_cnt++] = sector;
+  }
+  lock_release(&journal_lock);
+
+  /* No commit can start while our handle is open, so the sector
+     stays in the transaction while we write it. */
+  cache_write_held(sector, buffer, sector_ofs, size);
+}
+
+/* Commits the running transaction, at once if no handle is open
+   or else as soon as the last one closes. */
+void journal_commit(void) {
+  lock_acquire(&journal_lock);
+  if (txn_cnt > 0) {
+    commit_requested = true;
+    if (active_cnt == 0)
+      commit();
+  }
+  lock_release(&journal_lock);
+}
+
+/* Writes the running transaction to the journal, then to its
+   home locations, and starts a new one.  JOURNAL_LOCK must be
+   held and no handle may be open. */
+static void commit(void) {
+  struct journal_desc desc;
+  struct journal_commit rec;
+  size_t i;
+
+  ASSERT(lock_held_by_current_thread(&journal_lock));
+  ASSERT(active_cnt == 0);
+
+  /* Write descriptor, logged sectors and commit record. */
+  memset(&desc, 0, sizeof desc);
+  desc.magic = JOURNAL_DESC_MAGIC;
+  desc.seq = seq;
+  desc.cnt = txn_cnt;
+  for (i = 0; i < txn_cnt; i++) {
+    desc.sectors[i] = txn_sectors[i];
+    cache_read(txn_sectors[i], log_data + i * BLOCK_SECTOR_SIZE);
+  }
+  block_write(fs_device, JOURNAL_SECTOR + 1, &desc);
+  if (txn_cnt > 0)
+    block_write_multiple(fs_device, JOURNAL_SECTOR + 2, txn_cnt, log_data);
+
+  memset(&rec, 0, sizeof rec);
+  rec.magic = JOURNAL_COMMIT_MAGIC;
+  rec.seq = seq;
+  rec.checksum = checksum(&desc);
+  block_write(fs_device, JOURNAL_SECTOR + 2 + txn_cnt, &rec);
+
+  commit_cnt++;
+  logged_cnt += txn_cnt;
+  if (crash_after != 0 && commit_cnt == (unsigned long long)crash_after) {
+    printf("Journal: crashing after commit %llu.\n", commit_cnt);
+    shutdown_crash();
+  }
+
+  /* Checkpoint. */
+  for (i = 0; i < txn_cnt; i++)
+    block_write(fs_device, txn_sectors[i], log_data + i * BLOCK_SECTOR_SIZE);
+  seq++;
+  write_super();
+  for (i = 0; i < txn_cnt; i++)
+    cache_unhold(txn_sectors[i], log_data + i * BLOCK_SECTOR_SIZE);
+  free_map_commit();
+
+  txn_cnt = 0;
+  commit_requested = false;
+  cond_broadcast(&journal_cond, &journal_lock);
+}
+
+/* Reads the journal superblock and, if the transaction it names
+   was committed but possibly not checkpointed, copies its
+   sectors to their home locations. */
+static void replay(void) {
+  struct journal_super super;
+  struct journal_desc desc;
+  struct journal_commit rec;
+  size_t i;
+
+  block_read(fs_device, JOURNAL_SECTOR, &super);
+  if (super.magic != JOURNAL_SUPER_MAGIC)
+    PANIC("file system has no journal, reformat with -f");
+  seq = super.seq;
+
+  block_read(fs_device, JOURNAL_SECTOR + 1, &desc);
+  if (desc.magic != JOURNAL_DESC_MAGIC || desc.seq != seq || desc.cnt > JOURNAL_MAX_BLOCKS)
+    return;
+  if (desc.cnt > 0)
+    block_read_multiple(fs_device, JOURNAL_SECTOR + 2, desc.cnt, log_data);
+  block_read(fs_device, JOURNAL_SECTOR + 2 + desc.cnt, &rec);
+  if (rec.magic != JOURNAL_COMMIT_MAGIC || rec.seq != seq || rec.checksum != checksum(&desc))
+    return;
+
+  for (i = 0; i < desc.cnt; i++)
+    block_write(fs_device, desc.sectors[i], log_data + i * BLOCK_SECTOR_SIZE);
+  replayed_cnt = desc.cnt;
+  seq++;
+  printf("Journal: replayed %zu sectors.\n", replayed_cnt);
+}
+
+/* Writes the journal superblock. */
+static void write_super(void) {
+  struct journal_super super;
+
+  memset(&super, 0, sizeof super);
+  super.magic = JOURNAL_SUPER_MAGIC;
+  super.seq = seq;
+  block_write(fs_device, JOURNAL_SECTOR, &super);
+}
+
+/* Returns a checksum of DESC and the DESC->cnt sectors in
+   LOG_DATA. */
+static uint32_t checksum(const struct journal_desc* desc) {
+  return hash_bytes(desc, sizeof *desc) ^ hash_bytes(log_data, desc->cnt * BLOCK_SECTOR_SIZE);
+}
+
+/* Prints journal statistics. */
+void journal_print_stats(void) {
+  printf("Journal: %llu commits, %llu sectors logged, %llu handles (%llu waited for room), "
+         "%zu sectors replayed\n",
+         commit_cnt, logged_cnt, handle_cnt, full_cnt, replayed_cnt);
+}
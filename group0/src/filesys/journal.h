@@ -0,0 +1,38 @@
+#ifndef FILESYS_JOURNAL_H
+#define FILESYS_JOURNAL_H
+
+#include <stdbool.h>
+#include "devices/block.h"
+
+/* Most sectors a single transaction can log.  At most this many
+   sectors are held in the buffer cache awaiting commit, so it
+   must stay well below CACHE_SIZE. */
+#define JOURNAL_MAX_BLOCKS 48
+
+/* Most new sectors a single outermost handle may log.  Each
+   handle reserves this much room in the running transaction
+   when it opens, and logging more is a kernel bug: operations
+   that could touch more sectors are split into several handles
+   or refuse to go on, checking journal_credits() and calling
+   journal_restart() as they go.  The largest fixed-size one,
+   creating a file in a hashed directory that must split a leaf
+   twice, logs about a dozen sectors plus one per free map sector
+   it touches. */
+#define JOURNAL_HANDLE_BLOCKS 16
+
+/* Sectors reserved for the journal, starting at JOURNAL_SECTOR:
+   a superblock, a descriptor, the logged sectors, and a commit
+   record. */
+#define JOURNAL_SECTORS (JOURNAL_MAX_BLOCKS + 3)
+
+void journal_configure_crash(int cnt);
+void journal_init(bool format);
+void journal_begin(void);
+void journal_end(void);
+int journal_credits(void);
+void journal_restart(void);
+void journal_write(block_sector_t, const void*, int sector_ofs, int size);
+void journal_commit(void);
+void journal_print_stats(void);
+
+#endif /* filesys/journal.h */
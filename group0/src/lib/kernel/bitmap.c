@@ -26,6 +26,7 @@ typedef unsigned long elem_type;
    simulates an array of bits. */
 struct bitmap {
   size_t bit_cnt;  /* Number of bits. */
+  size_t hint;     /* Next-fit start for bitmap_scan_and_flip(). */
   elem_type* bits; /* Elements that represent bits. */
 };
 
@@ -50,6 +51,64 @@ static inline elem_type last_mask(const struct bitmap* b) {
   return last_bits ? ((elem_type)1 << last_bits) - 1 : (elem_type)-1;
 }
 
+/* Returns a bit mask in which the bits at and above BIT_IDX's
+   position within its element are set to 1 and the rest are set
+   to 0. */
+static inline elem_type high_mask(size_t bit_idx) { return (elem_type)-1 << (bit_idx % ELEM_BITS); }
+
+/* Returns the number of bits set to 1 in WORD.  (The kernel is
+   not linked against libgcc, so __builtin_popcount is out.) */
+static inline size_t count_ones(elem_type word) {
+  size_t cnt = 0;
+  for (; word != 0; word &= word - 1)
+    cnt++;
+  return cnt;
+}
+
+/* Returns the index of the first bit in B at or after START and
+   before LIMIT that is set to VALUE, or LIMIT if there is none.
+   Examines a whole element at a time, so runs of bits that are
+   all !VALUE cost one memory access per ELEM_BITS bits. */
+static size_t next_bit(const struct bitmap* b, size_t start, size_t limit, bool value) {
+  size_t idx = elem_idx(start);
+  elem_type flip = value ? 0 : (elem_type)-1;
+  elem_type word;
+
+  if (start >= limit)
+    return limit;
+
+  word = (b->bits[idx] ^ flip) & high_mask(start);
+  while (word == 0) {
+    if (++idx >= elem_cnt(limit))
+      return limit;
+    word = b->bits[idx] ^ flip;
+  }
+
+  start = idx * ELEM_BITS + __builtin_ctzl(word);
+  return start < limit ? start : limit;
+}
+
+/* Finds the first group of CNT consecutive bits in B at or after
+   START and before LIMIT that are all set to VALUE.  Returns the
+   index of its first bit, or BITMAP_ERROR if there is none.
+   Each step skips to the next bit set to VALUE, then to the next
+   bit set to !VALUE, so no bit is examined more than twice. */
+static size_t scan_range(const struct bitmap* b, size_t start, size_t limit, size_t cnt,
+                         bool value) {
+  while (start + cnt <= limit) {
+    size_t end;
+
+    start = next_bit(b, start, limit, value);
+    if (start + cnt > limit)
+      break;
+    end = next_bit(b, start, start + cnt, !value);
+    if (end == start + cnt)
+      return start;
+    start = end;
+  }
+  return BITMAP_ERROR;
+}
+
 /* Creation and destruction. */
 
 /* Creates and returns a pointer to a newly allocated bitmap with room for
@@ -60,6 +119,7 @@ struct bitmap* bitmap_create(size_t bit_cnt) {
   struct bitmap* b = malloc(sizeof *b);
   if (b != NULL) {
     b->bit_cnt = bit_cnt;
+    b->hint = 0;
     b->bits = malloc(byte_cnt(bit_cnt));
     if (b->bits != NULL || bit_cnt == 0) {
       bitmap_set_all(b, false);
@@ -79,6 +139,7 @@ struct bitmap* bitmap_create_in_buf(size_t bit_cnt, void* block, size_t block_si
   ASSERT(block_size >= bitmap_buf_size(bit_cnt));
 
   b->bit_cnt = bit_cnt;
+  b->hint = 0;
   b->bits = (elem_type*)(b + 1);
   bitmap_set_all(b, false);
   return b;
@@ -165,16 +226,31 @@ void bitmap_set_all(struct bitmap* b, bool value) {
   bitmap_set_multiple(b, 0, bitmap_size(b), value);
 }
 
-/* Sets the CNT bits starting at START in B to VALUE. */
+/* Sets the CNT bits starting at START in B to VALUE.
+   Each element is updated atomically, but the group as a whole
+   is not. */
 void bitmap_set_multiple(struct bitmap* b, size_t start, size_t cnt, bool value) {
-  size_t i;
+  size_t end = start + cnt;
 
   ASSERT(b != NULL);
   ASSERT(start <= b->bit_cnt);
   ASSERT(start + cnt <= b->bit_cnt);
 
-  for (i = 0; i < cnt; i++)
-    bitmap_set(b, start + i, value);
+  while (start < end) {
+    size_t idx = elem_idx(start);
+    elem_type mask = high_mask(start);
+    if (elem_idx(end) == idx)
+      mask &= ~high_mask(end);
+
+    /* Same as bitmap_mark() and bitmap_reset(), applied to
+       every bit in MASK at once. */
+    if (value)
+      asm("orl %1, %0" : "=m"(b->bits[idx]) : "r"(mask) : "cc");
+    else
+      asm("andl %1, %0" : "=m"(b->bits[idx]) : "r"(~mask) : "cc");
+
+    start = (idx + 1) * ELEM_BITS;
+  }
 }
 
 /* Returns the number of bits in B between START and START + CNT,
@@ -187,25 +263,23 @@ size_t bitmap_count(const struct bitmap* b, size_t start, size_t cnt, bool value
   ASSERT(start + cnt <= b->bit_cnt);
 
   value_cnt = 0;
-  for (i = 0; i < cnt; i++)
-    if (bitmap_test(b, start + i) == value)
-      value_cnt++;
-  return value_cnt;
+  for (i = start; i < start + cnt; i = (elem_idx(i) + 1) * ELEM_BITS) {
+    elem_type word = b->bits[elem_idx(i)] & high_mask(i);
+    if (elem_idx(start + cnt) == elem_idx(i))
+      word &= ~high_mask(start + cnt);
+    value_cnt += count_ones(word);
+  }
+  return value ? value_cnt : cnt - value_cnt;
 }
 
 /* Returns true if any bits in B between START and START + CNT,
    exclusive, are set to VALUE, and false otherwise. */
 bool bitmap_contains(const struct bitmap* b, size_t start, size_t cnt, bool value) {
-  size_t i;
-
   ASSERT(b != NULL);
   ASSERT(start <= b->bit_cnt);
   ASSERT(start + cnt <= b->bit_cnt);
 
-  for (i = 0; i < cnt; i++)
-    if (bitmap_test(b, start + i) == value)
-      return true;
-  return false;
+  return next_bit(b, start, start + cnt, value) < start + cnt;
 }
 
 /* Returns true if any bits in B between START and START + CNT,
@@ -236,30 +310,88 @@ size_t bitmap_scan(const struct bitmap* b, size_t start, size_t cnt, bool value)
   ASSERT(b != NULL);
   ASSERT(start <= b->bit_cnt);
 
-  if (cnt <= b->bit_cnt) {
-    size_t last = b->bit_cnt - cnt;
-    size_t i;
-    for (i = start; i <= last; i++)
-      if (!bitmap_contains(b, i, cnt, !value))
-        return i;
-  }
-  return BITMAP_ERROR;
+  if (cnt == 0)
+    return start;
+  return scan_range(b, start, b->bit_cnt, cnt, value);
 }
 
-/* Finds the first group of CNT consecutive bits in B at or after
-   START that are all set to VALUE, flips them all to !VALUE,
-   and returns the index of the first bit in the group.
+/* Finds a group of CNT consecutive bits in B at or after START
+   that are all set to VALUE, flips them all to !VALUE, and
+   returns the index of the first bit in the group.
    If there is no such group, returns BITMAP_ERROR.
-   If CNT is zero, returns 0.
+   If CNT is zero, returns START.
+
+   The search is next-fit: it begins where the previous
+   successful call left off, if that is past START, and wraps
+   around to START only if nothing is found from there to the
+   end of B.  Repeated allocations thus do not rescan the
+   already-full prefix of B.
+
    Bits are set atomically, but testing bits is not atomic with
    setting them. */
 size_t bitmap_scan_and_flip(struct bitmap* b, size_t start, size_t cnt, bool value) {
-  size_t idx = bitmap_scan(b, start, cnt, value);
-  if (idx != BITMAP_ERROR)
+  size_t idx;
+
+  ASSERT(b != NULL);
+  ASSERT(start <= b->bit_cnt);
+
+  if (cnt == 0)
+    return start;
+
+  if (b->hint > start) {
+    idx = scan_range(b, b->hint, b->bit_cnt, cnt, value);
+    if (idx == BITMAP_ERROR) {
+      size_t limit = b->hint + cnt - 1;
+      idx = scan_range(b, start, limit < b->bit_cnt ? limit : b->bit_cnt, cnt, value);
+    }
+  } else
+    idx = scan_range(b, start, b->bit_cnt, cnt, value);
+
+  if (idx != BITMAP_ERROR) {
     bitmap_set_multiple(b, idx, cnt, !value);
+    b->hint = idx + cnt < b->bit_cnt ? idx + cnt : 0;
+  }
   return idx;
 }
 
+/* Finds the best fit in B, at or after START and before LIMIT,
+   for a group of CNT consecutive bits set to VALUE: the shortest
+   run of such bits that is at least CNT long, or if there is
+   none, the longest run.  Runs are cut off at START and LIMIT.
+   Returns the index of the first bit in the run and stores its
+   length into *RUN_CNT, or returns BITMAP_ERROR if no bit in the
+   range is set to VALUE.  Ties go to the run that starts first. */
+size_t bitmap_scan_best(const struct bitmap* b, size_t start, size_t limit, size_t cnt, bool value,
+                        size_t* run_cnt) {
+  size_t best = BITMAP_ERROR;
+  size_t best_cnt = 0;
+
+  ASSERT(b != NULL);
+  ASSERT(cnt > 0);
+  ASSERT(start <= limit && limit <= b->bit_cnt);
+
+  for (;;) {
+    size_t end;
+
+    start = next_bit(b, start, limit, value);
+    if (start >= limit)
+      break;
+    end = next_bit(b, start, limit, !value);
+
+    if (best == BITMAP_ERROR || (best_cnt < cnt && end - start > best_cnt) ||
+        (end - start >= cnt && end - start < best_cnt)) {
+      best = start;
+      best_cnt = end - start;
+      if (best_cnt == cnt)
+        break;
+    }
+    start = end;
+  }
+
+  *run_cnt = best_cnt;
+  return best;
+}
+
 /* File input and output. */
 
 #ifdef FILESYS
@@ -284,6 +416,20 @@ bool bitmap_write(const struct bitmap* b, struct file* file) {
   off_t size = byte_cnt(b->bit_cnt);
   return file_write_at(file, b->bits, size, 0) == size;
 }
+
+/* Writes SIZE bytes of B, as bitmap_write() would store them,
+   starting at byte offset OFS, to the same offset in FILE.  The
+   range is cut off at the end of B.  Return true if successful,
+   false otherwise. */
+bool bitmap_write_part(const struct bitmap* b, struct file* file, size_t ofs, size_t size) {
+  size_t file_size = byte_cnt(b->bit_cnt);
+
+  if (ofs >= file_size)
+    return true;
+  if (size > file_size - ofs)
+    size = file_size - ofs;
+  return file_write_at(file, (const uint8_t*)b->bits + ofs, size, ofs) == (off_t)size;
+}
 #endif /* FILESYS */
 
 /* Debugging. */
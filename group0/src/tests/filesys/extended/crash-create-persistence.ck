@@ -0,0 +1,39 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+
+our ($test, @prereq_tests);
+# Whatever the crash cut off, the file system must hold the test
+# program, "tar", and file0 through fileN-1 for some N: creates
+# are committed in order, and none may be half done.
+my (@output) = read_text_file ("$test.output");
+common_checks ("file system extraction run", @output);
+@output = get_core_output ("file system extraction run", @output);
+@output = grep (!/^[a-zA-Z0-9-_]+: exit\(\d+\)$/, @output);
+fail join ("\n", "Error extracting file system:", @output) if @output;
+
+my (%actual) = read_tar ("$prereq_tests[0].tar");
+my (%expected) = normalize_fs (flatten_hierarchy ({
+    'crash-create' => $prereq_tests[0],
+    'tar' => 'tests/filesys/extended/tar'}, ""));
+foreach my $name (sort keys %expected) {
+    fail "$name is missing from the file system\n" if !exists $actual{$name};
+    my ($exp_file, $exp_length) = open_file ($expected{$name});
+    my ($act_file, $act_length) = open_file ($actual{$name});
+    fail "$name was damaged by the crash\n"
+      if !compare_files ($exp_file, $exp_length, $act_file, $act_length, $name, 1);
+}
+
+my ($file_cnt) = 0;
+$file_cnt++ while exists $actual{"file$file_cnt"};
+foreach my $name (sort keys %actual) {
+    next if exists $expected{$name};
+    my ($idx) = $name =~ /^file(0|[1-9]\d*)$/;
+    fail "$name exists in the file system but it should not\n"
+      if !defined $idx || $idx >= $file_cnt;
+    fail "$name is a directory but should be an ordinary file\n"
+      if is_dir ($actual{$name});
+    fail "$name should be empty\n" if file_size ($actual{$name}) != 0;
+}
+pass;
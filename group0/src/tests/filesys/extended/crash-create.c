@@ -0,0 +1,26 @@
+/* Creates many empty files, one after another, in the root
+   directory.  Run with -jcrash, the kernel powers off partway
+   through, and the persistence check verifies that journal
+   replay recovered every file created before the last commit,
+   and nothing else.  The crashtest and crashcheck kernel
+   actions do the same without system calls. */
+
+#include <stdio.h>
+#include <syscall.h>
+#include "tests/lib.h"
+#include "tests/main.h"
+
+#define FILE_CNT 300
+
+void test_main(void) {
+  int i;
+
+  quiet = true;
+  for (i = 0; i < FILE_CNT; i++) {
+    char name[16];
+
+    snprintf(name, sizeof name, "file%d", i);
+    CHECK(create(name, 0), "create \"%s\"", name);
+  }
+  quiet = false;
+}
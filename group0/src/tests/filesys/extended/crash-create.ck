@@ -0,0 +1,21 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+
+our ($test);
+# The run either powers off after the commit named by -jcrash,
+# without the usual shutdown messages, or finishes normally if
+# the test makes fewer commits than that.
+my (@output) = read_text_file ("$test.output");
+fail "Run produced no output at all\n" if @output == 0;
+check_for_panic ("run", @output);
+check_for_keyword ("run", "FAIL", @output);
+check_for_triple_fault ("run", @output);
+check_for_keyword ("run", "TIMEOUT", @output);
+fail "Test didn't start: no \"(crash-create) begin\" message\n"
+  if !grep (/^\(crash-create\) begin$/, @output);
+fail "Run neither crashed on purpose nor finished\n"
+  if !grep (/^Journal: crashing after commit \d+\.$/, @output)
+     && !grep (/^\(crash-create\) end$/, @output);
+pass;
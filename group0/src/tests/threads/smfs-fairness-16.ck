@@ -0,0 +1,4 @@
+# -*- perl -*-
+use tests::tests;
+use tests::threads::smfs;
+check_smfs_fairness (16);
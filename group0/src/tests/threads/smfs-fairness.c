@@ -0,0 +1,119 @@
+/* Measures how closely the fair scheduler divides the CPU in
+   proportion to each thread's tickets, and reports the result
+   as Jain's fairness index over the normalized shares.
+
+   Each counter thread counts loop iterations while it runs.
+   Dividing its count by its ticket count gives its share per
+   ticket, which should be the same for every thread.  Jain's
+   index of those shares is 1 when they are all equal and falls
+   toward 1/n as one thread takes everything.
+
+   With 256 threads holding 1 to 63 tickets, a thread with few
+   tickets runs only a handful of time slices in the whole run,
+   and each one is a large part of its share.  The run is long
+   enough to keep that error well below the pass mark. */
+
+#include <stdio.h>
+#include "tests/threads/tests.h"
+#include "threads/init.h"
+#include "threads/interrupt.h"
+#include "threads/synch.h"
+#include "threads/thread.h"
+#include "devices/timer.h"
+
+static thread_func counter_thread_func;
+
+static void test_smfs_fairness(size_t num_threads);
+
+#define TEST(n)                                                                                    \
+  void test_smfs_fairness_##n(void) { test_smfs_fairness(n); }
+
+TEST(16);
+TEST(256);
+
+#define MAX_THREADS 256
+
+/* Number of timer ticks to let the counter threads run. */
+#define RUN_TICKS 16000
+
+static int64_t counters[MAX_THREADS];
+static int64_t shares[MAX_THREADS];
+static struct semaphore barrier_sema;
+static struct semaphore done_sema;
+static bool keep_looping;
+
+/* Returns the priority of counter thread I: spread over
+   [PRI_MIN, PRI_MAX - 1]. */
+static int counter_priority(size_t i) { return PRI_MIN + i % (PRI_MAX - PRI_MIN); }
+
+void test_smfs_fairness(size_t num_threads) {
+  int64_t max_share, sum, sum_sq;
+  int index;
+
+  ASSERT(active_sched_policy == SCHED_FAIR);
+  ASSERT(num_threads <= MAX_THREADS);
+
+  /* Not essential, but reduces randomness. */
+  thread_set_priority(PRI_MAX);
+
+  sema_init(&barrier_sema, 0);
+  sema_init(&done_sema, 0);
+  keep_looping = true;
+
+  msg("Spawning %zu counter threads...", num_threads);
+  for (size_t i = 0; i < num_threads; i++) {
+    char name[16];
+
+    counters[i] = 0;
+    snprintf(name, sizeof name, "counter %zu", i);
+    thread_create(name, counter_priority(i), counter_thread_func, &counters[i]);
+  }
+  msg("Done spawning counter threads.");
+
+  /* Release barrier and let the counters run. */
+  for (size_t i = 0; i < num_threads; i++)
+    sema_up(&barrier_sema);
+  timer_sleep(RUN_TICKS);
+
+  intr_disable();
+  keep_looping = false;
+  intr_enable();
+  for (size_t i = 0; i < num_threads; i++)
+    sema_down(&done_sema);
+
+  /* Normalize each count by its ticket count, then scale the
+     shares into [0, 1000] so that the sums below cannot overflow. */
+  max_share = 1;
+  for (size_t i = 0; i < num_threads; i++) {
+    shares[i] = counters[i] / PRI_TICKETS(counter_priority(i));
+    if (shares[i] > max_share)
+      max_share = shares[i];
+  }
+  sum = sum_sq = 0;
+  for (size_t i = 0; i < num_threads; i++) {
+    int64_t x = shares[i] * 1000 / max_share;
+    sum += x;
+    sum_sq += x * x;
+  }
+
+  /* Jain's index = (sum x)^2 / (n * sum x^2), reported in
+     thousandths. */
+  index = sum_sq > 0 ? sum * sum * 1000 / ((int64_t)num_threads * sum_sq) : 0;
+  msg("Jain's fairness index: %d.%03d", index / 1000, index % 1000);
+}
+
+static void counter_thread_func(void* counter_) {
+  int64_t* counter = counter_;
+  bool loop = true;
+
+  sema_down(&barrier_sema);
+
+  while (loop) {
+    intr_disable();
+    *counter += 1;
+    loop = keep_looping;
+    intr_enable();
+  }
+
+  sema_up(&done_sema);
+}
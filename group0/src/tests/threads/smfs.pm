@@ -0,0 +1,19 @@
+sub check_smfs_fairness {
+    my ($threads) = @_;
+    our ($test);
+
+    @output = read_text_file ("$test.output");
+    common_checks ("run", @output);
+
+    my ($index);
+    local ($_);
+    foreach (@output) {
+	($index) = /Jain's fairness index: (\d+\.\d+)$/ if !defined $index;
+    }
+    fail "Fairness index was not reported.\n" if !defined $index;
+    fail "Fairness index $index across $threads threads is below 0.900.\n"
+      if $index < 0.9;
+    pass;
+}
+
+1;
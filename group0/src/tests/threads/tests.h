@@ -52,5 +52,7 @@ extern test_func test_smfs_hierarchy_16;
 extern test_func test_smfs_hierarchy_32;
 extern test_func test_smfs_hierarchy_64;
 extern test_func test_smfs_hierarchy_256;
+extern test_func test_smfs_fairness_16;
+extern test_func test_smfs_fairness_256;
 
 #endif /* tests/threads/tests.h */
@@ -22,6 +22,7 @@
 #include "threads/malloc.h"
 #include "threads/palloc.h"
 #include "threads/pte.h"
+#include "threads/slab.h"
 #include "threads/thread.h"
 #ifdef USERPROG
 #include "userprog/process.h"
@@ -37,8 +38,11 @@
 #ifdef FILESYS
 #include "devices/block.h"
 #include "devices/ide.h"
+#include "devices/ramdisk.h"
+#include "filesys/cache.h"
 #include "filesys/filesys.h"
 #include "filesys/fsutil.h"
+#include "filesys/journal.h"
 #endif
 
 /* Page directory with kernel mappings only. */
@@ -65,6 +69,9 @@ static void paging_init(void);
 
 static char** read_command_line(void);
 static char** parse_options(char** argv);
+#ifdef FILESYS
+static int parse_positive(const char* name, const char* value);
+#endif
 static void run_actions(char** argv);
 static void usage(void);
 
@@ -95,6 +102,7 @@ int main(void) {
   /* Initialize memory system. */
   palloc_init(user_page_limit);
   malloc_init();
+  kmem_init();
   paging_init();
 
   /* Segmentation. */
@@ -126,6 +134,7 @@ int main(void) {
 #ifdef FILESYS
   /* Initialize file system. */
   ide_init();
+  ramdisk_init();
   locate_block_devices();
   filesys_init(format_filesys);
 #endif
@@ -240,6 +249,12 @@ static char** parse_options(char** argv) {
       filesys_bdev_name = value;
     else if (!strcmp(name, "-scratch"))
       scratch_bdev_name = value;
+    else if (!strcmp(name, "-flush"))
+      cache_configure_flush(parse_positive(name, value));
+    else if (!strcmp(name, "-jcrash"))
+      journal_configure_crash(parse_positive(name, value));
+    else if (!strcmp(name, "-ramdisk"))
+      ramdisk_configure(atoi(value));
 #ifdef VM
     else if (!strcmp(name, "-swap"))
       swap_bdev_name = value;
@@ -306,6 +321,25 @@ static char** parse_options(char** argv) {
   return argv;
 }
 
+#ifdef FILESYS
+/* Returns VALUE, the value given for option NAME, as a positive
+   integer.  Panics if it is missing or is not one. */
+static int parse_positive(const char* name, const char* value) {
+  bool ok = value != NULL && *value != '\0';
+  int n = 0;
+
+  for (; ok && *value != '\0'; value++) {
+    int digit = *value - '0';
+    ok = digit >= 0 && digit <= 9 && n <= (INT_MAX - digit) / 10;
+    if (ok)
+      n = n * 10 + digit;
+  }
+  if (!ok || n == 0)
+    PANIC("option `%s' needs a positive integer value (use -h for help)", name);
+  return n;
+}
+#endif
+
 /* Runs the task specified in ARGV[1]. */
 static void run_task(char** argv) {
   const char* task = argv[1];
@@ -364,6 +398,10 @@ static void run_actions(char** argv) {
       {"rm", 2, fsutil_rm},
       {"extract", 1, fsutil_extract},
       {"append", 2, fsutil_append},
+      {"dirbench", 1, fsutil_dirbench},
+      {"iobench", 1, fsutil_iobench},
+      {"crashtest", 1, fsutil_crashtest},
+      {"crashcheck", 1, fsutil_crashcheck},
 #endif
       {NULL, 0, NULL},
   };
@@ -408,6 +446,10 @@ static void usage(void) {
          "  ls                 List files in the root directory.\n"
          "  cat FILE           Print FILE to the console.\n"
          "  rm FILE            Delete FILE.\n"
+         "  dirbench           Time linear and hashed directories.\n"
+         "  iobench            Compare global and per-inode file system locking.\n"
+         "  crashtest          Create files until -jcrash powers off.\n"
+         "  crashcheck         Check the files crashtest left behind.\n"
          "Use these actions indirectly via `pintos' -g and -p options:\n"
          "  extract            Untar from scratch device into file system.\n"
          "  append FILE        Append FILE to tar file on scratch device.\n"
@@ -420,6 +462,9 @@ static void usage(void) {
          "  -f                 Format file system device during startup.\n"
          "  -filesys=BDEV      Use BDEV for file system instead of default.\n"
          "  -scratch=BDEV      Use BDEV for scratch instead of default.\n"
+         "  -flush=TICKS       Write back dirty file system data every TICKS ticks.\n"
+         "  -jcrash=N          Power off without syncing after N journal commits.\n"
+         "  -ramdisk=KB        Create a KB-kilobyte RAM disk named ram0.\n"
 #ifdef VM
          "  -swap=BDEV         Use BDEV for swap instead of default.\n"
 #endif // VM
@@ -236,6 +236,22 @@ static void pic_init(void) {
   outb(PIC1_DATA, 0x00);
 }
 
+/* Returns true if the PICs have IRQ (0...15) raised but not yet
+   delivered to the CPU, e.g. because interrupts are off. */
+bool intr_irq_pending(int irq) {
+  ASSERT(irq >= 0 && irq < 16);
+
+  /* OCW3: make the next read of the control register return the
+     interrupt request register. */
+  if (irq < 8) {
+    outb(PIC0_CTRL, 0x0a);
+    return (inb(PIC0_CTRL) >> irq) & 1;
+  } else {
+    outb(PIC1_CTRL, 0x0a);
+    return (inb(PIC1_CTRL) >> (irq - 8)) & 1;
+  }
+}
+
 /* Sends an end-of-interrupt signal to the PIC for the given IRQ.
    If we don't acknowledge the IRQ, it will never be delivered to
    us again, so this is important.  */
@@ -60,6 +60,7 @@ void intr_register_ext(uint8_t vec, intr_handler_func*, const char* name);
 void intr_register_int(uint8_t vec, int dpl, enum intr_level, intr_handler_func*, const char* name);
 bool intr_context(void);
 void intr_yield_on_return(void);
+bool intr_irq_pending(int irq);
 
 void intr_dump_frame(const struct intr_frame*);
 const char* intr_name(uint8_t vec);
@@ -26,7 +26,13 @@
    When we free a block, we add it to its descriptor's free list.
    But if the arena that the block was in now has no in-use
    blocks, we remove all of the arena's blocks from the free list
-   and give the arena back to the page allocator.
+   and give the arena back to the page allocator, unless the
+   descriptor has fewer than SPARE_ARENAS empty arenas, in which
+   case we keep it to avoid churning pages through the page
+   allocator when a block is repeatedly allocated and freed.
+
+   Hot fixed-size objects are better served by the object caches
+   in slab.h, which do not round sizes up to a power of 2.
 
    We can't handle blocks bigger than 2 kB using this scheme,
    because they're too big to fit in a single page with a
@@ -34,11 +40,15 @@
    with the page allocator and sticking the allocation size at
    the beginning of the allocated block's arena header. */
 
+/* Number of empty arenas each descriptor holds on to. */
+#define SPARE_ARENAS 1
+
 /* Descriptor. */
 struct desc {
   size_t block_size;       /* Size of each element in bytes. */
   size_t blocks_per_arena; /* Number of blocks in an arena. */
   struct list free_list;   /* List of free blocks. */
+  size_t empty_cnt;        /* Number of arenas with no blocks in use. */
   struct lock lock;        /* Lock. */
 };
 
@@ -74,6 +84,7 @@ void malloc_init(void) {
     d->block_size = block_size;
     d->blocks_per_arena = (PGSIZE - sizeof(struct arena)) / block_size;
     list_init(&d->free_list);
+    d->empty_cnt = 0;
     lock_init(&d->lock);
   }
 }
@@ -127,6 +138,7 @@ void* malloc(size_t size) {
     a->magic = ARENA_MAGIC;
     a->desc = d;
     a->free_cnt = d->blocks_per_arena;
+    d->empty_cnt++;
     for (i = 0; i < d->blocks_per_arena; i++) {
       struct block* b = arena_to_block(a, i);
       list_push_back(&d->free_list, &b->free_elem);
@@ -136,7 +148,8 @@ void* malloc(size_t size) {
   /* Get a block from free list and return it. */
   b = list_entry(list_pop_front(&d->free_list), struct block, free_elem);
   a = block_to_arena(b);
-  a->free_cnt--;
+  if (a->free_cnt-- == d->blocks_per_arena)
+    d->empty_cnt--;
   lock_release(&d->lock);
   return b;
 }
@@ -212,16 +225,21 @@ void free(void* p) {
       /* Add block to free list. */
       list_push_front(&d->free_list, &b->free_elem);
 
-      /* If the arena is now entirely unused, free it. */
+      /* If the arena is now entirely unused, keep it as a spare
+         or, if we already have enough spares, free it. */
       if (++a->free_cnt >= d->blocks_per_arena) {
         size_t i;
 
         ASSERT(a->free_cnt == d->blocks_per_arena);
-        for (i = 0; i < d->blocks_per_arena; i++) {
-          struct block* b = arena_to_block(a, i);
-          list_remove(&b->free_elem);
+        if (d->empty_cnt < SPARE_ARENAS)
+          d->empty_cnt++;
+        else {
+          for (i = 0; i < d->blocks_per_arena; i++) {
+            struct block* b = arena_to_block(a, i);
+            list_remove(&b->free_elem);
+          }
+          palloc_free_page(a);
         }
-        palloc_free_page(a);
       }
 
       lock_release(&d->lock);
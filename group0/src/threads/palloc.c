@@ -1,5 +1,6 @@
 #include "threads/palloc.h"
 #include <bitmap.h>
+#include <list.h>
 #include <debug.h>
 #include <inttypes.h>
 #include <round.h>
@@ -25,11 +26,37 @@
    half to the user pool.  That should be huge overkill for the
    kernel pool, but that's just fine for demonstration purposes. */
 
+/* Pages are managed by a binary buddy allocator.  Each pool
+   keeps one free list per order; a block of order K is 2**K
+   pages long and starts at a page index (relative to the pool
+   base) that is a multiple of 2**K.  Allocation splits the
+   smallest sufficient block and freeing coalesces a block with
+   its buddy for as long as the buddy is free, so both take
+   O(log n) time regardless of pool size.
+
+   Requests that are not a power of two are rounded up to the
+   next order and the unused tail is returned to the free lists
+   immediately, so no memory is lost to rounding.  Because
+   palloc_free_multiple() is told the page count, any range can
+   be freed by splitting it into maximal aligned blocks. */
+
+/* Largest block order: 2**10 pages, or 4 MB. */
+#define PALLOC_MAX_ORDER 10
+#define PALLOC_ORDER_CNT (PALLOC_MAX_ORDER + 1)
+
+/* Value of free_order[] for a page that does not start a
+   free block. */
+#define NOT_FREE 0xff
+
 /* A memory pool. */
 struct pool {
-  struct lock lock;        /* Mutual exclusion. */
-  struct bitmap* used_map; /* Bitmap of free pages. */
-  uint8_t* base;           /* Base of pool. */
+  struct lock lock;                         /* Mutual exclusion. */
+  struct list free_lists[PALLOC_ORDER_CNT]; /* Free blocks, by order. */
+  uint8_t* free_order;                      /* Order of free block at each page. */
+  size_t page_cnt;                          /* Number of pages in pool. */
+  size_t free_cnt;                          /* Number of free pages. */
+  uint8_t* base;                            /* Base of pool. */
+  const char* name;                         /* Name, for statistics. */
 };
 
 /* Two pools: one for kernel data, one for user pages. */
@@ -37,6 +64,9 @@ static struct pool kernel_pool, user_pool;
 
 static void init_pool(struct pool*, void* base, size_t page_cnt, const char* name);
 static bool page_from_pool(const struct pool*, void* page);
+static size_t alloc_block(struct pool*, int order);
+static void free_range(struct pool*, size_t page_idx, size_t page_cnt);
+static void print_pool_stats(struct pool*);
 
 /* Initializes the page allocator.  At most USER_PAGE_LIMIT
    pages are put into the user pool. */
@@ -61,18 +91,30 @@ void palloc_init(size_t user_page_limit) {
    otherwise from the kernel pool.  If PAL_ZERO is set in FLAGS,
    then the pages are filled with zeros.  If too few pages are
    available, returns a null pointer, unless PAL_ASSERT is set in
-   FLAGS, in which case the kernel panics. */
+   FLAGS, in which case the kernel panics.
+
+   At most 2**PALLOC_MAX_ORDER pages may be obtained at once. */
 void* palloc_get_multiple(enum palloc_flags flags, size_t page_cnt) {
   struct pool* pool = flags & PAL_USER ? &user_pool : &kernel_pool;
   void* pages;
-  size_t page_idx;
+  size_t page_idx = BITMAP_ERROR;
+  int order = 0;
 
   if (page_cnt == 0)
     return NULL;
 
-  lock_acquire(&pool->lock);
-  page_idx = bitmap_scan_and_flip(pool->used_map, 0, page_cnt, false);
-  lock_release(&pool->lock);
+  while (order <= PALLOC_MAX_ORDER && ((size_t)1 << order) < page_cnt)
+    order++;
+
+  if (order <= PALLOC_MAX_ORDER) {
+    lock_acquire(&pool->lock);
+    page_idx = alloc_block(pool, order);
+    if (page_idx != BITMAP_ERROR) {
+      free_range(pool, page_idx + page_cnt, ((size_t)1 << order) - page_cnt);
+      pool->free_cnt -= page_cnt;
+    }
+    lock_release(&pool->lock);
+  }
 
   if (page_idx != BITMAP_ERROR)
     pages = pool->base + PGSIZE * page_idx;
@@ -116,35 +158,55 @@ void palloc_free_multiple(void* pages, size_t page_cnt) {
     NOT_REACHED();
 
   page_idx = pg_no(pages) - pg_no(pool->base);
+  ASSERT(page_idx + page_cnt <= pool->page_cnt);
 
 #ifndef NDEBUG
   memset(pages, 0xcc, PGSIZE * page_cnt);
 #endif
 
-  ASSERT(bitmap_all(pool->used_map, page_idx, page_cnt));
-  bitmap_set_multiple(pool->used_map, page_idx, page_cnt, false);
+  lock_acquire(&pool->lock);
+  free_range(pool, page_idx, page_cnt);
+  pool->free_cnt += page_cnt;
+  lock_release(&pool->lock);
 }
 
 /* Frees the page at PAGE. */
 void palloc_free_page(void* page) { palloc_free_multiple(page, 1); }
 
+/* Prints page allocator statistics. */
+void palloc_print_stats(void) {
+  print_pool_stats(&kernel_pool);
+  print_pool_stats(&user_pool);
+}
+
 /* Initializes pool P as starting at START and ending at END,
    naming it NAME for debugging purposes. */
 static void init_pool(struct pool* p, void* base, size_t page_cnt, const char* name) {
-  /* We'll put the pool's used_map at its base.
-     Calculate the space needed for the bitmap
+  /* We'll put the pool's free_order map at its base.
+     Calculate the space needed for the map
      and subtract it from the pool's size. */
-  size_t bm_pages = DIV_ROUND_UP(bitmap_buf_size(page_cnt), PGSIZE);
-  if (bm_pages > page_cnt)
-    PANIC("Not enough memory in %s for bitmap.", name);
-  page_cnt -= bm_pages;
+  size_t map_pages = DIV_ROUND_UP(page_cnt, PGSIZE);
+  int order;
+
+  if (map_pages > page_cnt)
+    PANIC("Not enough memory in %s for buddy map.", name);
+  page_cnt -= map_pages;
 
   printf("%zu pages available in %s.\n", page_cnt, name);
 
   /* Initialize the pool. */
   lock_init(&p->lock);
-  p->used_map = bitmap_create_in_buf(page_cnt, base, bm_pages * PGSIZE);
-  p->base = base + bm_pages * PGSIZE;
+  for (order = 0; order <= PALLOC_MAX_ORDER; order++)
+    list_init(&p->free_lists[order]);
+  p->free_order = base;
+  memset(p->free_order, NOT_FREE, page_cnt);
+  p->page_cnt = page_cnt;
+  p->free_cnt = page_cnt;
+  p->base = base + map_pages * PGSIZE;
+  p->name = name;
+
+  /* Every page starts out free. */
+  free_range(p, 0, page_cnt);
 }
 
 /* Returns true if PAGE was allocated from POOL,
@@ -152,7 +214,116 @@ static void init_pool(struct pool* p, void* base, size_t page_cnt, const char* n
 static bool page_from_pool(const struct pool* pool, void* page) {
   size_t page_no = pg_no(page);
   size_t start_page = pg_no(pool->base);
-  size_t end_page = start_page + bitmap_size(pool->used_map);
+  size_t end_page = start_page + pool->page_cnt;
 
   return page_no >= start_page && page_no < end_page;
 }
+
+/* Returns the free list element stored in the first page of
+   the block at PAGE_IDX in POOL. */
+static struct list_elem* block_elem(struct pool* pool, size_t page_idx) {
+  return (struct list_elem*)(pool->base + PGSIZE * page_idx);
+}
+
+/* Adds the block of ORDER at PAGE_IDX to POOL's free lists. */
+static void push_block(struct pool* pool, size_t page_idx, int order) {
+  pool->free_order[page_idx] = order;
+  list_push_front(&pool->free_lists[order], block_elem(pool, page_idx));
+}
+
+/* Removes the free block at PAGE_IDX from POOL's free lists. */
+static void remove_block(struct pool* pool, size_t page_idx) {
+  pool->free_order[page_idx] = NOT_FREE;
+  list_remove(block_elem(pool, page_idx));
+}
+
+/* Takes a block of ORDER out of POOL, splitting a larger block
+   if necessary, and returns the index of its first page, or
+   BITMAP_ERROR if no block is large enough.  POOL's lock must
+   be held. */
+static size_t alloc_block(struct pool* pool, int order) {
+  int k;
+
+  for (k = order; k <= PALLOC_MAX_ORDER; k++)
+    if (!list_empty(&pool->free_lists[k])) {
+      struct list_elem* e = list_front(&pool->free_lists[k]);
+      size_t page_idx = ((uint8_t*)e - pool->base) / PGSIZE;
+
+      remove_block(pool, page_idx);
+      while (k > order) {
+        k--;
+        push_block(pool, page_idx + ((size_t)1 << k), k);
+      }
+      return page_idx;
+    }
+  return BITMAP_ERROR;
+}
+
+/* Returns the block of ORDER at PAGE_IDX to POOL, merging it
+   with its buddy for as long as the buddy is free. */
+static void free_block(struct pool* pool, size_t page_idx, int order) {
+  ASSERT(pool->free_order[page_idx] == NOT_FREE);
+
+  while (order < PALLOC_MAX_ORDER) {
+    size_t buddy = page_idx ^ ((size_t)1 << order);
+    if (buddy >= pool->page_cnt || pool->free_order[buddy] != order)
+      break;
+    remove_block(pool, buddy);
+    page_idx &= ~((size_t)1 << order);
+    order++;
+  }
+  push_block(pool, page_idx, order);
+}
+
+/* Returns the PAGE_CNT pages starting at PAGE_IDX to POOL,
+   splitting them into the largest aligned blocks possible. */
+static void free_range(struct pool* pool, size_t page_idx, size_t page_cnt) {
+  while (page_cnt > 0) {
+    int order = 0;
+    while (order < PALLOC_MAX_ORDER && page_idx % ((size_t)2 << order) == 0 &&
+           ((size_t)2 << order) <= page_cnt)
+      order++;
+    free_block(pool, page_idx, order);
+    page_idx += (size_t)1 << order;
+    page_cnt -= (size_t)1 << order;
+  }
+}
+
+/* Prints free block counts by order for POOL and the length of
+   its longest run of contiguous free pages, which bounds the
+   largest request that could succeed if blocks were not
+   constrained to buddy alignment.
+   Takes no lock, since it runs on the panic path, where the pool
+   lock may be held or unavailable.  It reads only the free_order
+   map, which cannot send the walk out of bounds, not the free
+   lists, which may be half-updated. */
+static void print_pool_stats(struct pool* pool) {
+  size_t block_cnt[PALLOC_MAX_ORDER + 1];
+  size_t largest_run = 0;
+  size_t run = 0;
+  size_t i;
+  int order;
+
+  for (order = 0; order <= PALLOC_MAX_ORDER; order++)
+    block_cnt[order] = 0;
+  for (i = 0; i < pool->page_cnt;) {
+    order = pool->free_order[i];
+    if (order != NOT_FREE && order <= PALLOC_MAX_ORDER) {
+      block_cnt[order]++;
+      run += (size_t)1 << order;
+      i += (size_t)1 << order;
+      if (run > largest_run)
+        largest_run = run;
+    } else {
+      run = 0;
+      i++;
+    }
+  }
+
+  printf("Palloc %s: %zu of %zu pages free, largest free run %zu pages\n", pool->name,
+         pool->free_cnt, pool->page_cnt, largest_run);
+  printf("Palloc %s: free blocks by order:", pool->name);
+  for (order = 0; order <= PALLOC_MAX_ORDER; order++)
+    printf(" %zu", block_cnt[order]);
+  printf("\n");
+}
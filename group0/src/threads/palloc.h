@@ -15,5 +15,6 @@ void* palloc_get_page(enum palloc_flags);
 void* palloc_get_multiple(enum palloc_flags, size_t page_cnt);
 void palloc_free_page(void*);
 void palloc_free_multiple(void*, size_t page_cnt);
+void palloc_print_stats(void);
 
 #endif /* threads/palloc.h */
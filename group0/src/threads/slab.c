@@ -0,0 +1,316 @@
+#include "threads/slab.h"
+#include <debug.h>
+#include <list.h>
+#include <round.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include "threads/malloc.h"
+#include "threads/palloc.h"
+#include "threads/synch.h"
+#include "threads/vaddr.h"
+
+/* Object caches in the style of Bonwick's slab allocator.
+
+   A cache hands out objects of a single size.  Its memory comes
+   from the page allocator one page, called a "slab", at a time.
+   Each slab starts with a header, followed by a stack of the
+   indexes of its free objects, followed by the objects
+   themselves.  Objects are packed at their own size (rounded up
+   to pointer alignment) instead of a power of 2, so a 68-byte
+   object does not occupy a 128-byte block as it would with
+   malloc().
+
+   Free objects are tracked by index rather than by a link stored
+   in the object, so an object keeps the state its constructor
+   gave it while it sits in the cache.
+
+   Slabs are kept on three lists: partially used, full, and
+   empty.  Allocation prefers a partial slab, then an empty one.
+   When a slab becomes empty it is kept around, up to
+   KMEM_EMPTY_SLABS of them per cache, so that a workload that
+   repeatedly allocates and frees one object does not bounce a
+   page in and out of the page allocator. */
+
+/* Number of empty slabs each cache holds on to. */
+#define KMEM_EMPTY_SLABS 2
+
+/* Magic number for detecting slab corruption. */
+#define SLAB_MAGIC 0x51ab51ab
+
+/* Object cache. */
+struct kmem_cache {
+  char name[16];            /* Name, for statistics. */
+  size_t obj_size;          /* Size requested by the creator. */
+  size_t slot_size;         /* OBJ_SIZE rounded up for alignment. */
+  size_t objs_per_slab;     /* Number of objects in a slab. */
+  size_t objs_ofs;          /* Offset of first object in a slab. */
+  kmem_ctor_func* ctor;     /* Constructor, or a null pointer. */
+  struct list_elem elem;    /* Element in all_caches. */
+  struct lock lock;         /* Protects all members below. */
+  struct list partial;      /* Slabs with some objects free. */
+  struct list full;         /* Slabs with no objects free. */
+  struct list empty;        /* Slabs with all objects free. */
+  size_t empty_cnt;         /* Number of slabs in EMPTY. */
+  size_t slab_cnt;          /* Total number of slabs. */
+  size_t inuse_cnt;         /* Number of allocated objects. */
+  uint64_t alloc_cnt;       /* # of kmem_cache_alloc() calls. */
+  uint64_t lock_cycles;     /* Total TSC cycles LOCK was held. */
+  uint64_t lock_max_cycles; /* Longest single hold of LOCK. */
+};
+
+/* Slab header, at the start of each slab's page. */
+struct slab {
+  unsigned magic;           /* Always set to SLAB_MAGIC. */
+  struct kmem_cache* cache; /* Owning cache. */
+  struct list_elem elem;    /* Element in one of the cache's lists. */
+  size_t free_cnt;          /* Number of free objects. */
+  uint16_t free_idx[];      /* Indexes of free objects, as a stack. */
+};
+
+/* All caches, for kmem_print_stats(). */
+static struct list all_caches;
+static struct lock all_caches_lock;
+
+static struct slab* slab_create(struct kmem_cache*);
+static struct slab* obj_to_slab(struct kmem_cache*, void* obj);
+static void* slab_obj(struct kmem_cache*, struct slab*, size_t idx);
+static void cache_lock(struct kmem_cache*, uint64_t* start);
+static void cache_unlock(struct kmem_cache*, uint64_t start);
+static uint64_t rdtsc(void);
+
+/* Initializes the object cache allocator. */
+void kmem_init(void) {
+  list_init(&all_caches);
+  lock_init(&all_caches_lock);
+}
+
+/* Creates and returns a cache of SIZE-byte objects named NAME.
+   CTOR, if non-null, is run on each object as the cache grows.
+   Panics if memory is not available, since caches are created
+   during initialization. */
+struct kmem_cache* kmem_cache_create(const char* name, size_t size, kmem_ctor_func* ctor) {
+  struct kmem_cache* c;
+  size_t n;
+
+  ASSERT(name != NULL);
+  ASSERT(size > 0);
+
+  c = malloc(sizeof *c);
+  if (c == NULL)
+    PANIC("kmem_cache_create: out of memory for cache \"%s\"", name);
+
+  strlcpy(c->name, name, sizeof c->name);
+  c->obj_size = size;
+  c->slot_size = ROUND_UP(size, sizeof(void*));
+  c->ctor = ctor;
+
+  /* Fit as many objects into a page as we can, counting a
+     two-byte free-stack entry for each one. */
+  n = (PGSIZE - sizeof(struct slab)) / (c->slot_size + sizeof(uint16_t));
+  while (n > 0 && ROUND_UP(sizeof(struct slab) + n * sizeof(uint16_t), sizeof(void*)) +
+                          n * c->slot_size >
+                      PGSIZE)
+    n--;
+  ASSERT(n > 0);
+  c->objs_per_slab = n;
+  c->objs_ofs = ROUND_UP(sizeof(struct slab) + n * sizeof(uint16_t), sizeof(void*));
+
+  lock_init(&c->lock);
+  list_init(&c->partial);
+  list_init(&c->full);
+  list_init(&c->empty);
+  c->empty_cnt = c->slab_cnt = c->inuse_cnt = 0;
+  c->alloc_cnt = 0;
+  c->lock_cycles = c->lock_max_cycles = 0;
+
+  lock_acquire(&all_caches_lock);
+  list_push_back(&all_caches, &c->elem);
+  lock_release(&all_caches_lock);
+
+  return c;
+}
+
+/* Allocates and returns an object from cache C.  Returns a null
+   pointer if memory is not available. */
+void* kmem_cache_alloc(struct kmem_cache* c) {
+  struct slab* s;
+  uint64_t start;
+  void* obj;
+
+  ASSERT(c != NULL);
+
+  cache_lock(c, &start);
+  if (list_empty(&c->partial)) {
+    if (!list_empty(&c->empty)) {
+      /* Reuse a spare empty slab. */
+      s = list_entry(list_pop_front(&c->empty), struct slab, elem);
+      c->empty_cnt--;
+    } else {
+      /* Grow the cache.  Allocating and constructing the new
+         slab's objects is done without the lock held, so that
+         other threads using this cache are not held up. */
+      cache_unlock(c, start);
+      s = slab_create(c);
+      if (s == NULL)
+        return NULL;
+      cache_lock(c, &start);
+      c->slab_cnt++;
+    }
+    list_push_front(&c->partial, &s->elem);
+  }
+
+  s = list_entry(list_front(&c->partial), struct slab, elem);
+  ASSERT(s->free_cnt > 0);
+  obj = slab_obj(c, s, s->free_idx[--s->free_cnt]);
+  if (s->free_cnt == 0) {
+    list_remove(&s->elem);
+    list_push_back(&c->full, &s->elem);
+  }
+  c->inuse_cnt++;
+  c->alloc_cnt++;
+  cache_unlock(c, start);
+
+  return obj;
+}
+
+/* Returns OBJ, which must have been allocated from cache C and
+   must be in its constructed state, to C. */
+void kmem_cache_free(struct kmem_cache* c, void* obj) {
+  struct slab* s;
+  struct slab* release = NULL;
+  uint64_t start;
+
+  if (obj == NULL)
+    return;
+
+  s = obj_to_slab(c, obj);
+
+  cache_lock(c, &start);
+  if (s->free_cnt == 0) {
+    list_remove(&s->elem);
+    list_push_front(&c->partial, &s->elem);
+  }
+  s->free_idx[s->free_cnt++] = ((uint8_t*)obj - (uint8_t*)s - c->objs_ofs) / c->slot_size;
+  c->inuse_cnt--;
+
+  if (s->free_cnt == c->objs_per_slab) {
+    list_remove(&s->elem);
+    if (c->empty_cnt < KMEM_EMPTY_SLABS) {
+      list_push_front(&c->empty, &s->elem);
+      c->empty_cnt++;
+    } else {
+      c->slab_cnt--;
+      release = s;
+    }
+  }
+  cache_unlock(c, start);
+
+  if (release != NULL)
+    palloc_free_page(release);
+}
+
+/* Destroys cache C, which must have no objects allocated. */
+void kmem_cache_destroy(struct kmem_cache* c) {
+  if (c == NULL)
+    return;
+
+  ASSERT(c->inuse_cnt == 0);
+  ASSERT(list_empty(&c->partial) && list_empty(&c->full));
+
+  lock_acquire(&all_caches_lock);
+  list_remove(&c->elem);
+  lock_release(&all_caches_lock);
+
+  while (!list_empty(&c->empty))
+    palloc_free_page(list_entry(list_pop_front(&c->empty), struct slab, elem));
+  free(c);
+}
+
+/* Prints statistics for every cache: objects in use, slabs, the
+   bytes of slab memory not holding a live object (internal
+   fragmentation plus free objects), and how long the cache lock
+   was held per allocation, in TSC cycles.
+   Takes no locks, since it runs on the panic path, where the
+   locks may be held or unavailable; the counts may be slightly
+   stale. */
+void kmem_print_stats(void) {
+  struct list_elem* e;
+
+  for (e = list_begin(&all_caches); e != list_end(&all_caches); e = list_next(e)) {
+    struct kmem_cache* c = list_entry(e, struct kmem_cache, elem);
+    size_t slab_bytes = c->slab_cnt * PGSIZE;
+    size_t wasted = slab_bytes - c->inuse_cnt * c->obj_size;
+
+    printf("Slab %s: %zu objects in %zu slabs, %zu of %zu bytes unused, "
+           "lock held %llu cycles/alloc (max %llu)\n",
+           c->name, c->inuse_cnt, c->slab_cnt, wasted, slab_bytes,
+           c->alloc_cnt > 0 ? c->lock_cycles / c->alloc_cnt : 0, c->lock_max_cycles);
+  }
+}
+
+/* Allocates a new slab for C and runs C's constructor on each of
+   its objects.  Returns a null pointer if no page is available. */
+static struct slab* slab_create(struct kmem_cache* c) {
+  struct slab* s = palloc_get_page(0);
+  size_t i;
+
+  if (s == NULL)
+    return NULL;
+
+  s->magic = SLAB_MAGIC;
+  s->cache = c;
+  s->free_cnt = c->objs_per_slab;
+  for (i = 0; i < c->objs_per_slab; i++) {
+    s->free_idx[i] = c->objs_per_slab - i - 1;
+    if (c->ctor != NULL)
+      c->ctor(slab_obj(c, s, i));
+  }
+  return s;
+}
+
+/* Returns the slab that OBJ, an object from cache C, is in. */
+static struct slab* obj_to_slab(struct kmem_cache* c, void* obj) {
+  struct slab* s = pg_round_down(obj);
+
+  /* Check that the slab is valid and the object is properly
+     aligned within it. */
+  ASSERT(s->magic == SLAB_MAGIC);
+  ASSERT(s->cache == c);
+  ASSERT(pg_ofs(obj) >= c->objs_ofs);
+  ASSERT((pg_ofs(obj) - c->objs_ofs) % c->slot_size == 0);
+
+  return s;
+}
+
+/* Returns the IDX'th object in slab S of cache C. */
+static void* slab_obj(struct kmem_cache* c, struct slab* s, size_t idx) {
+  ASSERT(idx < c->objs_per_slab);
+  return (uint8_t*)s + c->objs_ofs + idx * c->slot_size;
+}
+
+/* Acquires C's lock and stores the time it was acquired in
+   *START. */
+static void cache_lock(struct kmem_cache* c, uint64_t* start) {
+  lock_acquire(&c->lock);
+  *start = rdtsc();
+}
+
+/* Releases C's lock, which was acquired at time START, and
+   accounts for how long it was held. */
+static void cache_unlock(struct kmem_cache* c, uint64_t start) {
+  uint64_t held = rdtsc() - start;
+
+  c->lock_cycles += held;
+  if (held > c->lock_max_cycles)
+    c->lock_max_cycles = held;
+  lock_release(&c->lock);
+}
+
+/* Returns the CPU's time-stamp counter. */
+static uint64_t rdtsc(void) {
+  /* See [IA32-v2b] "RDTSC". */
+  uint64_t tsc;
+  asm volatile("rdtsc" : "=A"(tsc));
+  return tsc;
+}
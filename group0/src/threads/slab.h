@@ -0,0 +1,24 @@
+#ifndef THREADS_SLAB_H
+#define THREADS_SLAB_H
+
+#include <stddef.h>
+
+/* Object caches for frequently allocated fixed-size objects.
+   See slab.c for details. */
+
+/* Constructor for objects in a cache.  Called once on each
+   object when the page holding it is added to the cache, not on
+   every allocation, so objects must be freed back to the cache
+   in their constructed state. */
+typedef void kmem_ctor_func(void* obj);
+
+struct kmem_cache;
+
+void kmem_init(void);
+struct kmem_cache* kmem_cache_create(const char* name, size_t size, kmem_ctor_func*);
+void* kmem_cache_alloc(struct kmem_cache*);
+void kmem_cache_free(struct kmem_cache*, void*);
+void kmem_cache_destroy(struct kmem_cache*);
+void kmem_print_stats(void);
+
+#endif /* threads/slab.h */
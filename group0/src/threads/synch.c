@@ -32,6 +32,10 @@
 #include "threads/interrupt.h"
 #include "threads/thread.h"
 
+static void waiter_insert(struct list* waiters, struct thread* t);
+static bool waiter_priority_less(const struct list_elem* a, const struct list_elem* b,
+                                 void* aux UNUSED);
+
 /* Initializes semaphore SEMA to VALUE.  A semaphore is a
    nonnegative integer along with two atomic operators for
    manipulating it:
@@ -40,7 +44,11 @@
      decrement it.
 
    - up or "V": increment the value (and wake up one waiting
-     thread, if any). */
+     thread, if any).
+
+   Under the strict-priority scheduler, the wait list is kept in
+   descending order of priority, so "up" always wakes the
+   highest-priority waiter. */
 void sema_init(struct semaphore* sema, unsigned value) {
   ASSERT(sema != NULL);
 
@@ -63,7 +71,8 @@ void sema_down(struct semaphore* sema) {
 
   old_level = intr_disable();
   while (sema->value == 0) {
-    list_push_back(&sema->waiters, &thread_current()->elem);
+    thread_current()->waiting_sema = sema;
+    waiter_insert(&sema->waiters, thread_current());
     thread_block();
   }
   sema->value--;
@@ -102,10 +111,46 @@ void sema_up(struct semaphore* sema) {
   ASSERT(sema != NULL);
 
   old_level = intr_disable();
-  if (!list_empty(&sema->waiters))
-    thread_unblock(list_entry(list_pop_front(&sema->waiters), struct thread, elem));
+  if (!list_empty(&sema->waiters)) {
+    struct thread* t = list_entry(list_pop_front(&sema->waiters), struct thread, elem);
+    t->waiting_sema = NULL;
+    thread_unblock(t);
+  }
   sema->value++;
   intr_set_level(old_level);
+
+  /* The thread we woke may outrank us. */
+  thread_preempt();
+}
+
+/* Moves T, which must be blocked on SEMA, to the position in
+   SEMA's wait list that matches its current priority.  Called by
+   the thread module when a blocked thread's priority changes.
+
+   This function must be called with interrupts turned off. */
+void sema_reorder_waiter(struct semaphore* sema, struct thread* t) {
+  ASSERT(intr_get_level() == INTR_OFF);
+  ASSERT(t->waiting_sema == sema);
+
+  list_remove(&t->elem);
+  waiter_insert(&sema->waiters, t);
+}
+
+/* Adds T to the semaphore wait list WAITERS.  The list is FIFO,
+   except under the strict-priority scheduler, where it is kept
+   in descending priority order with ties left in FIFO order. */
+static void waiter_insert(struct list* waiters, struct thread* t) {
+  if (active_sched_policy == SCHED_PRIO)
+    list_insert_ordered(waiters, &t->elem, waiter_priority_less, NULL);
+  else
+    list_push_back(waiters, &t->elem);
+}
+
+/* Orders wait-list threads so that higher priorities come first. */
+static bool waiter_priority_less(const struct list_elem* a, const struct list_elem* b,
+                                 void* aux UNUSED) {
+  return list_entry(a, struct thread, elem)->priority >
+         list_entry(b, struct thread, elem)->priority;
 }
 
 static void sema_test_helper(void* sema_);
@@ -165,17 +210,42 @@ void lock_init(struct lock* lock) {
    necessary.  The lock must not already be held by the current
    thread.
 
+   Under the strict-priority scheduler, a thread that must wait
+   donates its priority to the holder, and on through the chain
+   of locks that the holder is itself waiting for, stopping after
+   LOCK_DONATION_DEPTH holders.
+
    This function may sleep, so it must not be called within an
    interrupt handler.  This function may be called with
    interrupts disabled, but interrupts will be turned back on if
    we need to sleep. */
 void lock_acquire(struct lock* lock) {
+  struct thread* cur = thread_current();
+  enum intr_level old_level;
+
   ASSERT(lock != NULL);
   ASSERT(!intr_context());
   ASSERT(!lock_held_by_current_thread(lock));
 
+  old_level = intr_disable();
+  if (lock->holder != NULL && active_sched_policy == SCHED_PRIO) {
+    struct lock* l = lock;
+    int depth;
+
+    cur->waiting_lock = lock;
+    for (depth = 0; l != NULL && l->holder != NULL && depth < LOCK_DONATION_DEPTH; depth++) {
+      if (l->holder->priority >= cur->priority)
+        break;
+      thread_donate_priority(l->holder, cur->priority);
+      l = l->holder->waiting_lock;
+    }
+  }
+
   sema_down(&lock->semaphore);
-  lock->holder = thread_current();
+  cur->waiting_lock = NULL;
+  lock->holder = cur;
+  list_push_back(&cur->held_locks, &lock->elem);
+  intr_set_level(old_level);
 }
 
 /* Tries to acquires LOCK and returns true if successful or false
@@ -185,27 +255,40 @@ void lock_acquire(struct lock* lock) {
    This function will not sleep, so it may be called within an
    interrupt handler. */
 bool lock_try_acquire(struct lock* lock) {
+  enum intr_level old_level;
   bool success;
 
   ASSERT(lock != NULL);
   ASSERT(!lock_held_by_current_thread(lock));
 
+  old_level = intr_disable();
   success = sema_try_down(&lock->semaphore);
-  if (success)
+  if (success) {
     lock->holder = thread_current();
+    list_push_back(&thread_current()->held_locks, &lock->elem);
+  }
+  intr_set_level(old_level);
   return success;
 }
 
 /* Releases LOCK, which must be owned by the current thread.
+   Gives up any priority that was donated through LOCK.
 
    An interrupt handler cannot acquire a lock, so it does not
    make sense to try to release a lock within an interrupt
    handler. */
 void lock_release(struct lock* lock) {
+  enum intr_level old_level;
+
   ASSERT(lock != NULL);
   ASSERT(lock_held_by_current_thread(lock));
 
+  old_level = intr_disable();
   lock->holder = NULL;
+  list_remove(&lock->elem);
+  thread_refresh_priority(thread_current());
+  intr_set_level(old_level);
+
   sema_up(&lock->semaphore);
 }
 
@@ -280,8 +363,12 @@ void rw_lock_release(struct rw_lock* rw_lock, bool reader) {
 struct semaphore_elem {
   struct list_elem elem;      /* List element. */
   struct semaphore semaphore; /* This semaphore. */
+  struct thread* thread;      /* Thread waiting on the semaphore. */
 };
 
+static bool cond_waiter_priority_less(const struct list_elem* a, const struct list_elem* b,
+                                      void* aux UNUSED);
+
 /* Initializes condition variable COND.  A condition variable
    allows one piece of code to signal a condition and cooperating
    code to receive the signal and act upon it. */
@@ -320,6 +407,7 @@ void cond_wait(struct condition* cond, struct lock* lock) {
   ASSERT(lock_held_by_current_thread(lock));
 
   sema_init(&waiter.semaphore, 0);
+  waiter.thread = thread_current();
   list_push_back(&cond->waiters, &waiter.elem);
   lock_release(lock);
   sema_down(&waiter.semaphore);
@@ -328,7 +416,9 @@ void cond_wait(struct condition* cond, struct lock* lock) {
 
 /* If any threads are waiting on COND (protected by LOCK), then
    this function signals one of them to wake up from its wait.
-   LOCK must be held before calling this function.
+   Under the strict-priority scheduler, the highest-priority
+   waiter is chosen.  LOCK must be held before calling this
+   function.
 
    An interrupt handler cannot acquire a lock, so it does not
    make sense to try to signal a condition variable within an
@@ -339,8 +429,24 @@ void cond_signal(struct condition* cond, struct lock* lock UNUSED) {
   ASSERT(!intr_context());
   ASSERT(lock_held_by_current_thread(lock));
 
-  if (!list_empty(&cond->waiters))
-    sema_up(&list_entry(list_pop_front(&cond->waiters), struct semaphore_elem, elem)->semaphore);
+  if (!list_empty(&cond->waiters)) {
+    struct list_elem* e;
+
+    if (active_sched_policy == SCHED_PRIO) {
+      e = list_max(&cond->waiters, cond_waiter_priority_less, NULL);
+      list_remove(e);
+    } else
+      e = list_pop_front(&cond->waiters);
+    sema_up(&list_entry(e, struct semaphore_elem, elem)->semaphore);
+  }
+}
+
+/* Orders condition variable waiters by the priority of the
+   thread waiting on each. */
+static bool cond_waiter_priority_less(const struct list_elem* a, const struct list_elem* b,
+                                      void* aux UNUSED) {
+  return list_entry(a, struct semaphore_elem, elem)->thread->priority <
+         list_entry(b, struct semaphore_elem, elem)->thread->priority;
 }
 
 /* Wakes up all threads, if any, waiting on COND (protected by
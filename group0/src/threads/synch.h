@@ -4,6 +4,8 @@
 #include <list.h>
 #include <stdbool.h>
 
+struct thread;
+
 /* A counting semaphore. */
 struct semaphore {
   unsigned value;      /* Current value. */
@@ -14,12 +16,19 @@ void sema_init(struct semaphore*, unsigned value);
 void sema_down(struct semaphore*);
 bool sema_try_down(struct semaphore*);
 void sema_up(struct semaphore*);
+void sema_reorder_waiter(struct semaphore*, struct thread*);
 void sema_self_test(void);
 
+/* Maximum number of lock holders that lock_acquire() will walk
+   through when donating priority along a chain of nested locks.
+   Bounds the time lock_acquire() spends with interrupts off. */
+#define LOCK_DONATION_DEPTH 8
+
 /* Lock. */
 struct lock {
   struct thread* holder;      /* Thread holding lock (for debugging). */
   struct semaphore semaphore; /* Binary semaphore controlling access. */
+  struct list_elem elem;      /* Element in holder's `held_locks' list. */
 };
 
 void lock_init(struct lock*);
@@ -11,6 +11,7 @@
 #include "threads/switch.h"
 #include "threads/synch.h"
 #include "threads/vaddr.h"
+#include "devices/timer.h"
 #ifdef USERPROG
 #include "userprog/process.h"
 #endif
@@ -24,6 +25,37 @@
    that are ready to run but not actually running. */
 static struct list fifo_ready_list;
 
+/* Run queue for the strict-priority scheduler: one FIFO list per
+   priority level, plus a bitmap in which bit P is set if and only
+   if prio_ready_lists[P] is nonempty.  Enqueueing a thread and
+   finding the highest-priority ready thread both take constant
+   time, no matter how many threads are ready. */
+static struct list prio_ready_lists[PRI_MAX + 1];
+static uint64_t prio_ready_mask;
+static int prio_ready_count; /* # of threads in prio_ready_lists. */
+
+/* MLFQS state.  The MLFQS shares the strict-priority run queue;
+   only the way priorities are assigned differs. */
+#define MLFQS_PRIORITY_PERIOD 4 /* # of ticks between priority updates. */
+static fixed_point_t load_avg;  /* System load average. */
+
+/* Ready heap for the fair scheduler, which implements stride
+   scheduling.  Each thread advances its pass value by a stride
+   inversely proportional to its tickets for every tick it runs,
+   and the ready thread with the lowest pass runs next.  The heap
+   is a leftist min-heap linked through the threads themselves,
+   so insertion and removal of the minimum both take O(log n)
+   time and need no storage beyond struct thread. */
+#define STRIDE1 (1 << 20)        /* Stride of a thread holding one ticket. */
+static struct thread* fair_heap; /* Root of the heap, or a null pointer. */
+static int64_t fair_vtime;       /* Pass of the last thread dispatched. */
+
+/* Threads whose recent_cpu has changed since their priority was
+   last computed.  Between the once-per-second decays only the
+   running thread's recent_cpu changes, so this list stays short
+   and the periodic priority update need not visit every thread. */
+static struct list mlfqs_stale_list;
+
 /* List of all processes.  Processes are added to this list
    when they are first scheduled and removed when they exit. */
 static struct list all_list;
@@ -54,10 +86,24 @@ static long long user_ticks;   /* # of timer ticks in user programs. */
 static unsigned thread_ticks; /* # of timer ticks since last yield. */
 
 static void init_thread(struct thread*, const char* name, int priority);
+static void thread_apply_priority(struct thread* t, int priority);
 static bool is_thread(struct thread*) UNUSED;
 static void* alloc_frame(struct thread*, size_t size);
 static void schedule(void);
 static void thread_enqueue(struct thread* t);
+static void prio_ready_push(struct thread* t);
+static void prio_ready_remove(struct thread* t);
+static struct thread* prio_ready_pop(void);
+static int prio_ready_max(void);
+static bool prio_queue_active(void);
+static void fair_heap_push(struct thread* t);
+static struct thread* fair_heap_pop(void);
+static struct thread* fair_heap_merge(struct thread* a, struct thread* b);
+static int fair_heap_rank(struct thread* t);
+static void mlfqs_tick(struct thread* cur);
+static void mlfqs_mark_stale(struct thread* t);
+static void mlfqs_update_priority(struct thread* t);
+static void mlfqs_decay(struct thread* t, void* aux UNUSED);
 static tid_t allocate_tid(void);
 void thread_switch_tail(struct thread* prev);
 
@@ -108,6 +154,10 @@ void thread_init(void) {
 
   lock_init(&tid_lock);
   list_init(&fifo_ready_list);
+  for (int i = PRI_MIN; i <= PRI_MAX; i++)
+    list_init(&prio_ready_lists[i]);
+  prio_ready_mask = 0;
+  list_init(&mlfqs_stale_list);
   list_init(&all_list);
 
   /* Set up a thread structure for the running thread. */
@@ -147,6 +197,11 @@ void thread_tick(void) {
   else
     kernel_ticks++;
 
+  if (active_sched_policy == SCHED_MLFQS)
+    mlfqs_tick(t);
+  else if (active_sched_policy == SCHED_FAIR && t != idle_thread)
+    t->pass += STRIDE1 / PRI_TICKETS(t->priority);
+
   /* Enforce preemption. */
   if (++thread_ticks >= TIME_SLICE)
     intr_yield_on_return();
@@ -170,9 +225,8 @@ void thread_print_stats(void) {
    scheduled.  Use a semaphore or some other form of
    synchronization if you need to ensure ordering.
 
-   The code provided sets the new thread's `priority' member to
-   PRIORITY, but no actual priority scheduling is implemented.
-   Priority scheduling is the goal of Problem 1-3. */
+   Under the strict-priority scheduler, the running thread yields
+   immediately if the new thread has a higher priority. */
 tid_t thread_create(const char* name, int priority, thread_func* function, void* aux) {
   struct thread* t;
   struct kernel_thread_frame* kf;
@@ -191,6 +245,25 @@ tid_t thread_create(const char* name, int priority, thread_func* function, void*
   init_thread(t, name, priority);
   tid = t->tid = allocate_tid();
 
+  /* Under the MLFQS, the new thread inherits its creator's
+     niceness and recent_cpu, and its priority follows from them. */
+  if (active_sched_policy == SCHED_MLFQS) {
+    t->nice = thread_current()->nice;
+    t->recent_cpu = thread_current()->recent_cpu;
+    mlfqs_update_priority(t);
+  }
+
+  /* Under the fair scheduler, the new thread joins one stride
+     past the current virtual time, as if it had just run a tick.
+     Starting at the virtual time itself would let every new
+     thread run a full slice ahead of the threads already
+     competing, whatever its tickets. */
+  if (active_sched_policy == SCHED_FAIR) {
+    enum intr_level old_level = intr_disable();
+    t->pass = fair_vtime + STRIDE1 / PRI_TICKETS(t->priority);
+    intr_set_level(old_level);
+  }
+
   /* Stack frame for kernel_thread(). */
   kf = alloc_frame(t, sizeof *kf);
   kf->eip = NULL;
@@ -208,6 +281,7 @@ tid_t thread_create(const char* name, int priority, thread_func* function, void*
 
   /* Add to run queue. */
   thread_unblock(t);
+  thread_preempt();
 
   return tid;
 }
@@ -236,6 +310,10 @@ static void thread_enqueue(struct thread* t) {
 
   if (active_sched_policy == SCHED_FIFO)
     list_push_back(&fifo_ready_list, &t->elem);
+  else if (prio_queue_active())
+    prio_ready_push(t);
+  else if (active_sched_policy == SCHED_FAIR)
+    fair_heap_push(t);
   else
     PANIC("Unimplemented scheduling policy value: %d", active_sched_policy);
 }
@@ -293,6 +371,8 @@ void thread_exit(void) {
      when it calls thread_switch_tail(). */
   intr_disable();
   list_remove(&thread_current()->allelem);
+  if (thread_current()->mlfqs_stale)
+    list_remove(&thread_current()->stale_elem);
   thread_current()->status = THREAD_DYING;
   schedule();
   NOT_REACHED();
@@ -314,6 +394,27 @@ void thread_yield(void) {
   intr_set_level(old_level);
 }
 
+/* Yields the CPU if the scheduling policy says that some ready
+   thread should run in preference to the running thread.  In an
+   interrupt context, arranges for the yield to happen when the
+   interrupt returns instead. */
+void thread_preempt(void) {
+  enum intr_level old_level;
+  bool should_yield = false;
+
+  old_level = intr_disable();
+  if (prio_queue_active())
+    should_yield = prio_ready_max() > thread_current()->priority;
+  intr_set_level(old_level);
+
+  if (!should_yield)
+    return;
+  if (intr_context())
+    intr_yield_on_return();
+  else
+    thread_yield();
+}
+
 /* Invoke function 'func' on all threads, passing along 'aux'.
    This function must be called with interrupts off. */
 void thread_foreach(thread_action_func* func, void* aux) {
@@ -327,32 +428,207 @@ void thread_foreach(thread_action_func* func, void* aux) {
   }
 }
 
-/* Sets the current thread's priority to NEW_PRIORITY. */
-void thread_set_priority(int new_priority) { thread_current()->priority = new_priority; }
+/* Sets the current thread's base priority to NEW_PRIORITY.  Any
+   priority donated to the thread still applies on top of it.
+   Yields if the running thread no longer has the highest
+   priority.  Ignored under the MLFQS, which computes priorities
+   itself. */
+void thread_set_priority(int new_priority) {
+  struct thread* cur = thread_current();
+  enum intr_level old_level;
+
+  ASSERT(PRI_MIN <= new_priority && new_priority <= PRI_MAX);
+
+  if (active_sched_policy == SCHED_MLFQS)
+    return;
+
+  old_level = intr_disable();
+  cur->base_priority = new_priority;
+  thread_refresh_priority(cur);
+  intr_set_level(old_level);
+
+  thread_preempt();
+}
+
+/* Raises T's effective priority to PRIORITY, if that is higher
+   than its current effective priority.  Used by lock_acquire()
+   to donate priority to a lock holder.
+
+   This function must be called with interrupts turned off. */
+void thread_donate_priority(struct thread* t, int priority) {
+  ASSERT(intr_get_level() == INTR_OFF);
+  ASSERT(is_thread(t));
+
+  if (priority > t->priority)
+    thread_apply_priority(t, priority);
+}
+
+/* Recomputes T's effective priority as the maximum of its base
+   priority and the priority of the highest-priority waiter on
+   each lock it holds.  Lock wait lists are kept sorted by
+   priority, so this costs one step per held lock rather than
+   one per waiter.
+
+   This function must be called with interrupts turned off. */
+void thread_refresh_priority(struct thread* t) {
+  struct list_elem* e;
+  int priority;
+
+  ASSERT(intr_get_level() == INTR_OFF);
+  ASSERT(is_thread(t));
+
+  priority = t->base_priority;
+  if (active_sched_policy != SCHED_PRIO) {
+    thread_apply_priority(t, priority);
+    return;
+  }
+
+  for (e = list_begin(&t->held_locks); e != list_end(&t->held_locks); e = list_next(e)) {
+    struct lock* lock = list_entry(e, struct lock, elem);
+    struct list* waiters = &lock->semaphore.waiters;
+
+    if (!list_empty(waiters)) {
+      struct thread* top = list_entry(list_front(waiters), struct thread, elem);
+      if (top->priority > priority)
+        priority = top->priority;
+    }
+  }
+  thread_apply_priority(t, priority);
+}
+
+/* Sets T's effective priority to PRIORITY, moving T within
+   whichever priority-ordered queue it currently sits on: the
+   ready queue if it is ready, or a semaphore's wait list if it
+   is blocked on one. */
+static void thread_apply_priority(struct thread* t, int priority) {
+  ASSERT(PRI_MIN <= priority && priority <= PRI_MAX);
+
+  if (t->priority == priority)
+    return;
+
+  if (t->status == THREAD_READY && prio_queue_active()) {
+    prio_ready_remove(t);
+    t->priority = priority;
+    prio_ready_push(t);
+  } else if (t->status == THREAD_BLOCKED && t->waiting_sema != NULL &&
+             active_sched_policy == SCHED_PRIO) {
+    t->priority = priority;
+    sema_reorder_waiter(t->waiting_sema, t);
+  } else
+    t->priority = priority;
+}
 
 /* Returns the current thread's priority. */
 int thread_get_priority(void) { return thread_current()->priority; }
 
-/* Sets the current thread's nice value to NICE. */
-void thread_set_nice(int nice UNUSED) { /* Not yet implemented. */
+/* Sets the current thread's nice value to NICE and recomputes
+   its priority, yielding if it no longer has the highest
+   priority. */
+void thread_set_nice(int nice) {
+  struct thread* cur = thread_current();
+  enum intr_level old_level;
+
+  ASSERT(NICE_MIN <= nice && nice <= NICE_MAX);
+
+  old_level = intr_disable();
+  cur->nice = nice;
+  if (active_sched_policy == SCHED_MLFQS)
+    mlfqs_update_priority(cur);
+  intr_set_level(old_level);
+
+  thread_preempt();
 }
 
 /* Returns the current thread's nice value. */
-int thread_get_nice(void) {
-  /* Not yet implemented. */
-  return 0;
-}
+int thread_get_nice(void) { return thread_current()->nice; }
 
 /* Returns 100 times the system load average. */
 int thread_get_load_avg(void) {
-  /* Not yet implemented. */
-  return 0;
+  enum intr_level old_level = intr_disable();
+  int load = fix_round(fix_scale(load_avg, 100));
+  intr_set_level(old_level);
+  return load;
 }
 
 /* Returns 100 times the current thread's recent_cpu value. */
 int thread_get_recent_cpu(void) {
-  /* Not yet implemented. */
-  return 0;
+  enum intr_level old_level = intr_disable();
+  int recent_cpu = fix_round(fix_scale(thread_current()->recent_cpu, 100));
+  intr_set_level(old_level);
+  return recent_cpu;
+}
+
+/* MLFQS work for one timer tick, with CUR the running thread.
+   Charges the tick to CUR.  Once per second, updates the load
+   average and decays every thread's recent_cpu, which changes
+   every priority.  Otherwise, every MLFQS_PRIORITY_PERIOD ticks,
+   recomputes the priority of only those threads whose recent_cpu
+   has changed since their priority was last computed. */
+static void mlfqs_tick(struct thread* cur) {
+  int64_t now = timer_ticks();
+
+  if (cur != idle_thread) {
+    cur->recent_cpu = fix_add(cur->recent_cpu, fix_int(1));
+    mlfqs_mark_stale(cur);
+  }
+
+  if (now % TIMER_FREQ == 0) {
+    int ready_threads = prio_ready_count + (cur != idle_thread);
+
+    load_avg = fix_add(fix_mul(fix_frac(59, 60), load_avg), fix_frac(ready_threads, 60));
+    thread_foreach(mlfqs_decay, NULL);
+    list_init(&mlfqs_stale_list);
+  } else if (now % MLFQS_PRIORITY_PERIOD == 0) {
+    while (!list_empty(&mlfqs_stale_list)) {
+      struct thread* t = list_entry(list_pop_front(&mlfqs_stale_list), struct thread, stale_elem);
+      t->mlfqs_stale = false;
+      mlfqs_update_priority(t);
+    }
+  }
+
+  if (prio_ready_max() > cur->priority)
+    intr_yield_on_return();
+}
+
+/* Queues T for a priority update at the next MLFQS period. */
+static void mlfqs_mark_stale(struct thread* t) {
+  if (!t->mlfqs_stale) {
+    t->mlfqs_stale = true;
+    list_push_back(&mlfqs_stale_list, &t->stale_elem);
+  }
+}
+
+/* Sets T's priority from its recent_cpu and niceness, as
+   PRI_MAX - (recent_cpu / 4) - (nice * 2), clamped to the valid
+   range.  The idle thread always keeps PRI_MIN. */
+static void mlfqs_update_priority(struct thread* t) {
+  int priority;
+
+  if (t == idle_thread)
+    return;
+
+  priority = PRI_MAX - fix_trunc(fix_unscale(t->recent_cpu, 4)) - t->nice * 2;
+  if (priority < PRI_MIN)
+    priority = PRI_MIN;
+  else if (priority > PRI_MAX)
+    priority = PRI_MAX;
+
+  t->base_priority = priority;
+  thread_apply_priority(t, priority);
+}
+
+/* Once-per-second decay of T's recent_cpu, followed by the
+   priority update that it implies.  Used with thread_foreach(). */
+static void mlfqs_decay(struct thread* t, void* aux UNUSED) {
+  fixed_point_t twice_load = fix_scale(load_avg, 2);
+  fixed_point_t coeff = fix_div(twice_load, fix_add(twice_load, fix_int(1)));
+
+  if (t == idle_thread)
+    return;
+
+  t->recent_cpu = fix_add(fix_mul(coeff, t->recent_cpu), fix_int(t->nice));
+  t->mlfqs_stale = false;
+  mlfqs_update_priority(t);
 }
 
 /* Idle thread.  Executes when no other thread is ready to run.
@@ -427,7 +703,10 @@ static void init_thread(struct thread* t, const char* name, int priority) {
   t->status = THREAD_BLOCKED;
   strlcpy(t->name, name, sizeof t->name);
   t->stack = (uint8_t*)t + PGSIZE;
-  t->priority = priority;
+  t->priority = t->base_priority = priority;
+  list_init(&t->held_locks);
+  t->nice = NICE_DEFAULT;
+  t->recent_cpu = fix_int(0);
   t->pcb = NULL;
   t->magic = THREAD_MAGIC;
 
@@ -455,19 +734,138 @@ static struct thread* thread_schedule_fifo(void) {
     return idle_thread;
 }
 
+/* Appends T to the run queue for its priority level. */
+static void prio_ready_push(struct thread* t) {
+  ASSERT(PRI_MIN <= t->priority && t->priority <= PRI_MAX);
+
+  list_push_back(&prio_ready_lists[t->priority], &t->elem);
+  prio_ready_mask |= (uint64_t)1 << t->priority;
+  prio_ready_count++;
+}
+
+/* Removes ready thread T from the run queue for its priority
+   level. */
+static void prio_ready_remove(struct thread* t) {
+  list_remove(&t->elem);
+  if (list_empty(&prio_ready_lists[t->priority]))
+    prio_ready_mask &= ~((uint64_t)1 << t->priority);
+  prio_ready_count--;
+}
+
+/* Removes and returns the thread at the front of the highest
+   nonempty priority level, or returns a null pointer if no
+   thread is ready. */
+static struct thread* prio_ready_pop(void) {
+  int pri = prio_ready_max();
+  struct list* queue;
+  struct thread* t;
+
+  if (pri < 0)
+    return NULL;
+
+  queue = &prio_ready_lists[pri];
+  t = list_entry(list_pop_front(queue), struct thread, elem);
+  if (list_empty(queue))
+    prio_ready_mask &= ~((uint64_t)1 << pri);
+  prio_ready_count--;
+  return t;
+}
+
+/* Returns the highest priority that has a ready thread, or -1 if
+   no thread is ready.  The mask is split into 32-bit halves so
+   that GCC emits a BSR instruction rather than calling into
+   libgcc, which the kernel does not link against. */
+static int prio_ready_max(void) {
+  uint32_t hi = prio_ready_mask >> 32;
+  uint32_t lo = prio_ready_mask;
+
+  if (hi != 0)
+    return 63 - __builtin_clz(hi);
+  else if (lo != 0)
+    return 31 - __builtin_clz(lo);
+  else
+    return -1;
+}
+
+/* Returns true if the active scheduling policy keeps ready
+   threads in the per-priority run queue. */
+static bool prio_queue_active(void) {
+  return active_sched_policy == SCHED_PRIO || active_sched_policy == SCHED_MLFQS;
+}
+
 /* Strict priority scheduler */
 static struct thread* thread_schedule_prio(void) {
-  PANIC("Unimplemented scheduler policy: \"-sched=prio\"");
+  struct thread* t = prio_ready_pop();
+  return t != NULL ? t : idle_thread;
 }
 
+/* Adds T to the fair scheduler's ready heap.  A thread that has
+   been blocked for a while would otherwise return with a pass far
+   behind everyone else's and monopolize the CPU until it caught
+   up, so its pass is first advanced to the current virtual time. */
+static void fair_heap_push(struct thread* t) {
+  if (t->pass < fair_vtime)
+    t->pass = fair_vtime;
+  t->heap_left = t->heap_right = NULL;
+  t->heap_rank = 1;
+  fair_heap = fair_heap_merge(fair_heap, t);
+}
+
+/* Removes and returns the ready thread with the lowest pass, or
+   returns a null pointer if no thread is ready. */
+static struct thread* fair_heap_pop(void) {
+  struct thread* t = fair_heap;
+
+  if (t == NULL)
+    return NULL;
+
+  fair_heap = fair_heap_merge(t->heap_left, t->heap_right);
+  fair_vtime = t->pass;
+  return t;
+}
+
+/* Merges the leftist heaps rooted at A and B and returns the root
+   of the result.  Recurses only down right spines, whose length
+   is logarithmic in the size of the heap. */
+static struct thread* fair_heap_merge(struct thread* a, struct thread* b) {
+  struct thread* tmp;
+
+  if (a == NULL)
+    return b;
+  if (b == NULL)
+    return a;
+
+  if (b->pass < a->pass) {
+    tmp = a;
+    a = b;
+    b = tmp;
+  }
+
+  a->heap_right = fair_heap_merge(a->heap_right, b);
+  if (fair_heap_rank(a->heap_left) < fair_heap_rank(a->heap_right)) {
+    tmp = a->heap_left;
+    a->heap_left = a->heap_right;
+    a->heap_right = tmp;
+  }
+  a->heap_rank = fair_heap_rank(a->heap_right) + 1;
+  return a;
+}
+
+/* Returns the rank of the heap rooted at T. */
+static int fair_heap_rank(struct thread* t) { return t != NULL ? t->heap_rank : 0; }
+
 /* Fair priority scheduler */
 static struct thread* thread_schedule_fair(void) {
-  PANIC("Unimplemented scheduler policy: \"-sched=fair\"");
+  struct thread* t = fair_heap_pop();
+  return t != NULL ? t : idle_thread;
 }
 
-/* Multi-level feedback queue scheduler */
+/* Multi-level feedback queue scheduler.  Picks from the same run
+   queue as the strict priority scheduler; mlfqs_tick() is what
+   makes priorities change over time. */
 static struct thread* thread_schedule_mlfqs(void) {
-  PANIC("Unimplemented scheduler policy: \"-sched=mlfqs\"");
+  struct thread* t = prio_ready_pop();
+  return t != NULL ? t : idle_thread;
 }
 
 /* Not an actual scheduling policy — placeholder for empty
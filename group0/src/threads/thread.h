@@ -25,6 +25,16 @@ typedef int tid_t;
 #define PRI_DEFAULT 31 /* Default priority. */
 #define PRI_MAX 63     /* Highest priority. */
 
+/* Number of lottery tickets a thread of priority PRI holds under
+   the fair scheduler.  Every thread holds at least one ticket, so
+   even PRI_MIN threads make progress. */
+#define PRI_TICKETS(PRI) ((PRI)-PRI_MIN + 1)
+
+/* Thread niceness, used by the MLFQS. */
+#define NICE_MIN -20   /* Least nice; favors the thread. */
+#define NICE_DEFAULT 0 /* Default niceness. */
+#define NICE_MAX 20    /* Nicest; yields to other threads. */
+
 /* A kernel thread or user process.
 
    Each thread structure is stored in its own 4 kB page.  The
@@ -77,27 +87,53 @@ typedef int tid_t;
    value, triggering the assertion. */
 /* The `elem' member has a dual purpose.  It can be an element in
    the run queue (thread.c), or it can be an element in a
-   semaphore wait list (synch.c).  It can be used these two ways
-   only because they are mutually exclusive: only a thread in the
-   ready state is on the run queue, whereas only a thread in the
-   blocked state is on a semaphore wait list. */
+   semaphore wait list (synch.c) or the sleep list (timer.c).  It
+   can be used these ways only because they are mutually
+   exclusive: only a thread in the ready state is on the run
+   queue, whereas only a thread in the blocked state is on a
+   semaphore wait list or the sleep list, and never both. */
 struct thread {
   /* Owned by thread.c. */
   tid_t tid;                 /* Thread identifier. */
   enum thread_status status; /* Thread state. */
   char name[16];             /* Name (for debugging purposes). */
   uint8_t* stack;            /* Saved stack pointer. */
-  int priority;              /* Priority. */
+  int priority;              /* Effective priority, including donations. */
+  int base_priority;         /* Priority before any donation. */
   struct list_elem allelem;  /* List element for all threads list. */
 
+  /* Owned by thread.c, used only by the MLFQS. */
+  int nice;                    /* Niceness. */
+  fixed_point_t recent_cpu;    /* Recent CPU usage. */
+  bool mlfqs_stale;            /* Priority needs recomputing? */
+  struct list_elem stale_elem; /* List element for stale threads list. */
+
+  /* Owned by thread.c, used only by the fair scheduler. */
+  int64_t pass;              /* Virtual time consumed; lowest runs next. */
+  struct thread* heap_left;  /* Left child in the ready heap. */
+  struct thread* heap_right; /* Right child in the ready heap. */
+  int heap_rank;             /* Length of shortest path to a leaf. */
+
+  /* Owned by devices/timer.c. */
+  int64_t wakeup_tick; /* Tick at which a sleeping thread wakes. */
+
   /* Shared between thread.c and synch.c. */
-  struct list_elem elem; /* List element. */
+  struct list_elem elem;          /* List element. */
+  struct semaphore* waiting_sema; /* Semaphore we are blocked on, if any. */
+  struct lock* waiting_lock;      /* Lock we are trying to acquire, if any. */
+  struct list held_locks;         /* Locks we hold, for priority donation. */
 
 #ifdef USERPROG
   /* Owned by process.c. */
   struct process* pcb; /* Process control block if this thread is a userprog */
 #endif
 
+#ifdef FILESYS
+  /* Owned by filesys/journal.c. */
+  int journal_depth;   /* Number of journal handles open. */
+  int journal_credits; /* Sectors the open handle may still log. */
+#endif
+
   /* Owned by thread.c. */
   unsigned magic; /* Detects stack overflow. */
 };
@@ -136,6 +172,7 @@ const char* thread_name(void);
 
 void thread_exit(void) NO_RETURN;
 void thread_yield(void);
+void thread_preempt(void);
 
 /* Performs some operation on thread t, given auxiliary data AUX. */
 typedef void thread_action_func(struct thread* t, void* aux);
@@ -143,6 +180,8 @@ void thread_foreach(thread_action_func*, void*);
 
 int thread_get_priority(void);
 void thread_set_priority(int);
+void thread_donate_priority(struct thread*, int priority);
+void thread_refresh_priority(struct thread*);
 
 int thread_get_nice(void);
 void thread_set_nice(int);
@@ -16,11 +16,13 @@
 #include "threads/interrupt.h"
 #include "threads/malloc.h"
 #include "threads/palloc.h"
+#include "threads/slab.h"
 #include "threads/synch.h"
 #include "threads/thread.h"
 #include "threads/vaddr.h"
 
 static struct semaphore temporary;
+static struct kmem_cache* pcb_cache;
 static thread_func start_process NO_RETURN;
 static thread_func start_pthread NO_RETURN;
 static bool load(const char* file_name, void (**eip)(void), void** esp);
@@ -34,13 +36,19 @@ void userprog_init(void) {
   struct thread* t = thread_current();
   bool success;
 
+  pcb_cache = kmem_cache_create("pcb", sizeof(struct process), NULL);
+
   /* Allocate process control block
-     It is imoprtant that this is a call to calloc and not malloc,
+     It is imoprtant that the PCB is zeroed before it is assigned,
      so that t->pcb->pagedir is guaranteed to be NULL (the kernel's
      page directory) when t->pcb is assigned, because a timer interrupt
      can come at any time and activate our pagedir */
-  t->pcb = calloc(sizeof(struct process), 1);
-  success = t->pcb != NULL;
+  struct process* pcb = kmem_cache_alloc(pcb_cache);
+  success = pcb != NULL;
+  if (success) {
+    memset(pcb, 0, sizeof *pcb);
+    t->pcb = pcb;
+  }
 
   /* Kill the kernel if we did not succeed */
   ASSERT(success);
@@ -78,7 +86,7 @@ static void start_process(void* file_name_) {
   bool success, pcb_success;
 
   /* Allocate process control block */
-  struct process* new_pcb = malloc(sizeof(struct process));
+  struct process* new_pcb = kmem_cache_alloc(pcb_cache);
   success = pcb_success = new_pcb != NULL;
 
   /* Initialize process control block */
@@ -109,7 +117,7 @@ static void start_process(void* file_name_) {
     // can try to activate the pagedir, but it is now freed memory
     struct process* pcb_to_free = t->pcb;
     t->pcb = NULL;
-    free(pcb_to_free);
+    kmem_cache_free(pcb_cache, pcb_to_free);
   }
 
   /* Clean up. Exit on failure or jump to userspace */
@@ -176,7 +184,7 @@ void process_exit(void) {
      can try to activate the pagedir, but it is now freed memory */
   struct process* pcb_to_free = cur->pcb;
   cur->pcb = NULL;
-  free(pcb_to_free);
+  kmem_cache_free(pcb_cache, pcb_to_free);
 
   sema_up(&temporary);
   thread_exit();